@@ -5,11 +5,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
-#include <dirent.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <math.h>
+#include <inttypes.h>
+#include <sys/file.h>
 
 #include "rain.h"
 
@@ -17,6 +19,12 @@
 #define DROPLET_FMT_6 0x36
 #define DROPLET_FMT_7 0x37
 #define DROPLET_FMT_8 0x38
+#define DROPLET_FMT_LZ 0x7a
+#define DROPLET_FMT_SOLID 0x73
+#define DROPLET_FMT_REF 0x72
+#define DROPLET_FMT_CHUNK 0x6b
+#define DROPLET_FMT_CHUNK_MAP 0x6d
+#define DROPLET_FMT_SPARSE 0x70
 #define MAGIC_NUMBER_BYTES 1
 #define DROPLET_FORMAT_BYTES 1
 #define PERMISSIONS_BYTES 10
@@ -27,103 +35,121 @@
 #define FORMAT_7_BYTES 7
 #define FORMAT_8_BYTES 8
 #define FORMAT_6_BYTES 6
+#define CHECK_BATCH_DROPLETS 4096
+#define CHECK_BATCH_BYTES (16 * 1024 * 1024)
+#define EXTRACT_DROPLETS_PER_THREAD 16
+
+// the droplets of a check batch to verify against their checksums
+struct checksum_batch {
+    struct drop_checksums *checksums;
+    struct droplet_header *headers;
+    const uint8_t **droplets;
+    int64_t *bad_offsets;
+};
+
+// a droplet of an extract batch
+struct extract_item {
+    uint8_t calculated_hash;
+    uint8_t stored_hash;
+    bool directory_made;   /**< The directory was made while scanning. */
+    bool copied;           /**< The file's contents decoded correctly. */
+    FILE *output_stream;   /**< The temporary file, NULL once finished. */
+    char *temp_pathname;
+};
+
+// a file extracted earlier, which a reference droplet can refer to
+struct extracted_file {
+    off_t offset;          /**< Offset of its droplet. */
+    char *pathname;
+};
+
+struct extract_batch {
+    int fd;
+    struct droplet_header *headers;
+    struct extract_item *items;
+    struct extracted_file *extracted;  /**< In droplet order. */
+    size_t n_extracted;
+    size_t extracted_capacity;
+};
 
 uint8_t calculate_hash(long droplet_length, FILE *input_stream);
+bool check_lz_block_table(FILE *input_stream, long content_offset, uint64_t content_length);
+void verify_checksum_item(void *context, size_t item);
 mode_t convert_permissions_array(char *permissions);
 char *convert_permissions_to_array(mode_t mode);
-long create_drop_recursive(FILE *output_stream, int format, char *pathname, long amount_of_bytes);
-long create_directory_droplet(FILE *output_stream, int format, char *pathname, long amount_of_bytes);
-long create_file_droplet(FILE *output_stream, int format, char *pathname, long amount_of_bytes);
+FILE *open_temp_drop(char *drop_pathname);
+long create_droplets(FILE *output_stream, int format, int n_pathnames, char *pathnames[n_pathnames],
+    long amount_of_bytes);
+long create_drop_entries(FILE *output_stream, int format, char *pathname, long amount_of_bytes);
+long create_directory_droplet(FILE *output_stream, int format, char *pathname, struct stat *stats,
+    long amount_of_bytes);
+long create_file_droplet(FILE *output_stream, int format, char *pathname, struct stat *stats,
+    long amount_of_bytes);
 long create_drop_backwards(FILE *output_stream, int format, char *pathname, long amount_of_bytes);
-void extract_7_bits(FILE *input_stream, FILE *output_stream, uint64_t content_length);
-void extract_8_bits(FILE *input_stream, FILE *output_stream, uint64_t content_length);
-void extract_6_bits(FILE *input_stream, FILE *output_stream, uint64_t content_length);
-uint64_t create_file(char *pathname, mode_t mode, FILE *input_stream, uint8_t format, uint64_t content_length);
+void read_stored_hash(int input_fd, struct droplet_header *header, uint8_t *stored_hash);
+void extract_file_item(void *context, size_t item_index);
+bool finish_extract_item(FILE *input_stream, struct extract_batch *batch, struct droplet_header *header,
+    struct extract_item *item);
+void record_extracted_file(struct extract_batch *batch, struct droplet_header *header);
+void extract_reference(struct extract_batch *batch, struct droplet_header *header, mode_t mode);
+bool copy_extracted_file(char *target_pathname, char *pathname, mode_t mode, uint64_t length);
+long create_reference_droplet(FILE *output_stream, int format, char *pathname, struct stat *stats,
+    long amount_of_bytes);
 void create_directory(char *pathname, mode_t mode);
-int fgetc_with_EOF_checking(FILE *input_stream);
+void make_directory(char *pathname, mode_t mode);
 
 
 // print the files & directories stored in drop_pathname (subset 0)
 // if long_listing is non-zero then file/directory permissions, formats & sizes 
 // are also printed (subset 0)
+// the listing goes to output_stream, and a drop which can not be opened
+// or scanned is reported on error_stream; returns true if all of the
+// drop was listed
 
-void list_drop(char *drop_pathname, int long_listing) {
+bool list_drop(char *drop_pathname, int long_listing, FILE *output_stream, FILE *error_stream) {
     FILE *input_stream = fopen(drop_pathname, "rb");
     if (input_stream == NULL) {
-        perror(drop_pathname);
-        exit(1);
+        fprintf(error_stream, "%s: %s\n", drop_pathname, strerror(errno));
+        return false;
+    }
+    int input_fd = fileno(input_stream);
+    off_t drop_size = settled_drop_size(input_fd);
+    if (drop_size < 0) {
+        fprintf(error_stream, "%s: %s\n", drop_pathname, strerror(errno));
+        fclose(input_stream);
+        return false;
     }
-    int byte;
-    long amount_of_bytes = 0;
-    while ((byte = fgetc(input_stream)) != EOF) {
-        // on 2nd byte
-
-        byte = fgetc_with_EOF_checking(input_stream);
-        uint8_t format = byte;
-        
-        char permissions[PERMISSIONS_BYTES + 1];
-        for (int i = 0; i < PERMISSIONS_BYTES; i++) {
-            permissions[i] = fgetc_with_EOF_checking(input_stream);
-        }
-        permissions[PERMISSIONS_BYTES] = '\0';
-
-        byte = fgetc_with_EOF_checking(input_stream);  
-        int byte2 = fgetc_with_EOF_checking(input_stream);  
-        // access 2 bytes as a single uint16_t value
-        // little endian
-        uint16_t pathname_length = (byte2 << BYTE_SIZE) | byte;
-
-        char pathname[pathname_length + 1];
-        for (int i = 0; i < pathname_length; i++) {
-            pathname[i] = fgetc_with_EOF_checking(input_stream);
-        }
-        pathname[pathname_length] = '\0';
-
-
-        // get content length
-        uint64_t content_length = 0;
-        // Read 6 bytes from input stream
-        for (int i = 0; i < CONTENT_LENGTH_BYTES; i++) {
-            byte = fgetc_with_EOF_checking(input_stream);
-            content_length |= ((uint64_t)byte << (i * BYTE_SIZE));
-        }
 
-        // print to stdout
-        if (long_listing) {
-            printf("%s  %c  %5lu  %s\n", permissions, format, content_length, pathname);
+    // only headers are read, the contents are skipped over
+    off_t offset = 0;
+    struct droplet_header header;
+    enum scan_result result;
+    bool listed = true;
+    while ((result = read_droplet_header_any_magic(input_fd, offset, drop_size, &header)) == SCAN_OK) {
+        if (header.format == DROPLET_FMT_SOLID) {
+            // the droplets after a corrupt solid block are still listed
+            fseek(input_stream, header.content_offset, SEEK_SET);
+            listed &= list_solid_block(input_stream, header.content_length, long_listing, output_stream,
+                error_stream);
+        } else if (header.format == DROPLET_FMT_CHUNK) {
+            // chunks are only listed as part of the files they make up
+        } else if (long_listing) {
+            fprintf(output_stream, "%s  %c  %5lu  %s\n", header.mode, header.format,
+                header.content_length, header.pathname);
         } else {
-            printf("%s\n", pathname);
-        }
-
-        // account for format
-        if (format == DROPLET_FMT_7) {
-            content_length = (uint64_t) ceil(((double)FORMAT_7_BYTES / 
-                (double)FORMAT_8_BYTES) * (double) content_length);
-        } else if (format == DROPLET_FMT_6) {
-            content_length = (uint64_t) ceil(((double)FORMAT_6_BYTES / 
-                (double)FORMAT_8_BYTES) * (double) content_length);
-        }
-
-        // error check unchecked bytes
-        for (int i = 0; i < (content_length + HASH_BYTES); i++) {
-            fgetc_with_EOF_checking(input_stream);
+            fprintf(output_stream, "%s\n", header.pathname);
         }
-
-        // add altogether to change amount of bytes
-        // so the processs can repeat until EOF is found
-        amount_of_bytes = amount_of_bytes + MAGIC_NUMBER_BYTES + 
-            DROPLET_FORMAT_BYTES + 
-            PERMISSIONS_BYTES + PATHNAME_LENGTH_BYTES + pathname_length +
-            CONTENT_LENGTH_BYTES +
-            content_length + HASH_BYTES;
-        
-        // go to next droplet
-        fseek(input_stream, amount_of_bytes, SEEK_SET);
+        offset += header.length;
+        free(header.pathname);
+    }
+    if (result != SCAN_END) {
+        print_scan_error(error_stream, result, &header);
     }
     if (fclose(input_stream) != 0) {
         fprintf(stderr, "error: problem encounted with fclose\n");
         exit(1);
     }
+    return listed && result == SCAN_END;
 }
 
 
@@ -132,235 +158,624 @@ void list_drop(char *drop_pathname, int long_listing) {
 // either, indicating the hash byte is correct, or
 // indicating the hash byte is incorrect, what the incorrect value is and the 
 // correct value would be
-
-void check_drop(char *drop_pathname) {
-    // check the first byte of the droplet for c if its not  eof
+// if options has CHECK_INCREMENTAL, droplets before the watermark of an
+// earlier such check which found every droplet correct are not checked
+// again, unless options has CHECK_FULL, and the watermark is moved on
+// results go to output_stream, and a drop which can not be opened or
+// scanned is reported on error_stream, so many drops can be checked at
+// once; returns true if every droplet is correct
+
+bool check_drop(char *drop_pathname, int options, FILE *output_stream, FILE *error_stream) {
     FILE *input_stream = fopen(drop_pathname, "rb");
     if (input_stream == NULL) {
-        perror(drop_pathname);
-        exit(1);
+        fprintf(error_stream, "%s: %s\n", drop_pathname, strerror(errno));
+        return false;
+    }
+    int input_fd = fileno(input_stream);
+    off_t drop_size = settled_drop_size(input_fd);
+    if (drop_size < 0) {
+        fprintf(error_stream, "%s: %s\n", drop_pathname, strerror(errno));
+        fclose(input_stream);
+        return false;
     }
 
-    int byte;
-    long amount_of_bytes = 0;
-    while ((byte = fgetc(input_stream)) != EOF) {
-        // on 2nd byte
-        // check byte 1 to see if 0x63 (magic number)
-        if (byte != VALID_MAGIC_NUMBER) {
-            fprintf(stderr, "error: incorrect first droplet byte: 0x%02x should be 0x63\n", byte);
-            exit(1);
+    // droplets are checked a batch at a time: their headers are scanned,
+    // the whole batch is read at once and hashed on every thread
+    struct droplet_header *headers = malloc(CHECK_BATCH_DROPLETS * sizeof *headers);
+    const uint8_t **droplets = malloc(CHECK_BATCH_DROPLETS * sizeof *droplets);
+    size_t *droplet_lengths = malloc(CHECK_BATCH_DROPLETS * sizeof *droplet_lengths);
+    uint8_t *calculated_hashes = malloc(CHECK_BATCH_DROPLETS);
+    int64_t *bad_offsets = malloc(CHECK_BATCH_DROPLETS * sizeof *bad_offsets);
+    uint8_t *batch = malloc(CHECK_BATCH_BYTES);
+    struct checksum_batch checksum_batch = {
+        .checksums = load_checksums(drop_pathname),
+        .headers = headers,
+        .droplets = droplets,
+        .bad_offsets = bad_offsets,
+    };
+
+    struct check_watermark watermark = { .offset = 0, .n_droplets = 0 };
+    struct check_watermark previous;
+    sha256_init(&watermark.prefix_digest);
+    enum watermark_result watermark_result = WATERMARK_NONE;
+    if (options & CHECK_INCREMENTAL) {
+        watermark_result = load_watermark(drop_pathname, input_fd, drop_size, &previous);
+    }
+    if (watermark_result == WATERMARK_STALE) {
+        fprintf(output_stream, "%s has changed since it was last checked, checking all of it\n", drop_pathname);
+    } else if (watermark_result == WATERMARK_VALID && !(options & CHECK_FULL)) {
+        watermark = previous;
+        fprintf(output_stream, "%zu droplets to byte %jd correct when last checked\n",
+            watermark.n_droplets, (intmax_t)watermark.offset);
+    }
+    // a full check makes sure the droplets before the old watermark
+    // still have the SHA-256 they had then
+    struct check_watermark *compare_with = watermark_result == WATERMARK_VALID &&
+        (options & CHECK_FULL) ? &previous : NULL;
+    bool prefix_matches = true;
+    bool all_correct = true;
+
+    off_t offset = watermark.offset;
+    size_t n_droplets;
+    enum scan_result result;
+    do {
+        off_t batch_offset = offset;
+        n_droplets = 0;
+        while ((result = read_droplet_header(input_fd, offset, drop_size,
+                    &headers[n_droplets])) == SCAN_OK) {
+            uint64_t droplet_length = headers[n_droplets].length;
+            if (n_droplets > 0 && offset - batch_offset + droplet_length > CHECK_BATCH_BYTES) {
+                // this droplet starts the next batch
+                free(headers[n_droplets].pathname);
+                break;
+            }
+            offset += droplet_length;
+            n_droplets++;
+            if (n_droplets == CHECK_BATCH_DROPLETS || droplet_length > CHECK_BATCH_BYTES) {
+                break;
+            }
         }
 
-        // check format
-        byte = fgetc_with_EOF_checking(input_stream);
-        uint8_t format = byte;
-        if (!(format == DROPLET_FMT_6 || format == DROPLET_FMT_7 || format == DROPLET_FMT_8)) {
-            fprintf(stderr, "error: droplet format is wrong\n");
-            exit(1);
-        }
-        
-        // error check unchecked bytes
-        for (int i = 0; i < PERMISSIONS_BYTES; i++) {
-            fgetc_with_EOF_checking(input_stream);
+        uint8_t *stored_hashes = calculated_hashes;
+        if (n_droplets == 1 && headers[0].length > CHECK_BATCH_BYTES) {
+            // too big to read at once
+            off_t hash_offset = headers[0].offset + headers[0].length - HASH_BYTES;
+            calculated_hashes[0] = droplet_hash_range(input_fd, headers[0].offset,
+                headers[0].length - HASH_BYTES);
+            struct droplet_checksum *checksum = find_checksum(checksum_batch.checksums, headers[0].offset);
+            bad_offsets[0] = checksum == NULL ? -1 :
+                verify_droplet_checksum_range(input_fd, checksum_batch.checksums, checksum, headers[0].length);
+            if (pread(input_fd, batch, HASH_BYTES, hash_offset) != HASH_BYTES) {
+                perror("partially created droplet/EOF found");
+                exit(1);
+            }
+            stored_hashes = batch;
+            prefix_matches &= advance_watermark(&watermark, compare_with, input_fd, NULL, headers[0].length);
+        } else if (n_droplets > 0) {
+            size_t batch_length = offset - batch_offset;
+            if (pread(input_fd, batch, batch_length, batch_offset) != (ssize_t)batch_length) {
+                perror("partially created droplet/EOF found");
+                exit(1);
+            }
+            for (size_t i = 0; i < n_droplets; i++) {
+                droplets[i] = batch + (headers[i].offset - batch_offset);
+                droplet_lengths[i] = headers[i].length - HASH_BYTES;
+            }
+            droplet_hash_many(n_droplets, droplets, droplet_lengths, calculated_hashes);
+            stored_hashes = NULL;
+            prefix_matches &= advance_watermark(&watermark, compare_with, input_fd, batch, batch_length);
+            if (checksum_batch.checksums != NULL) {
+                parallel_for(n_droplets, verify_checksum_item, &checksum_batch);
+            } else {
+                memset(bad_offsets, 0xff, n_droplets * sizeof *bad_offsets);
+            }
         }
 
-        byte = fgetc_with_EOF_checking(input_stream);  
-        int byte2 = fgetc_with_EOF_checking(input_stream);  
-        // access 2 bytes as a single uint16_t value
-        // little endian
-        uint16_t pathname_length = (byte2 << BYTE_SIZE) | byte;
-        
-        char pathname[pathname_length + 1];
-        for (int i = 0; i < pathname_length; i++) {
-            pathname[i] = fgetc_with_EOF_checking(input_stream);
-        }
-        pathname[pathname_length] = '\0';
-
-        // get content length
-        uint64_t content_length = 0;
-        // Read 6 bytes from input stream
-        for (int i = 0; i < CONTENT_LENGTH_BYTES; i++) {
-            byte = fgetc_with_EOF_checking(input_stream);
-            content_length |= ((uint64_t)byte << (i * BYTE_SIZE));
+        for (size_t i = 0; i < n_droplets; i++) {
+            uint8_t stored_hash = stored_hashes ? stored_hashes[i] : droplets[i][droplet_lengths[i]];
+            int64_t bad_offset = bad_offsets[i] < 0 ? -1 : headers[i].offset + bad_offsets[i];
+            all_correct &= check_droplet_result(input_stream, &headers[i],
+                calculated_hashes[i], stored_hash, bad_offset, output_stream);
+            free(headers[i].pathname);
         }
+        watermark.n_droplets += n_droplets;
+    } while (result == SCAN_OK);
 
-        // account for format
-        if (format == DROPLET_FMT_7) {
-            content_length = (uint64_t) ceil(((double)FORMAT_7_BYTES / 
-                (double)FORMAT_8_BYTES) * (double) content_length);
-        } else if (format == DROPLET_FMT_6) {
-            content_length = (uint64_t) ceil(((double)FORMAT_6_BYTES / 
-                (double)FORMAT_8_BYTES) * (double) content_length);
+    if (result != SCAN_END) {
+        print_scan_error(error_stream, result, &headers[n_droplets]);
+        all_correct = false;
+    }
+    if (!prefix_matches) {
+        fprintf(output_stream, "%s - bytes before %jd have changed since they were last checked\n",
+            drop_pathname, (intmax_t)previous.offset);
+    }
+    if ((options & CHECK_INCREMENTAL) && all_correct && prefix_matches &&
+        (watermark_result != WATERMARK_VALID || watermark.offset != previous.offset || (options & CHECK_FULL))) {
+        save_watermark(drop_pathname, input_fd, &watermark);
+    }
+    free(headers);
+    free(droplets);
+    free(droplet_lengths);
+    free(calculated_hashes);
+    free(bad_offsets);
+    free(batch);
+    free_checksums(checksum_batch.checksums);
+    if (fclose(input_stream) != 0) {
+        fprintf(stderr, "error: problem encounted with fclose\n");
+        exit(1);
+    }
+    return all_correct && prefix_matches;
+}
+
+// checks the droplets of a check batch which have a recorded checksum
+void verify_checksum_item(void *context, size_t item) {
+    struct checksum_batch *batch = context;
+    struct droplet_checksum *checksum = find_checksum(batch->checksums, batch->headers[item].offset);
+    batch->bad_offsets[item] = checksum == NULL ? -1 : verify_droplet_checksum(batch->checksums,
+        checksum, batch->droplets[item], batch->headers[item].length);
+}
+
+// prints the result of checking one droplet to output_stream
+// bad_offset is where the first block failing its checksum starts, or -1
+// returns true if the droplet is correct
+bool check_droplet_result(FILE *input_stream, struct droplet_header *header,
+    uint8_t calculated_hash, uint8_t stored_hash, int64_t bad_offset, FILE *output_stream) {
+    char checksum_result[64] = "";
+    if (bad_offset >= 0) {
+        snprintf(checksum_result, sizeof checksum_result,
+            ", bad checksum from byte %" PRId64, bad_offset);
+    }
+    if (header->format == DROPLET_FMT_SOLID) {
+        char result[128] = "correct hash";
+        if (calculated_hash != stored_hash) {
+            snprintf(result, sizeof result, "incorrect hash 0x%02x should be 0x%02x%s",
+                calculated_hash, stored_hash, checksum_result);
+        } else if (bad_offset >= 0) {
+            snprintf(result, sizeof result, "incorrect checksum from byte %" PRId64, bad_offset);
         }
+        check_solid_block(input_stream, header->content_offset, header->content_length, result, output_stream);
+        return calculated_hash == stored_hash && bad_offset < 0;
+    } else if (calculated_hash != stored_hash) {
+        fprintf(output_stream, "%s%s - incorrect hash 0x%02x should be 0x%02x%s\n",
+            header->format == DROPLET_FMT_CHUNK ? "chunk " : "", header->pathname,
+            calculated_hash, stored_hash, checksum_result);
+    } else if (bad_offset >= 0) {
+        fprintf(output_stream, "%s%s - incorrect checksum from byte %" PRId64 "\n",
+            header->format == DROPLET_FMT_CHUNK ? "chunk " : "", header->pathname, bad_offset);
+    } else if (header->format == DROPLET_FMT_LZ && header->content_length > 0 &&
+        !check_lz_block_table(input_stream, header->content_offset, header->content_length)) {
+        fprintf(output_stream, "%s - incorrect block table\n", header->pathname);
+    } else if (header->format == DROPLET_FMT_REF && !reference_target_valid(fileno(input_stream), header)) {
+        fprintf(output_stream, "%s - incorrect reference\n", header->pathname);
+    } else if (header->format == DROPLET_FMT_CHUNK_MAP && !chunk_map_valid(fileno(input_stream), header)) {
+        fprintf(output_stream, "%s - incorrect chunks\n", header->pathname);
+    } else if (header->format == DROPLET_FMT_SPARSE && !sparse_extents_valid(fileno(input_stream), header)) {
+        fprintf(output_stream, "%s - incorrect extent table\n", header->pathname);
+    } else if (header->format == DROPLET_FMT_CHUNK) {
+        // a correct chunk goes without saying, its files are reported
+        return true;
+    } else {
+        fprintf(output_stream, "%s - correct hash\n", header->pathname);
+        return true;
+    }
+    return false;
+}
 
-        // go back to the start and check the hashing now
-        fseek(input_stream, amount_of_bytes, SEEK_SET);
 
-        long droplet_length = MAGIC_NUMBER_BYTES + DROPLET_FORMAT_BYTES + 
-            PERMISSIONS_BYTES + PATHNAME_LENGTH_BYTES + pathname_length + 
-            CONTENT_LENGTH_BYTES +
-            content_length + HASH_BYTES;
+// the bad_hash_policy given to the current extract_drop call on this
+// thread, so many drops can be extracted at once
+static _Thread_local enum bad_hash_policy bad_hash_policy;
+// set once a droplet with an incorrect hash has been found
+static _Thread_local bool bad_hash_found;
+// where the current extract_drop call prints what it extracts & errors
+static _Thread_local FILE *extract_output_stream;
+static _Thread_local FILE *extract_error_stream;
 
-        amount_of_bytes = amount_of_bytes + droplet_length;
+// extract the files/directories stored in drop_pathname (subset 2 & 3)
+// each droplet's hash is checked as it is extracted, files are written
+// under a temporary name and only moved into place if the hash matches
+// policy says what happens to droplets with an incorrect hash
+// what is extracted is printed on output_stream, bad hashes and a drop
+// which can not be opened or scanned are reported on error_stream
+// returns true if every droplet was extracted with a correct hash
+//
+// droplets are extracted a batch at a time: headers are scanned, the
+// batch's directories are made, then its files are decoded on every
+// thread, each into its temporary file.  Files are moved into place and
+// messages printed in droplet order, so the result is the same as
+// extracting one droplet at a time, except that an abort can leave
+// directories made from later in its batch.  Solid blocks are extracted
+// on their own.
+bool extract_drop(char *drop_pathname, enum bad_hash_policy policy, FILE *output_stream, FILE *error_stream) {
+    FILE *input_stream = fopen(drop_pathname, "rb");
+    if (input_stream == NULL) {
+        fprintf(error_stream, "%s: %s\n", drop_pathname, strerror(errno));
+        return false;
+    }
+    bad_hash_policy = policy;
+    bad_hash_found = false;
+    extract_output_stream = output_stream;
+    extract_error_stream = error_stream;
+    int input_fd = fileno(input_stream);
+    off_t drop_size = settled_drop_size(input_fd);
+    if (drop_size < 0) {
+        fprintf(error_stream, "%s: %s\n", drop_pathname, strerror(errno));
+        fclose(input_stream);
+        return false;
+    }
 
-        // check hash
-        uint8_t calculated_hash = calculate_hash(droplet_length - 1, input_stream);
-        byte = fgetc_with_EOF_checking(input_stream);
-        if (calculated_hash != byte) {
-            printf("%s - incorrect hash 0x%02x should be 0x%02x\n", 
-                pathname, calculated_hash, byte);
-        } else {
-            printf("%s - correct hash\n", pathname);
+    size_t batch_capacity = rain_thread_count() * EXTRACT_DROPLETS_PER_THREAD;
+    struct droplet_header *headers = malloc(batch_capacity * sizeof *headers);
+    struct extract_batch batch = {
+        .fd = input_fd,
+        .headers = headers,
+        .items = malloc(batch_capacity * sizeof *batch.items),
+    };
+
+    off_t offset = 0;
+    size_t n_droplets;
+    enum scan_result result = SCAN_OK;
+    bool aborted = false;
+    do {
+        n_droplets = 0;
+        while (n_droplets < batch_capacity &&
+            (result = read_droplet_header_any_magic(input_fd, offset, drop_size,
+                &headers[n_droplets])) == SCAN_OK) {
+            struct droplet_header *header = &headers[n_droplets];
+            struct extract_item *item = &batch.items[n_droplets];
+            item->output_stream = NULL;
+            item->directory_made = false;
+            // solid blocks and bad directories are batches of their own,
+            // so what comes after a bad directory is only extracted once
+            // the policy has said what to do with it
+            bool alone = header->format == DROPLET_FMT_SOLID;
+            if (!alone && (convert_permissions_array(header->mode) & S_IFDIR)) {
+                item->calculated_hash = droplet_hash_range(input_fd, header->offset, header->length - HASH_BYTES);
+                read_stored_hash(input_fd, header, &item->stored_hash);
+                alone = item->calculated_hash != item->stored_hash;
+                if (!alone) {
+                    make_directory(header->pathname, convert_permissions_array(header->mode));
+                    item->directory_made = true;
+                }
+            }
+            if (alone && n_droplets > 0) {
+                free(header->pathname);
+                break;
+            }
+            offset += header->length;
+            n_droplets++;
+            if (alone) {
+                break;
+            }
+        }
+
+        parallel_for(n_droplets, extract_file_item, &batch);
+
+        for (size_t i = 0; i < n_droplets && !aborted; i++) {
+            aborted = !finish_extract_item(input_stream, &batch, &headers[i], &batch.items[i]) ||
+                (bad_hash_found && bad_hash_policy == BAD_HASH_ABORT);
+            if (aborted) {
+                // throw away the rest of the batch
+                for (size_t j = i + 1; j < n_droplets; j++) {
+                    if (batch.items[j].output_stream != NULL) {
+                        finish_extract_file(batch.items[j].output_stream, batch.items[j].temp_pathname,
+                            headers[j].pathname, 0, false);
+                    }
+                }
+            }
+        }
+        for (size_t i = 0; i < n_droplets; i++) {
+            free(headers[i].pathname);
         }
+    } while (!aborted && result == SCAN_OK && n_droplets > 0);
 
-        // already at end of the drop
+    bool scanned = aborted || result == SCAN_OK || result == SCAN_END;
+    if (!scanned) {
+        print_scan_error(error_stream, result, &headers[n_droplets]);
     }
+    free(headers);
+    free(batch.items);
+    for (size_t i = 0; i < batch.n_extracted; i++) {
+        free(batch.extracted[i].pathname);
+    }
+    free(batch.extracted);
     if (fclose(input_stream) != 0) {
         fprintf(stderr, "error: problem encounted with fclose\n");
         exit(1);
     }
+    return scanned && !aborted && !bad_hash_found;
 }
 
-
-// extract the files/directories stored in drop_pathname (subset 2 & 3)
-void extract_drop(char *drop_pathname) {
-    FILE *input_stream = fopen(drop_pathname, "rb");
-    if (input_stream == NULL) {
-        perror(drop_pathname);
+// reads the last byte of a droplet, its stored hash
+void read_stored_hash(int input_fd, struct droplet_header *header, uint8_t *stored_hash) {
+    if (pread(input_fd, stored_hash, HASH_BYTES, header->offset + header->length - HASH_BYTES) != HASH_BYTES) {
+        perror("partially created droplet/EOF found");
         exit(1);
     }
-    int byte;
-    long amount_of_bytes = 0;
-
-    while ((byte = fgetc(input_stream)) != EOF) {
-        // on 2nd byte
-        byte = fgetc_with_EOF_checking(input_stream);
-        uint8_t format = byte;
-        
-        char permissions[PERMISSIONS_BYTES + 1];
-        for (int i = 0; i < PERMISSIONS_BYTES; i++) {
-            permissions[i] = fgetc_with_EOF_checking(input_stream);
+}
+
+// decodes a file droplet of an extract batch into a temporary file,
+// hashing it as it goes, or first if it is huge, on a worker thread
+// directories and solid blocks are left to finish_extract_item, as are
+// references once hashed; chunks are read as part of their files
+void extract_file_item(void *context, size_t item_index) {
+    struct extract_batch *batch = context;
+    struct droplet_header *header = &batch->headers[item_index];
+    struct extract_item *item = &batch->items[item_index];
+    if (header->format == DROPLET_FMT_SOLID || header->format == DROPLET_FMT_CHUNK ||
+        (convert_permissions_array(header->mode) & S_IFDIR)) {
+        return;
+    } else if (header->format == DROPLET_FMT_CHUNK_MAP) {
+        item->output_stream = open_extract_file(header->pathname, &item->temp_pathname);
+        item->copied = extract_chunked_file(batch->fd, header, item->output_stream, &item->calculated_hash);
+        read_stored_hash(batch->fd, header, &item->stored_hash);
+        return;
+    } else if (header->format == DROPLET_FMT_REF) {
+        item->calculated_hash = droplet_hash_range(batch->fd, header->offset, header->length - HASH_BYTES);
+        read_stored_hash(batch->fd, header, &item->stored_hash);
+        return;
+    }
+
+    // a huge droplet is hashed in chunks on the threads this item has,
+    // as check does, rather than a byte at a time as it is decoded
+    bool hash_apart = header->format != DROPLET_FMT_SPARSE &&
+        droplet_hash_range_parallel(header->length - HASH_BYTES);
+    if (hash_apart) {
+        item->calculated_hash = droplet_hash_range(batch->fd, header->offset, header->length - HASH_BYTES);
+    } else {
+        uint64_t header_length = header->content_offset - header->offset;
+        uint8_t *header_bytes = malloc(header_length);
+        if (pread(batch->fd, header_bytes, header_length, header->offset) != (ssize_t)header_length) {
+            perror("partially created droplet/EOF found");
+            exit(1);
         }
-        permissions[PERMISSIONS_BYTES] = '\0';
+        item->calculated_hash = droplet_hash_bytes(0, header_bytes, header_length);
+        free(header_bytes);
+    }
 
-        byte = fgetc_with_EOF_checking(input_stream);  
-        int byte2 = fgetc_with_EOF_checking(input_stream);  
-        // access 2 bytes as a single uint16_t value
-        // little endian
-        uint16_t pathname_length = (byte2 << BYTE_SIZE) | byte;
+    item->output_stream = open_extract_file(header->pathname, &item->temp_pathname);
+    if (header->format == DROPLET_FMT_SPARSE) {
+        item->copied = extract_sparse_file(batch->fd, header, fileno(item->output_stream), &item->calculated_hash);
+        read_stored_hash(batch->fd, header, &item->stored_hash);
+        return;
+    } else if (header->format != DROPLET_FMT_LZ && header->content_length >= PIPELINE_MIN_LENGTH) {
+        item->copied = pipeline_decode(batch->fd, header->content_offset, header->stored_length,
+            header->format, header->content_length, fileno(item->output_stream),
+            hash_apart ? NULL : &item->calculated_hash);
+        read_stored_hash(batch->fd, header, &item->stored_hash);
+        return;
+    }
+    FILE *input_stream = open_pread_stream(batch->fd, header->content_offset, header->stored_length);
+    FILE *content_stream = hash_apart ? input_stream :
+        open_hashing_stream(input_stream, header->stored_length, &item->calculated_hash);
+    item->copied = copy_droplet_content(content_stream, item->output_stream, header->format,
+        header->content_length);
+    if (content_stream != input_stream) {
+        fclose(content_stream);
+    }
+    fclose(input_stream);
+    read_stored_hash(batch->fd, header, &item->stored_hash);
+}
 
-        char pathname[pathname_length + 1];
-        for (int i = 0; i < pathname_length; i++) {
-            pathname[i] = fgetc_with_EOF_checking(input_stream);
+// finishes extracting one droplet of a batch in droplet order: prints
+// what was extracted, reports a bad hash and moves a file into place
+// returns false if the droplet's contents are corrupt
+bool finish_extract_item(FILE *input_stream, struct extract_batch *batch, struct droplet_header *header,
+    struct extract_item *item) {
+    mode_t mode = convert_permissions_array(header->mode);
+    if (header->format == DROPLET_FMT_CHUNK) {
+        return true;
+    } else if (header->format == DROPLET_FMT_SOLID) {
+        fseek(input_stream, header->offset, SEEK_SET);
+        uint8_t hash = calculate_hash(header->content_offset - header->offset, input_stream);
+        return extract_solid_block(input_stream, header->content_length, hash, extract_output_stream,
+            extract_error_stream);
+    } else if (mode & S_IFDIR) {
+        if (item->directory_made) {
+            fprintf(extract_output_stream, "Creating directory: %s\n", header->pathname);
+        } else if (droplet_hash_verified(header->pathname, item->calculated_hash, item->stored_hash)) {
+            create_directory(header->pathname, mode);
         }
-        pathname[pathname_length] = '\0';
-
-        // get content length
-        uint64_t content_length = 0;
-        // Read 6 bytes from input stream
-        for (int i = 0; i < CONTENT_LENGTH_BYTES; i++) {
-            byte = fgetc_with_EOF_checking(input_stream);
-            content_length |= ((uint64_t)byte << (i * BYTE_SIZE));
+    } else if (header->format == DROPLET_FMT_REF) {
+        fprintf(extract_output_stream, "Extracting: %s\n", header->pathname);
+        if (droplet_hash_verified(header->pathname, item->calculated_hash, item->stored_hash)) {
+            extract_reference(batch, header, mode);
         }
-
-        // check if file or directory
-        mode_t mode = convert_permissions_array(permissions);
-        if (mode & S_IFDIR) {
-            create_directory(pathname, mode);
-            // add altogether to change amount of bytes
-            // so the processs can repeat until EOF is found
-
-            amount_of_bytes = amount_of_bytes + MAGIC_NUMBER_BYTES + 
-                DROPLET_FORMAT_BYTES + 
-                PERMISSIONS_BYTES + PATHNAME_LENGTH_BYTES + pathname_length + 
-                CONTENT_LENGTH_BYTES +
-                content_length + HASH_BYTES;
-            
-            // go to next droplet
-            fseek(input_stream, amount_of_bytes, SEEK_SET);
-        } else {
-            content_length = create_file(pathname, mode, input_stream, format, content_length);
-            // add altogether to change amount of bytes
-            // so the processs can repeat until EOF is found
-            amount_of_bytes = amount_of_bytes + MAGIC_NUMBER_BYTES + 
-            DROPLET_FORMAT_BYTES + 
-            PERMISSIONS_BYTES + PATHNAME_LENGTH_BYTES + pathname_length + 
-            CONTENT_LENGTH_BYTES +
-            content_length + HASH_BYTES;
-            
-            // go to next droplet
-            fseek(input_stream, amount_of_bytes, SEEK_SET);
+    } else {
+        fprintf(extract_output_stream, "Extracting: %s\n", header->pathname);
+        bool keep = droplet_hash_verified(header->pathname, item->calculated_hash, item->stored_hash);
+        bool corrupt = keep && !item->copied;
+        if (corrupt) {
+            fprintf(extract_error_stream, "error: droplet contents are corrupt\n");
         }
-
-        // check the hash byte for EOF
-        fseek(input_stream, -1, SEEK_CUR);
-        fgetc_with_EOF_checking(input_stream);
+        finish_extract_file(item->output_stream, item->temp_pathname, header->pathname, mode, keep && !corrupt);
+        item->output_stream = NULL;
+        if (keep && !corrupt) {
+            record_extracted_file(batch, header);
+        }
+        return !corrupt;
     }
+    return true;
+}
 
-    if (fclose(input_stream) != 0) {
-        fprintf(stderr, "error: problem encounted with fclose\n");
-        exit(1);
+// remembers a file just extracted, if a reference droplet could refer to it
+void record_extracted_file(struct extract_batch *batch, struct droplet_header *header) {
+    if (header->content_length < REFERENCE_MIN_LENGTH) {
+        return;
     }
+    if (batch->n_extracted == batch->extracted_capacity) {
+        batch->extracted_capacity = batch->extracted_capacity == 0 ? 256 : batch->extracted_capacity * 2;
+        batch->extracted = realloc(batch->extracted, batch->extracted_capacity * sizeof *batch->extracted);
+    }
+    batch->extracted[batch->n_extracted].offset = header->offset;
+    batch->extracted[batch->n_extracted].pathname = strdup(header->pathname);
+    batch->n_extracted++;
 }
 
-// tries to create direcotry and/or set permissions
-void create_directory(char *pathname, mode_t mode) {
-    printf("Creating directory: %s\n", pathname);
-    if (mkdir(pathname, mode) != 0) {
-        if (errno == EEXIST) {
-            // Directory exists 
-            if (chmod(pathname, mode) != 0) {
-                perror(pathname);
-                exit(1);
+// extracts a reference droplet as a hardlink to, or a copy of, the file
+// extracted from the droplet it refers to
+// a reference to a file which was not extracted is reported like a bad
+// hash
+void extract_reference(struct extract_batch *batch, struct droplet_header *header, mode_t mode) {
+    char kind;
+    off_t target_offset;
+    struct extracted_file *target = NULL;
+    if (read_reference(batch->fd, header, &kind, &target_offset)) {
+        // files are recorded in droplet order, so by increasing offset
+        size_t low = 0, high = batch->n_extracted;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (batch->extracted[middle].offset < target_offset) {
+                low = middle + 1;
+            } else {
+                high = middle;
             }
         }
-        else {
-            perror(pathname);
+        if (low < batch->n_extracted && batch->extracted[low].offset == target_offset) {
+            target = &batch->extracted[low];
+        }
+    }
+    if (target == NULL) {
+        fprintf(extract_error_stream, "error: %s - refers to a file which was not extracted\n", header->pathname);
+        bad_hash_found = true;
+        return;
+    }
+
+    if (kind == REFERENCE_HARDLINK) {
+        if (unlink(header->pathname) != 0 && errno != ENOENT) {
+            perror(header->pathname);
             exit(1);
         }
+        if (link(target->pathname, header->pathname) == 0) {
+            record_extracted_file(batch, header);
+            return;
+        }
+        // file systems without hardlinks get a copy
+    }
+    if (!copy_extracted_file(target->pathname, header->pathname, mode, header->content_length)) {
+        fprintf(extract_error_stream, "error: %s - %s changed while being copied\n", header->pathname,
+            target->pathname);
+        bad_hash_found = true;
+        return;
     }
+    // a hardlink to a file stored as a copy refers to the copy
+    record_extracted_file(batch, header);
 }
 
-// creates file of specified format with specified permissions
-uint64_t create_file(char *pathname, mode_t mode, FILE *input_stream, uint8_t format, uint64_t content_length) {
-    printf("Extracting: %s\n", pathname); 
-    // up to content section on input stream
-    // open output stream
-    FILE *output_stream = fopen(pathname, "w"); 
-    if (output_stream == NULL) {
-        perror(pathname);
+// copies the length bytes of the file extracted at target_pathname to pathname
+// returns false if it is not that long any more
+bool copy_extracted_file(char *target_pathname, char *pathname, mode_t mode, uint64_t length) {
+    int input_fd = open(target_pathname, O_RDONLY);
+    if (input_fd < 0) {
+        perror(target_pathname);
         exit(1);
     }
+    char *temp_pathname;
+    FILE *output_stream = open_extract_file(pathname, &temp_pathname);
+    bool copied = copy_file_bytes(input_fd, 0, fileno(output_stream), 0, length);
+    close(input_fd);
+    finish_extract_file(output_stream, temp_pathname, pathname, mode, copied);
+    return copied;
+}
 
-    // set permissions
-    if (chmod(pathname, mode) != 0) {
-        perror(pathname);
-        exit(1);
+// reports a droplet whose hash is incorrect, according to the policy
+// returns true if the droplet should be extracted
+bool droplet_hash_verified(char *name, uint8_t calculated_hash, uint8_t stored_hash) {
+    if (calculated_hash == stored_hash) {
+        return true;
     }
-    
-    // account for format
-    if (format == DROPLET_FMT_7) {
-        extract_7_bits(input_stream, output_stream, content_length);
-        content_length = (uint64_t) ceil(((double)FORMAT_7_BYTES / 
-            (double)FORMAT_8_BYTES) * (double) content_length);
-    } else if (format == DROPLET_FMT_6) {
-        extract_6_bits(input_stream, output_stream, content_length);
-        content_length = (uint64_t) ceil(((double)FORMAT_6_BYTES / 
-            (double)FORMAT_8_BYTES) * (double) content_length);
-    } else if (format == DROPLET_FMT_8) {
-        extract_8_bits(input_stream, output_stream, content_length);
+    bad_hash_found = true;
+    if (bad_hash_policy == BAD_HASH_KEEP) {
+        fprintf(extract_error_stream, "warning: %s - incorrect hash 0x%02x should be 0x%02x, extracted anyway\n",
+            name, calculated_hash, stored_hash);
+        return true;
+    } else if (bad_hash_policy == BAD_HASH_SKIP) {
+        fprintf(extract_error_stream, "error: %s - incorrect hash 0x%02x should be 0x%02x, not extracted\n",
+            name, calculated_hash, stored_hash);
     } else {
-        perror("invalid fomrat type");
+        fprintf(extract_error_stream, "error: %s - incorrect hash 0x%02x should be 0x%02x\n",
+            name, calculated_hash, stored_hash);
+    }
+    return false;
+}
+
+// opens a temporary file next to pathname to extract into
+// the name is left in *temp_pathname, which is malloc'd
+FILE *open_extract_file(char *pathname, char **temp_pathname) {
+    static const char suffix[] = ".rain-XXXXXX";
+    *temp_pathname = malloc(strlen(pathname) + sizeof suffix);
+    strcpy(*temp_pathname, pathname);
+    strcat(*temp_pathname, suffix);
+    int fd = mkstemp(*temp_pathname);
+    if (fd < 0) {
+        perror(pathname);
+        exit(1);
     }
+    return fdopen(fd, "w");
+}
 
+// gives the file being extracted its mode and moves it into place at
+// pathname if keep is true, otherwise throws it away
+void finish_extract_file(FILE *output_stream, char *temp_pathname, char *pathname, mode_t mode, bool keep) {
+    if (keep && fchmod(fileno(output_stream), mode) != 0) {
+        perror(pathname);
+        exit(1);
+    }
     if (fclose(output_stream) != 0) {
         fprintf(stderr, "error: problem encounted with fclose\n");
         exit(1);
     }
+    if (!keep) {
+        unlink(temp_pathname);
+    } else if (rename(temp_pathname, pathname) != 0) {
+        perror(pathname);
+        unlink(temp_pathname);
+        exit(1);
+    }
+    free(temp_pathname);
+}
 
-    return content_length;
+// tries to create direcotry and/or set permissions
+void create_directory(char *pathname, mode_t mode) {
+    fprintf(extract_output_stream, "Creating directory: %s\n", pathname);
+    make_directory(pathname, mode);
 }
 
+// creates directory or sets its permissions without printing anything
+void make_directory(char *pathname, mode_t mode) {
+    if (mkdir(pathname, mode) != 0) {
+        if (errno == EEXIST) {
+            // Directory exists 
+            if (chmod(pathname, mode) != 0) {
+                perror(pathname);
+                exit(1);
+            }
+        }
+        else {
+            perror(pathname);
+            exit(1);
+        }
+    }
+}
+
+// the create_option flags given to the current create_drop call
+static int create_options;
+// the directories already in the drop when appending, which are not
+// added again as the ancestors of a pathname, and the directories added
+// by this create_drop call, which are not added again at all
+static struct pathname_set *drop_directories;
+static struct pathname_set *added_directories;
+// the files written so far, which duplicates are stored as references
+// to, NULL unless options has CREATE_DEDUP
+static struct dedup_index *written_files;
+// the chunks in the drop, NULL unless options has CREATE_CHUNK, and the
+// offset in the drop of the start of the stream droplets are written to
+static struct chunk_table *stored_chunks;
+static off_t chunk_base;
+// the files in the drop, which are left out if unchanged and which the
+// files added are recorded in, NULL unless options has CREATE_UPDATE or
+// the drop has a times file
+static struct update_index *known_files;
 
 // create drop_pathname containing the files or directories specified in 
 // pathnames (subset 3)
@@ -368,14 +783,21 @@ uint64_t create_file(char *pathname, mode_t mode, FILE *input_stream, uint8_t fo
 // if append is non-zero droplets should be instead appended to drop_pathname 
 // if it exists
 // format specifies the droplet format to use, it must be one DROPLET_FMT_6,
-// DROPLET_FMT_7 or DROPLET_FMT_8
+// DROPLET_FMT_7, DROPLET_FMT_8 or DROPLET_FMT_LZ
+// options is zero or more create_option flags or'd together
 
-void create_drop(char *drop_pathname, int append, int format,
+void create_drop(char *drop_pathname, int append, int format, int options,
     int n_pathnames, char *pathnames[n_pathnames]) {
+    create_options = options;
+
     // create drop
     FILE *output_stream;
     if (append) {
-        output_stream = fopen(drop_pathname, "ab+");
+        // opened for update rather than append so 'z' droplets can go
+        // back and fill in their block table, and never truncated, as
+        // another writer may have just created it
+        int output_fd = open(drop_pathname, O_RDWR | O_CREAT, 0666);
+        output_stream = output_fd < 0 ? NULL : fdopen(output_fd, "rb+");
     } else {
         output_stream = fopen(drop_pathname, "wb+");
     }
@@ -383,29 +805,122 @@ void create_drop(char *drop_pathname, int append, int format,
         perror(drop_pathname);
         exit(1);
     }
-    struct stat stats;
-    if (stat(drop_pathname, &stats) != 0) {
-        perror(drop_pathname);
-        exit(1);
+    drop_directories = pathname_set_new();
+    added_directories = pathname_set_new();
+    written_files = (options & CREATE_DEDUP) ? dedup_index_new() : NULL;
+    stored_chunks = (options & CREATE_CHUNK) ? chunk_table_new() : NULL;
+    chunk_base = 0;
+    if (!append) {
+        // checksums and the watermark of an old drop of the same name no
+        // longer apply
+        remove_checksums(drop_pathname);
+        remove_watermark(drop_pathname);
+        remove_update_times(drop_pathname);
+    } else {
+        pathname_set_add_drop_directories(drop_directories, fileno(output_stream));
+    }
+    // a drop with a times file keeps it up to date
+    known_files = NULL;
+    if ((options & CREATE_UPDATE) || update_times_exist(drop_pathname)) {
+        known_files = update_index_load(drop_pathname, fileno(output_stream), options & CREATE_UPDATE);
     }
-    long amount_of_bytes = (long)stats.st_size;
     
-    for (int i = 0; i < n_pathnames; i++) {
-        char *pathname = strdup(pathnames[i]);
-        amount_of_bytes = create_drop_backwards(output_stream, format, pathname, amount_of_bytes);
-        free(pathname);
-        amount_of_bytes = create_drop_recursive(output_stream, format, pathnames[i], amount_of_bytes);
+    if (format != DROPLET_FMT_LZ && !(options & (CREATE_SOLID | CREATE_CHUNK))) {
+        // every droplet's length is known from stat, so they can be
+        // written at once, into a range reserved at the end of the drop
+        create_drop_parallel(fileno(output_stream), format, n_pathnames, pathnames, drop_directories,
+            added_directories, written_files, known_files);
+    } else if (append) {
+        // the droplets are written to a file of their own first, as their
+        // lengths are only known once written, then copied into a range
+        // reserved at the end of the drop so other writers can append at
+        // the same time
+        FILE *temp_stream = open_temp_drop(drop_pathname);
+        if (stored_chunks != NULL) {
+            // chunks are referred to by distance, so the drop has to stay
+            // the length it is until these droplets are in it: appends
+            // with chunks take turns with other appends for the whole time
+            if (flock(fileno(output_stream), LOCK_EX) != 0) {
+                perror("flock");
+                exit(1);
+            }
+            chunk_base = settled_drop_size(fileno(output_stream));
+            chunk_table_add_drop_chunks(stored_chunks, fileno(output_stream), chunk_base);
+        }
+        long length = create_droplets(temp_stream, format, n_pathnames, pathnames, 0);
+        if (fflush(temp_stream) != 0) {
+            perror(drop_pathname);
+            exit(1);
+        }
+        off_t offset = reserve_drop_range(fileno(output_stream), length);
+        if (!copy_file_bytes(fileno(temp_stream), 0, fileno(output_stream), offset, length)) {
+            perror(drop_pathname);
+            abandon_drop_range(fileno(output_stream), offset, length);
+            exit(1);
+        }
+        release_drop_range(fileno(output_stream), offset, length);
+        fclose(temp_stream);
+    } else {
+        create_droplets(output_stream, format, n_pathnames, pathnames, 0);
     }
 
+    pathname_set_free(drop_directories);
+    pathname_set_free(added_directories);
+    if (written_files != NULL) {
+        dedup_index_free(written_files);
+    }
+    if (stored_chunks != NULL) {
+        chunk_table_free(stored_chunks);
+    }
     if (fclose(output_stream) != 0) {
         fprintf(stderr, "error: problem encounted with fclose\n");
         exit(1);
     }
+
+    // a drop with checksums keeps them up to date
+    if ((options & CREATE_CHECKSUMS) || checksums_exist(drop_pathname)) {
+        update_checksums(drop_pathname);
+    }
+    // the times are only recorded once the files are in the drop
+    if (known_files != NULL) {
+        update_index_save(known_files, drop_pathname);
+        update_index_free(known_files);
+    }
+}
+
+// opens an unnamed file next to drop_pathname to build droplets in
+FILE *open_temp_drop(char *drop_pathname) {
+    static const char suffix[] = ".rain-XXXXXX";
+    char *temp_pathname = malloc(strlen(drop_pathname) + sizeof suffix);
+    strcpy(temp_pathname, drop_pathname);
+    strcat(temp_pathname, suffix);
+    int fd = mkstemp(temp_pathname);
+    if (fd < 0) {
+        perror(drop_pathname);
+        exit(1);
+    }
+    unlink(temp_pathname);
+    free(temp_pathname);
+    return fdopen(fd, "wb+");
+}
+
+// writes the droplets of pathnames and everything under them one at a
+// time to output_stream from amount_of_bytes on
+// returns the length of the drop
+long create_droplets(FILE *output_stream, int format, int n_pathnames, char *pathnames[n_pathnames],
+    long amount_of_bytes) {
+    for (int i = 0; i < n_pathnames; i++) {
+        char *pathname = strdup(pathnames[i]);
+        amount_of_bytes = create_drop_backwards(output_stream, format, pathname, amount_of_bytes);
+        free(pathname);
+        amount_of_bytes = create_drop_entries(output_stream, format, pathnames[i], amount_of_bytes);
+    }
+    return solid_flush(output_stream, amount_of_bytes);
 }
 
 // a copy of pathname needs to be made as strtok changes orignal string
 // goes back through the pathname and puts any directories inlcuded in it into 
-// the drop file 
+// the drop file, unless they are in it already
 long create_drop_backwards(FILE *output_stream, int format, char *pathname, long amount_of_bytes) {
     // have to use malloc for vairable lenght arrays, length is always going ot 
     // be less thne pathname length 
@@ -423,7 +938,16 @@ long create_drop_backwards(FILE *output_stream, int format, char *pathname, long
         } else {
             strcat(previous_pathname, new_dir);
         }
-        amount_of_bytes = create_directory_droplet(output_stream, format, previous_pathname, amount_of_bytes);
+        if (!pathname_set_contains(drop_directories, previous_pathname) &&
+            pathname_set_add(added_directories, previous_pathname)) {
+            struct stat stats;
+            if (stat(previous_pathname, &stats) != 0) {
+                perror(previous_pathname);
+                exit(1);
+            }
+            amount_of_bytes = create_directory_droplet(output_stream, format, previous_pathname, &stats,
+                amount_of_bytes);
+        }
         strcat(previous_pathname, "/");
         // automatically adds null terminator
         new_dir = next_path;
@@ -433,50 +957,40 @@ long create_drop_backwards(FILE *output_stream, int format, char *pathname, long
     return amount_of_bytes;
 }
 
-// recursive function that gets called on every single pathname from the original
-// pathnames given to create_drop
-// check if its file or directory so appropriate actions can be done
-long create_drop_recursive(FILE *output_stream, int format, char *pathname, long amount_of_bytes) {
-    struct stat stats;
-    if (stat(pathname, &stats) != 0) {
-        perror(pathname);
-        exit(1); 
+// adds pathname and, if it is a directory, everything under it, in the
+// order walk_tree finds them, each stat'd just the once
+long create_drop_entries(FILE *output_stream, int format, char *pathname, long amount_of_bytes) {
+    size_t n_entries;
+    struct walk_entry *entries = walk_tree(pathname, &n_entries);
+    if (known_files != NULL) {
+        n_entries = update_filter(known_files, entries, n_entries);
     }
-    if (stats.st_mode & S_IFDIR) {
-        // directory
-        amount_of_bytes = create_directory_droplet(output_stream, format, pathname, amount_of_bytes);
-        DIR *dir = opendir(pathname);
-        if (dir == NULL) {
-            perror(pathname);
-            exit(1);
-        }
-        struct dirent *entry;
-
-        // process each entry in the directory
-        while ((entry = readdir(dir)) != NULL) {
-            // ignore entries for the current and parent directories
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
+    for (size_t i = 0; i < n_entries; i++) {
+        struct stat *stats = &entries[i].stats;
+        if (stats->st_mode & S_IFDIR) {
+            // a directory listed after a pathname under it was added
+            // already, but one in the drop before this append is added
+            // again, so a change to its mode is kept
+            if (pathname_set_add(added_directories, entries[i].pathname)) {
+                amount_of_bytes = create_directory_droplet(output_stream, format, entries[i].pathname,
+                    stats, amount_of_bytes);
             }
-
-            char *sub_dir_path = malloc(strlen(pathname) + 1 + strlen(entry->d_name) + 1);
-            // copy the first string into the destination buffer
-            strcpy(sub_dir_path, pathname); 
-            strcat(sub_dir_path, "/");
-            // append the second string
-            strcat(sub_dir_path, entry->d_name); 
-            // automatically adds null terminator
-            amount_of_bytes = create_drop_recursive(output_stream, format, sub_dir_path, amount_of_bytes);
-            free(sub_dir_path);
-        }
-        if (closedir(dir) == -1) {
-            perror("Failed to close directory");
-            exit(1);
+        } else if ((create_options & CREATE_SOLID) && solid_eligible(stats)) {
+            amount_of_bytes = solid_add_file(output_stream, format, entries[i].pathname, stats,
+                amount_of_bytes);
+        } else if (written_files != NULL && dedup_eligible(stats)) {
+            amount_of_bytes = create_reference_droplet(output_stream, format, entries[i].pathname,
+                stats, amount_of_bytes);
+        } else if (stored_chunks != NULL && chunk_eligible(stats)) {
+            amount_of_bytes = create_chunked_droplet(output_stream, stored_chunks, chunk_base,
+                entries[i].pathname, stats, amount_of_bytes, NULL);
+        } else {
+            amount_of_bytes = create_file_droplet(output_stream, format, entries[i].pathname,
+                stats, amount_of_bytes);
         }
-    } else {
-        amount_of_bytes = create_file_droplet(output_stream, format, pathname, amount_of_bytes);
+        free(entries[i].pathname);
     }
-
+    free(entries);
     return amount_of_bytes;
 }
 
@@ -484,7 +998,8 @@ long create_drop_recursive(FILE *output_stream, int format, char *pathname, long
 // writes to the drop file if droplet to be wrote is a directory
 // returns amount of bytes so position can be recoreded in drop_pathname
 // file pointer is a the start of the next droplet
-long create_directory_droplet(FILE *output_stream, int format, char *pathname, long amount_of_bytes) {
+long create_directory_droplet(FILE *output_stream, int format, char *pathname, struct stat *stats,
+    long amount_of_bytes) {
     printf("Adding: %s\n", pathname);
     int byte;
 
@@ -496,13 +1011,8 @@ long create_directory_droplet(FILE *output_stream, int format, char *pathname, l
     fputc(byte, output_stream);
     fputc(format, output_stream);
 
-    struct stat stats;
-    //get permissions from 
-    if (stat(pathname, &stats) != 0) {
-        perror(pathname);
-        exit(1); 
-    }
-    char *permissions = convert_permissions_to_array(stats.st_mode);
+    //get permissions from the stat the droplet was found with
+    char *permissions = convert_permissions_to_array(stats->st_mode);
 
     // print to permssions file 
     for (int j = 0; j < PERMISSIONS_BYTES; j++) {
@@ -550,7 +1060,8 @@ long create_directory_droplet(FILE *output_stream, int format, char *pathname, l
 // writes to the drop file if droplet to be wrote is a file not directory
 // returns amount of bytes so position can be recoreded in drop_pathname
 // file pointer is a the start of the next droplet
-long create_file_droplet(FILE *output_stream, int format, char *pathname, long amount_of_bytes) {
+long create_file_droplet(FILE *output_stream, int format, char *pathname, struct stat *stats,
+    long amount_of_bytes) {
     FILE *input_stream = fopen(pathname, "rb");
     if (input_stream == NULL) {
         perror(pathname);
@@ -559,21 +1070,21 @@ long create_file_droplet(FILE *output_stream, int format, char *pathname, long a
     printf("Adding: %s\n", pathname);
     int byte;
 
+    // a file with holes only has its data stored
+    size_t n_extents;
+    uint64_t data_length;
+    struct sparse_extent *extents = sparse_extents(pathname, stats, &n_extents, &data_length);
+
     //go to end of drop file to add new droplet
     fseek(output_stream, amount_of_bytes, SEEK_SET);
 
     // add magic number and format
     byte = VALID_MAGIC_NUMBER;
     fputc(byte, output_stream);
-    fputc(format, output_stream);
+    fputc(extents != NULL ? DROPLET_FMT_SPARSE : format, output_stream);
     
-    struct stat stats;
-    //get permissions from file
-    if (stat(pathname, &stats) != 0) {
-        perror(pathname);
-        exit(1); 
-    }
-    char *permissions = convert_permissions_to_array(stats.st_mode);
+    //get permissions from the stat the file was found with
+    char *permissions = convert_permissions_to_array(stats->st_mode);
 
     // print to permssions file 
     for (int j = 0; j < PERMISSIONS_BYTES; j++) {
@@ -594,7 +1105,7 @@ long create_file_droplet(FILE *output_stream, int format, char *pathname, long a
     }
     
     // get content length and print to file
-    uint64_t content_length = (long)stats.st_size;
+    uint64_t content_length = (long)stats->st_size;
     
     // little endian so smallest bits first
     for (int j = 0; j < CONTENT_LENGTH_BYTES; j++) {
@@ -604,9 +1115,22 @@ long create_file_droplet(FILE *output_stream, int format, char *pathname, long a
     
     // print content to file
     fseek(input_stream, 0, SEEK_SET);
-    for (int j = 0; j < content_length; j++) {
-        byte = fgetc(input_stream);
-        fputc(byte, output_stream);
+    int bad_byte = -1;
+    int64_t stored_length;
+    if (extents != NULL) {
+        stored_length = write_sparse_content(pathname, extents, n_extents, data_length, output_stream);
+        free(extents);
+    } else {
+        stored_length = write_droplet_content(input_stream, output_stream, format,
+            content_length, &bad_byte);
+    }
+    if (stored_length < 0) {
+        // a file which could not be read has been reported already
+        if (bad_byte >= 0) {
+            fprintf(stderr, "error: byte 0x%02x in %s can not be stored in '%c' format\n",
+                bad_byte, pathname, format);
+        }
+        exit(1);
     }
 
     // go back to the start and check the hashing now
@@ -615,7 +1139,7 @@ long create_file_droplet(FILE *output_stream, int format, char *pathname, long a
     long droplet_length = MAGIC_NUMBER_BYTES + DROPLET_FORMAT_BYTES + 
     PERMISSIONS_BYTES + PATHNAME_LENGTH_BYTES + pathname_length + 
     CONTENT_LENGTH_BYTES +
-    content_length + HASH_BYTES;
+    stored_length + HASH_BYTES;
 
     amount_of_bytes = amount_of_bytes + droplet_length;
 
@@ -630,6 +1154,42 @@ long create_file_droplet(FILE *output_stream, int format, char *pathname, long a
     return amount_of_bytes;
 }
 
+// writes a reference droplet if a file with the same contents has been
+// written already, otherwise writes the file's droplet and remembers it
+long create_reference_droplet(FILE *output_stream, int format, char *pathname, struct stat *stats,
+    long amount_of_bytes) {
+    bool hashed = false;
+    uint8_t digest[SHA256_LENGTH];
+    off_t target_offset;
+    char kind = dedup_find(written_files, pathname, stats, &hashed, digest, &target_offset);
+    if (kind == 0 && stored_chunks != NULL && chunk_eligible(stats)) {
+        // the file's 'm' droplet comes after any new chunks
+        long map_offset;
+        amount_of_bytes = create_chunked_droplet(output_stream, stored_chunks, chunk_base, pathname, stats,
+            amount_of_bytes, &map_offset);
+        dedup_add(written_files, pathname, stats, &hashed, digest, map_offset);
+        return amount_of_bytes;
+    } else if (kind == 0) {
+        dedup_add(written_files, pathname, stats, &hashed, digest, amount_of_bytes);
+        return create_file_droplet(output_stream, format, pathname, stats, amount_of_bytes);
+    }
+
+    printf("Adding: %s\n", pathname);
+    size_t droplet_length;
+    uint8_t *droplet = build_reference_droplet(pathname, stats->st_mode, stats->st_size, kind,
+        amount_of_bytes - target_offset, &droplet_length);
+    fseek(output_stream, amount_of_bytes, SEEK_SET);
+    if (fwrite(droplet, 1, droplet_length, output_stream) != droplet_length) {
+        perror("fwrite");
+        exit(1);
+    }
+    free(droplet);
+    if (kind == REFERENCE_COPY) {
+        dedup_add_copy(written_files, stats, amount_of_bytes);
+    }
+    return amount_of_bytes + droplet_length;
+}
+
 // calcualtes the final has value of a droplet by scanning through droplet
 // droplet legnth is actually the real droplet legnth - 1
 // assumes its at the start of the droplet
@@ -641,6 +1201,20 @@ uint8_t calculate_hash(long droplet_length, FILE *input_stream) {
     return current_hash_value;
 }
 
+// checks the block lengths of a 'z' droplet add up to its stored length
+// input_stream is returned to where it was
+bool check_lz_block_table(FILE *input_stream, long content_offset, uint64_t content_length) {
+    long position = ftell(input_stream);
+    fseek(input_stream, content_offset, SEEK_SET);
+    size_t block_size;
+    size_t n_blocks;
+    uint32_t *table = read_lz_block_table(input_stream, content_length, &block_size, &n_blocks);
+    bool valid = table != NULL;
+    free(table);
+    fseek(input_stream, position, SEEK_SET);
+    return valid;
+}
+
 // converts a permissions array containing 
 mode_t convert_permissions_array(char *permissions) {
     // convert the permissions string to an integer in octal mode
@@ -688,128 +1262,6 @@ char *convert_permissions_to_array(mode_t mode) {
     return permissions;
 }
 
-// gets 8 bits values from input stream and prints to output stream
-void extract_8_bits(FILE *input_stream, FILE *output_stream, uint64_t content_length) {
-    uint8_t byte;
-    for (int i = 0; i < content_length; i++) {
-        byte = fgetc_with_EOF_checking(input_stream);
-        fputc(byte, output_stream);
-    }
-}
-
-// doesnt error check for if its not in 7 bit format
-// just extracts content_length amount of bytes from input stream
-// converts those 7 bit values to 8 bit values
-// prints 8 bit values to output stream
-void extract_7_bits(FILE *input_stream, FILE *output_stream, uint64_t content_length) {
-    uint8_t byte;
-    // only has to be over 14 bits
-    uint16_t bit_mask; 
-    // basically a buffer
-    uint16_t bits = 0; 
-    int amount_of_bits_in_bits_variable = 0;
-    int count = 0;
-    while (count < content_length) {
-        // get next byte
-        byte = fgetc(input_stream);
-        
-        // add to bits varibale (needs to be inserted at the lsb)
-        // thus move over  existing bits by 8 to add new scanned byte
-        bits = (bits << BYTE_SIZE) | byte;
-        amount_of_bits_in_bits_variable = amount_of_bits_in_bits_variable + BYTE_SIZE;
-        
-        // now get the leading 7 bits to get the next byte to print out
-        byte = (bits >> (amount_of_bits_in_bits_variable - FORMAT_7_BYTES));
-        // byte should now have leading 0 added as well
-        // so now its converted to 8 bit format
-        fputc(byte, output_stream);
-        count++;
-
-        //remove those 7 used byte bits from bits
-        amount_of_bits_in_bits_variable = amount_of_bits_in_bits_variable - FORMAT_7_BYTES;
-        
-        // create new bit mask of amount_of_bits_in_bits_variable length
-        // after adjusting for the now not needed leading 7 bits
-        bit_mask = 0;
-        for (int j = 0; j < amount_of_bits_in_bits_variable; j++) {
-            bit_mask |= (1 << j);
-        }
-        bits = (bits & bit_mask);
-        
-        // eventually there is going to be 7 leftover bits in the bits array and 
-        // thus another 7 bits will need to be printed or eventuallly there
-        // will be buffer overflow for bits variabel
-        if (amount_of_bits_in_bits_variable == FORMAT_7_BYTES && count < content_length) {
-            // print leftover bits
-            fputc(bits, output_stream);
-            count++;
-            // update these changes
-            bits = 0; 
-            amount_of_bits_in_bits_variable = 0;
-        }
-    }
-}
-
-// error checks for if its in 6 bit format
-// just extracts content_length amount of bytes from input stream
-// converts those 6 bit values to 8 bit values
-// prints 8 bit values to output stream
-void extract_6_bits(FILE *input_stream, FILE *output_stream, uint64_t content_length) {
-    uint8_t byte;
-    // only has to be over 12 bits
-    uint16_t bit_mask; 
-    // basically a buffer
-    uint16_t bits = 0; 
-    int amount_of_bits_in_bits_variable = 0;
-    int converted_byte;
-    int count = 0;
-    while (count < content_length) {
-        // get next byte
-        byte = fgetc(input_stream);
-        
-        // add to bits varibale (needs to be inserted at the lsb)
-        // thus move over existing bits by 8 to add new scanned byte
-        bits = (bits << BYTE_SIZE) | byte;
-        amount_of_bits_in_bits_variable = amount_of_bits_in_bits_variable + BYTE_SIZE;
-        
-        // now get the leading 6 bits to get the next byte to print out
-        byte = (bits >> (amount_of_bits_in_bits_variable - FORMAT_6_BYTES));
-        // byte should now have leading 0 added as well
-        
-        // check if its a valid conversion
-        converted_byte = droplet_from_6_bit(byte);
-        if (converted_byte == -1) {
-            fprintf(stderr, "error: 6 bit value 0x%02x is not valid\n", byte);
-            exit(1);
-        }
-        fputc(converted_byte, output_stream);
-        count++;
-
-        //remove those 6 used byte bits from bits
-        amount_of_bits_in_bits_variable = amount_of_bits_in_bits_variable - FORMAT_6_BYTES;
-        
-        // create new bit mask of amount_of_bits_in_bits_variable length
-        // after adjusting for the now not needed leading 6 bits
-        bit_mask = 0;
-        for (int j = 0; j < amount_of_bits_in_bits_variable; j++) {
-            bit_mask |= (1 << j);
-        }
-        bits = (bits & bit_mask);
-        
-        // eventually there is going to be 6 leftover bits in the bits array and 
-        // thus another 6 bits will need to be printed or eventuallly there
-        // will be buffer overflow for bits variabel
-        if (amount_of_bits_in_bits_variable == FORMAT_6_BYTES && count < content_length) {
-            // print leftover bits
-            fputc(bits, output_stream);
-            count++;
-            // update these changes
-            bits = 0; 
-            amount_of_bits_in_bits_variable = 0;
-        }
-    }
-}
-
 // fgets but produces error if EOF is encounted
 int fgetc_with_EOF_checking(FILE *input_stream) {
     int byte = fgetc(input_stream);
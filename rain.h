@@ -1,19 +1,62 @@
 #ifndef _RAIN_H
 #define _RAIN_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 
+/** Options for create_drop, or'd together. */
+enum create_option {
+    CREATE_SOLID = 1 << 0,     /**< Pack small files into solid blocks. */
+    CREATE_CHECKSUMS = 1 << 1, /**< Record CRC32C checksums of droplets. */
+    CREATE_DEDUP = 1 << 2,     /**< Store duplicate files as references. */
+    CREATE_CHUNK = 1 << 3,     /**< Store files as shared chunks. */
+    CREATE_UPDATE = 1 << 4,    /**< Leave out files unchanged since added. */
+};
+
+// what extract does with a droplet whose hash is wrong
+enum bad_hash_policy {
+    BAD_HASH_ABORT, /**< Stop extracting. */
+    BAD_HASH_SKIP,  /**< Leave the droplet out and carry on. */
+    BAD_HASH_KEEP,  /**< Extract the droplet anyway. */
+};
+
+/** Options for check_drop, or'd together. */
+enum check_option {
+    CHECK_FULL = 1 << 0,           /**< Check droplets before the watermark too. */
+    CHECK_SAMPLE_BY_SIZE = 1 << 1, /**< Sample droplets in proportion to length. */
+    CHECK_INCREMENTAL = 1 << 2,    /**< Start from, and keep, the watermark. */
+};
+
 // list_drop, check_drop, extract_drop, and create_drop are defined in rain.c
-void list_drop(char *drop_pathname, int long_listing);
-void check_drop(char *drop_pathname);
-void extract_drop(char *drop_pathname);
-void create_drop(char *drop_pathname, int append, int droplet_format, int n_pathnames, char *pathnames[n_pathnames]);
+bool list_drop(char *drop_pathname, int long_listing, FILE *output_stream, FILE *error_stream);
+bool check_drop(char *drop_pathname, int options, FILE *output_stream, FILE *error_stream);
+bool extract_drop(char *drop_pathname, enum bad_hash_policy policy, FILE *output_stream, FILE *error_stream);
+void create_drop(char *drop_pathname, int append, int droplet_format, int options, int n_pathnames, char *pathnames[n_pathnames]);
+
+// helpers shared with the other rain_*.c files, also defined in rain.c
+uint8_t calculate_hash(long droplet_length, FILE *input_stream);
+mode_t convert_permissions_array(char *permissions);
+char *convert_permissions_to_array(mode_t mode);
+int fgetc_with_EOF_checking(FILE *input_stream);
+bool droplet_hash_verified(char *name, uint8_t calculated_hash, uint8_t stored_hash);
+FILE *open_extract_file(char *pathname, char **temp_pathname);
+void finish_extract_file(FILE *output_stream, char *temp_pathname, char *pathname, mode_t mode, bool keep);
 
 
 // droplet_hash is defined in rain_hash.c
 uint8_t droplet_hash(uint8_t current_hash_value, uint8_t byte_value);
 
+// droplet_hash_bytes, droplet_hash_many, droplet_hash_range and
+// droplet_hash_range_parallel are defined in rain_multi_hash.c
+uint8_t droplet_hash_bytes(uint8_t hash, const uint8_t *bytes, size_t n);
+void droplet_hash_many(size_t n, const uint8_t *const *buffers, const size_t *lengths, uint8_t *hashes);
+uint8_t droplet_hash_range(int fd, off_t offset, uint64_t length);
+bool droplet_hash_range_parallel(uint64_t length);
+
 
 // droplet_to_6_bit, and droplet_from_6_bit are defined in rain_6_bit.c
 // These functions are provided for you to use in rain.c
@@ -22,16 +65,350 @@ int droplet_to_6_bit(uint8_t eight_bit_value);
 int droplet_from_6_bit(uint8_t six_bit_value);
 
 
+// rain_thread_count, rain_thread_budget and parallel_for are defined in
+// rain_thread.c
+int rain_thread_count(void);
+size_t rain_thread_budget(void);
+void parallel_for(size_t n_items, void (*work)(void *context, size_t item), void *context);
+
+
+// the block codec and 'z' droplet contents are defined in rain_lz.c
+size_t lz_compress_bound(size_t src_length);
+size_t lz_compress(const uint8_t *src, size_t src_length, uint8_t *dst, size_t dst_capacity);
+long lz_decompress(const uint8_t *src, size_t src_length, uint8_t *dst, size_t dst_capacity);
+uint64_t write_lz_content(FILE *input_stream, FILE *output_stream, uint64_t content_length);
+uint64_t lz_content_length(FILE *input_stream);
+uint32_t *read_lz_block_table(FILE *input_stream, uint64_t content_length, size_t *block_size, size_t *n_blocks);
+bool read_lz_content(FILE *input_stream, uint8_t *output, uint64_t content_length);
+struct lz_reader *lz_reader_open(FILE *input_stream, uint64_t content_length);
+long lz_reader_next(struct lz_reader *reader, uint8_t **data);
+void lz_reader_close(struct lz_reader *reader);
+
+
+// the packed n-bit codecs and content streams are defined in rain_codec.c
+struct droplet_codec {
+    int format;
+    int width;      /**< Bits per packed value. */
+    uint32_t bits;  /**< Bits carried over between calls. */
+    int n_bits;
+    int bad_byte;   /**< The byte codec_encode could not store. */
+};
+void codec_init(struct droplet_codec *codec, int format);
+long codec_encode(struct droplet_codec *codec, const uint8_t *input, size_t n, uint8_t *output);
+int codec_find_bad_byte(int format, const uint8_t *input, size_t n);
+size_t codec_encode_finish(struct droplet_codec *codec, uint8_t *output);
+size_t codec_decode(struct droplet_codec *codec, const uint8_t *input, size_t n, uint8_t *output, uint64_t max_values);
+FILE *open_droplet_content(FILE *input_stream, uint8_t format, uint64_t content_length);
+bool copy_droplet_content(FILE *input_stream, FILE *output_stream, uint8_t format, uint64_t content_length);
+int64_t write_droplet_content(FILE *content_stream, FILE *output_stream, int format, uint64_t content_length, int *bad_byte);
+FILE *open_hashing_stream(FILE *input_stream, uint64_t length, uint8_t *hash);
+
+
+// header-only drop scanning is defined in rain_scan.c
+enum scan_result {
+    SCAN_OK,         /**< A whole droplet was found. */
+    SCAN_END,        /**< The offset is the end of the drop. */
+    SCAN_TRUNCATED,  /**< The droplet runs past the end of the drop. */
+    SCAN_BAD_MAGIC,
+    SCAN_BAD_FORMAT,
+};
+
+struct droplet_header {
+    off_t offset;             /**< Offset of the droplet's magic number. */
+    uint8_t magic;
+    uint8_t format;
+    char mode[11];
+    uint16_t pathname_length;
+    char *pathname;           /**< malloc'd, null terminated. */
+    uint64_t content_length;  /**< The content length field. */
+    off_t content_offset;     /**< Offset of the first byte of contents. */
+    uint64_t stored_length;   /**< Bytes of contents in the drop. */
+    uint64_t length;          /**< Bytes in the whole droplet, hash included. */
+};
+
+bool droplet_format_valid(uint8_t format);
+uint64_t packed_content_length(uint8_t format, uint64_t content_length);
+enum scan_result read_droplet_header(int fd, off_t offset, off_t drop_size, struct droplet_header *header);
+enum scan_result read_droplet_header_any_magic(int fd, off_t offset, off_t drop_size,
+    struct droplet_header *header);
+const char *scan_result_message(enum scan_result result);
+void print_scan_error(FILE *error_stream, enum scan_result result, struct droplet_header *header);
+void scan_error(enum scan_result result, struct droplet_header *header);
+struct droplet_header *scan_drop(int fd, size_t *n_droplets);
+void free_droplet_headers(struct droplet_header *headers, size_t n_droplets);
+
+// check_droplet_result is defined in rain.c
+bool check_droplet_result(FILE *input_stream, struct droplet_header *header,
+    uint8_t calculated_hash, uint8_t stored_hash, int64_t bad_offset, FILE *output_stream);
+
+
+// crc32c is defined in rain_crc32c.c
+uint32_t crc32c(uint32_t crc, const uint8_t *bytes, size_t n);
+
+
+// sha256 is defined in rain_sha256.c
+#define SHA256_BLOCK 64
+#define SHA256_LENGTH 32
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[SHA256_BLOCK];
+    size_t n_buffered;
+};
+
+void sha256_init(struct sha256 *sha);
+void sha256_update(struct sha256 *sha, const uint8_t *bytes, size_t n);
+void sha256_final(struct sha256 *sha, uint8_t digest[SHA256_LENGTH]);
+
+
+// the watermark of the last successful check is defined in rain_watermark.c
+struct check_watermark {
+    off_t offset;                  /**< Bytes of the drop known correct. */
+    size_t n_droplets;             /**< Droplets in those bytes. */
+    struct sha256 prefix_digest;   /**< SHA-256 of those bytes, unfinished. */
+    uint8_t probe[SHA256_LENGTH];  /**< Hash of a few bytes at each end. */
+};
+
+enum watermark_result {
+    WATERMARK_NONE,   /**< The drop has never been checked. */
+    WATERMARK_STALE,  /**< The drop has changed since. */
+    WATERMARK_VALID,
+};
+
+void remove_watermark(char *drop_pathname);
+void sha256_update_range(struct sha256 *sha, int fd, off_t offset, uint64_t length);
+enum watermark_result load_watermark(char *drop_pathname, int fd, off_t drop_size,
+    struct check_watermark *watermark);
+bool advance_watermark(struct check_watermark *watermark, struct check_watermark *previous,
+    int fd, const uint8_t *bytes, uint64_t length);
+void save_watermark(char *drop_pathname, int fd, struct check_watermark *watermark);
+
+
+// the optional checksum file is defined in rain_checksums.c
+struct droplet_checksum {
+    off_t offset;          /**< Offset of the droplet in the drop. */
+    uint64_t length;       /**< Bytes in the droplet, hash included. */
+    uint32_t crc;          /**< CRC32C of the whole droplet. */
+    size_t n_blocks;       /**< 0 unless the droplet is over one block. */
+    uint32_t *block_crcs;  /**< CRC32C of each block. */
+    uint8_t digest[SHA256_LENGTH];  /**< Merkle leaf hash of the droplet. */
+};
+
+struct drop_checksums {
+    uint64_t block_size;
+    uint64_t covered_length;  /**< Bytes of the drop recorded. */
+    size_t n_recorded;        /**< Droplets recorded, from the first line. */
+    uint8_t root[SHA256_LENGTH];
+    size_t n_droplets;
+    struct droplet_checksum *droplets;
+};
+
+char *checksum_pathname(char *drop_pathname);
+bool checksums_exist(char *drop_pathname);
+void remove_checksums(char *drop_pathname);
+struct drop_checksums *load_checksums(char *drop_pathname);
+void free_checksums(struct drop_checksums *checksums);
+struct droplet_checksum *find_checksum(struct drop_checksums *checksums, off_t offset);
+int64_t verify_droplet_checksum(struct drop_checksums *checksums, struct droplet_checksum *checksum,
+    const uint8_t *bytes, uint64_t length);
+int64_t verify_droplet_checksum_range(int fd, struct drop_checksums *checksums,
+    struct droplet_checksum *checksum, uint64_t length);
+bool parse_digest(const char *text, uint8_t digest[SHA256_LENGTH]);
+void format_digest(const uint8_t digest[SHA256_LENGTH], char text[2 * SHA256_LENGTH + 1]);
+bool read_checksum_root(char *drop_pathname, uint64_t *covered_length, size_t *n_droplets,
+    uint8_t root[SHA256_LENGTH]);
+void update_checksums(char *drop_pathname);
+
+
+// the Merkle root and digest mode are defined in rain_digest.c
+#define MERKLE_LEAF_PREFIX "\x00"
+#define MERKLE_NODE_PREFIX "\x01"
+void merkle_root(uint8_t (*leaves)[SHA256_LENGTH], size_t n_leaves, uint8_t root[SHA256_LENGTH]);
+void digest_drops(char **drop_pathnames, int n_drops);
+
+
+// salvage_drop is defined in rain_salvage.c
+void salvage_drop(char *drop_pathname, char *new_drop_pathname);
+
+
+// check_drops is defined in rain_multi_check.c
+void check_drops(char **drop_pathnames, int n_drops, int options);
+
+
+// sample_drop is defined in rain_sample.c
+bool sample_drop(char *drop_pathname, int options, size_t n_samples, uint64_t seed);
+
+
+// scrub_directory is defined in rain_scrub.c
+#define SCRUB_DEFAULT_MB_PER_SECOND 50
+void scrub_directory(char *directory, double mb_per_second);
+
+
+// the pipeline large members are encoded and decoded through is
+// defined in rain_pipeline.c
+#define PIPELINE_MIN_LENGTH (16 * 1024 * 1024)
+int64_t pipeline_encode(int input_fd, int output_fd, off_t output_offset, int format,
+    uint64_t content_length, uint8_t *hash, int *bad_byte);
+bool pipeline_decode(int input_fd, off_t input_offset, uint64_t stored_length, int format,
+    uint64_t content_length, int output_fd, uint8_t *hash);
+
+
+// walk_tree is defined in rain_walk.c
+struct walk_entry {
+    char *pathname;
+    struct stat stats;
+};
+struct walk_entry *walk_tree(char *pathname, size_t *n_entries);
+
+
+// appending alongside other writers and readers is defined in rain_append.c
+off_t reserve_drop_range(int fd, uint64_t length);
+void release_drop_range(int fd, off_t offset, uint64_t length);
+void abandon_drop_range(int fd, off_t offset, uint64_t length);
+off_t settled_drop_size(int fd);
+
+
+// batch mode is defined in rain_batch.c
+void run_batch(char *manifest_pathname, enum bad_hash_policy policy, int check_options);
+
+
+// sets of pathnames are defined in rain_pathname_set.c
+struct pathname_set;
+struct pathname_set *pathname_set_new(void);
+void pathname_set_free(struct pathname_set *set);
+bool pathname_set_add(struct pathname_set *set, const char *pathname);
+bool pathname_set_contains(struct pathname_set *set, const char *pathname);
+void pathname_set_add_drop_directories(struct pathname_set *set, int fd);
+
+
+// reference droplets and the index of files they can refer to are
+// defined in rain_reference.c
+#define REFERENCE_LENGTH 7
+#define REFERENCE_MIN_LENGTH 64
+#define REFERENCE_HARDLINK 'h'
+#define REFERENCE_COPY 'c'
+struct dedup_index;
+bool dedup_eligible(struct stat *stats);
+struct dedup_index *dedup_index_new(void);
+void dedup_index_free(struct dedup_index *index);
+void dedup_hash_file(char *pathname, uint64_t size, uint8_t digest[SHA256_LENGTH]);
+char dedup_find(struct dedup_index *index, char *pathname, struct stat *stats, bool *hashed,
+    uint8_t digest[SHA256_LENGTH], off_t *offset);
+void dedup_add(struct dedup_index *index, char *pathname, struct stat *stats, bool *hashed,
+    uint8_t digest[SHA256_LENGTH], off_t offset);
+void dedup_add_copy(struct dedup_index *index, struct stat *stats, off_t offset);
+uint8_t *build_reference_droplet(char *pathname, mode_t mode, uint64_t content_length, char kind,
+    uint64_t distance, size_t *length);
+uint8_t *rebase_reference_droplet(const uint8_t *droplet, struct droplet_header *header, uint64_t distance);
+bool read_reference(int fd, struct droplet_header *header, char *kind, off_t *target_offset);
+bool reference_target_valid(int fd, struct droplet_header *header);
+
+
+// chunk and chunk map droplets are defined in rain_chunk.c
+#define CHUNK_COUNT_LENGTH 6
+#define CHUNK_DISTANCE_LENGTH 6
+struct chunk_table;
+bool chunk_eligible(struct stat *stats);
+struct chunk_table *chunk_table_new(void);
+void chunk_table_free(struct chunk_table *table);
+void chunk_table_add_drop_chunks(struct chunk_table *table, int fd, off_t drop_size);
+long create_chunked_droplet(FILE *output_stream, struct chunk_table *table, off_t base, char *pathname,
+    struct stat *stats, long amount_of_bytes, long *map_offset);
+uint8_t *read_chunk_map(int fd, struct droplet_header *header);
+uint64_t chunk_map_count(struct droplet_header *header);
+off_t chunk_map_offset(const uint8_t *droplet, struct droplet_header *header, uint64_t i);
+void chunk_map_set_offset(uint8_t *droplet, struct droplet_header *header, uint64_t i, off_t new_offset,
+    off_t offset);
+bool chunk_map_valid(int fd, struct droplet_header *header);
+bool extract_chunked_file(int fd, struct droplet_header *header, FILE *output_stream, uint8_t *hash);
+
+
+// sparse droplets are defined in rain_sparse.c
+#define SPARSE_FIELD_LENGTH 6
+struct sparse_extent {
+    uint64_t offset;
+    uint64_t length;
+};
+bool sparse_candidate(struct stat *stats);
+struct sparse_extent *sparse_extents(char *pathname, struct stat *stats, size_t *n_extents,
+    uint64_t *data_length);
+uint64_t sparse_stored_length(size_t n_extents, uint64_t data_length);
+int64_t write_sparse_content(char *pathname, struct sparse_extent *extents, size_t n_extents,
+    uint64_t data_length, FILE *output_stream);
+struct sparse_extent *read_sparse_extents(int fd, struct droplet_header *header, size_t *n_extents);
+bool sparse_extents_valid(int fd, struct droplet_header *header);
+bool extract_sparse_file(int fd, struct droplet_header *header, int output_fd, uint8_t *hash);
+
+
+// --update is defined in rain_update.c
+struct update_index;
+bool update_times_exist(char *drop_pathname);
+void remove_update_times(char *drop_pathname);
+struct update_index *update_index_load(char *drop_pathname, int fd, bool skip_unchanged);
+void update_index_free(struct update_index *index);
+size_t update_filter(struct update_index *index, struct walk_entry *entries, size_t n_entries);
+void update_index_save(struct update_index *index, char *drop_pathname);
+
+
+// create_drop_parallel is defined in rain_parallel_create.c
+void create_drop_parallel(int output_fd, int format, int n_pathnames, char *pathnames[n_pathnames],
+    struct pathname_set *drop_directories, struct pathname_set *added_directories,
+    struct dedup_index *written_files, struct update_index *known_files);
+
+
+// repack_drop is defined in rain_repack.c
+void repack_drop(char *drop_pathname, char *new_drop_pathname, int droplet_format);
+size_t find_droplet(struct droplet_header *headers, size_t n_headers, off_t offset);
+void copy_rebased_droplet(int input_fd, struct droplet_header *headers, off_t *new_offsets,
+    struct droplet_header *header, FILE *output_stream);
+
+
+// compact_drop is defined in rain_compact.c
+void compact_drop(char *drop_pathname);
+
+
+// the little-endian integer and copying helpers are defined in rain_io.c
+void write_little_endian(FILE *output_stream, uint64_t value, int n_bytes);
+uint64_t read_little_endian(FILE *input_stream, int n_bytes);
+void store_little_endian(uint8_t *bytes, uint64_t value, int n_bytes);
+uint64_t load_little_endian(const uint8_t *bytes, int n_bytes);
+bool copy_file_bytes(int input_fd, off_t input_offset, int output_fd, off_t output_offset, uint64_t length);
+FILE *open_pread_stream(int fd, off_t offset, uint64_t length);
+FILE *open_pwrite_stream(int fd, off_t offset, uint8_t *hash);
+
+
+// solid-block droplets are defined in rain_solid.c
+bool solid_eligible(struct stat *stats);
+long solid_add_file(FILE *output_stream, int format, char *pathname, struct stat *stats, long amount_of_bytes);
+long solid_flush(FILE *output_stream, long amount_of_bytes);
+uint64_t solid_content_length(FILE *input_stream, uint64_t content_length);
+bool list_solid_block(FILE *input_stream, uint64_t content_length, int long_listing, FILE *output_stream,
+    FILE *error_stream);
+void check_solid_block(FILE *input_stream, long content_offset, uint64_t content_length, char *result,
+    FILE *output_stream);
+bool extract_solid_block(FILE *input_stream, uint64_t content_length, uint8_t hash, FILE *output_stream,
+    FILE *error_stream);
+bool each_solid_member(FILE *input_stream, uint64_t content_length,
+    void (*found)(void *context, char *mode, char *pathname, uint64_t content_length), void *context);
+
+
 // Useful constants for you to use in rain.c
 
 /** The file `.drop` format magic number. */
 static const uint8_t DROPLET_MAGIC  = 0x63;
 
-/** The three types of droplet format. */
+/** The types of droplet format. */
 enum droplet_fmt {
-    DROPLET_FMT_6 = 0x36,
-    DROPLET_FMT_7 = 0x37,
-    DROPLET_FMT_8 = 0x38,
+    DROPLET_FMT_6     = 0x36,
+    DROPLET_FMT_7     = 0x37,
+    DROPLET_FMT_8     = 0x38,
+    DROPLET_FMT_LZ    = 0x7a,
+    DROPLET_FMT_SOLID = 0x73,
+    DROPLET_FMT_REF   = 0x72,
+    DROPLET_FMT_CHUNK = 0x6b,
+    DROPLET_FMT_CHUNK_MAP = 0x6d,
+    DROPLET_FMT_SPARSE = 0x70,
 };
 
 /** Droplet Offsets. */
@@ -58,7 +435,8 @@ static const int DROP_LENGTH_HASH     = 1;
  *  - 'magic_number':    byte 0 in every droplet must be 0x63 (ASCII 'c')
  *
  *  - 'droplet_format':   byte 1 in every droplet must be one of
- *                       0x36, 0x37, 0x38 (ASCII '6', '7' '8')
+ *                       0x36, 0x37, 0x38, 0x7a, 0x73, 0x72, 0x6b, 0x6d, 0x70
+ *                       (ASCII '6', '7' '8', 'z', 's', 'r', 'k', 'm', 'p')
  *
  *  - 'mode':            bytes 2-11 are the type and permissions as
  *                       a ls(1)-like character array; e.g., "-rwxr-xr-x"
@@ -105,6 +483,41 @@ static const int DROP_LENGTH_HASH     = 1;
  *
  *    This format needs to store ceil((6.0/8) * content_length) bytes.
  *
+ *  - droplet format 0x7a ('z'):
+ *    `contents' is a 6-byte stored length, then a table of block lengths,
+ *    then the file split into independently compressed blocks
+ *    (see `rain_lz.c').
+ *
+ *    The number of bytes stored is given by the stored length field,
+ *    not by content_length.  Nothing is stored if content_length is 0.
+ *
+ *  - droplet format 0x73 ('s'):
+ *    `contents' is a solid block holding many small files: an encoding
+ *    byte ('8' or 'z'), then a directory of the member files followed
+ *    by their contents (see `rain_solid.c').  content_length is the
+ *    length of the decoded block.
+ *
+ *  - droplet format 0x72 ('r'):
+ *    `contents' is 7 bytes referring to an earlier droplet holding the
+ *    same file: a kind byte, 'h' for a hardlink or 'c' for a copy, then
+ *    a 6-byte distance back from this droplet to that one (see
+ *    `rain_reference.c').  content_length is the length of the file.
+ *
+ *  - droplet format 0x6b ('k'):
+ *    `contents' is one chunk of one or more files, stored as-is; the
+ *    pathname is the chunk's SHA-256 in hex (see `rain_chunk.c').
+ *
+ *  - droplet format 0x6d ('m'):
+ *    `contents' is a 6-byte chunk count, then for each chunk of the file
+ *    a 6-byte distance back from this droplet to its 'k' droplet (see
+ *    `rain_chunk.c').  content_length is the length of the file.
+ *
+ *  - droplet format 0x70 ('p'):
+ *    `contents' is a 6-byte extent count and 6-byte data length, then a
+ *    6-byte offset and 6-byte length per extent of data, then the
+ *    extents' bytes (see `rain_sparse.c').  content_length is the length
+ *    of the file, holes included.
+ *
  *
  * Packed n-bit encoding:
  * ------------------------------------
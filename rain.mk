@@ -4,10 +4,23 @@ SRC = rain.c rain_main.c rain_hash.c rain_6_bit.c
 INCLUDES = rain.h
 
 # if you add extra .c files, add them here
-SRC += 
+SRC += rain_thread.c rain_lz.c rain_io.c rain_solid.c rain_codec.c
+SRC += rain_scan.c rain_repack.c rain_multi_hash.c
+SRC += rain_crc32c.c rain_checksums.c rain_sha256.c rain_digest.c
+SRC += rain_watermark.c rain_scrub.c rain_sample.c rain_salvage.c
+SRC += rain_multi_check.c rain_parallel_create.c rain_walk.c
+SRC += rain_pipeline.c rain_batch.c rain_append.c rain_pathname_set.c
+SRC += rain_reference.c rain_chunk.c rain_sparse.c rain_update.c
+SRC += rain_compact.c
 
 # if you add extra .h files, add them here
 INCLUDES +=
 
+LDLIBS += -lm -pthread
+
 rain:	$(SRC) $(INCLUDES)
-	$(CC) $(SRC) -o $@
+	$(CC) $(CFLAGS) $(SRC) -o $@ $(LDLIBS)
+
+.PHONY: test
+test:	rain
+	sh tests/packed_formats.sh ./rain
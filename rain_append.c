@@ -0,0 +1,176 @@
+// This file provides appending to a drop safely while other processes
+// append to or read it
+//
+// A writer reserves the bytes its droplets will take at the end of the
+// drop: holding flock on the drop, it takes a write lock on the range
+// from the current end, then grows the drop over it.  Only then does it
+// let the next writer reserve, so writers' ranges never overlap, and
+// each fills its own range in parallel with the others before unlocking
+// it.  The range locks are open file description locks, so they belong
+// to the open drop rather than the process and are dropped if a writer
+// dies.
+//
+// A reader takes a read lock on the whole drop as it is when it starts,
+// which waits for every writer with a range in it to finish, so it only
+// ever sees whole droplets.  It lets go at once: anything appended later
+// is past the end it read up to.
+//
+// Compact holds flock while it rewrites the drop, then renames the new
+// drop over it, so a writer which was waiting to reserve finds the drop
+// it has open unlinked.
+//
+// A writer which can not finish its range gives it back: under flock,
+// the drop is cut back to the start of the range if nothing has been
+// reserved after it, otherwise the range is filled with one chunk
+// droplet with an empty pathname, which no chunk map refers to, so list,
+// check and extract pass over it and compact removes it.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "rain.h"
+
+#define PADDING_WRITE (1024 * 1024)
+
+// sets an open file description lock on length bytes from offset,
+// waiting for any conflicting lock to go
+// file systems without these locks are left unlocked
+static void lock_range(int fd, short type, off_t offset, uint64_t length) {
+    struct flock lock = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+        .l_start = offset,
+        .l_len = length,
+    };
+    while (fcntl(fd, F_OFD_SETLKW, &lock) != 0) {
+        if (errno != EINTR) {
+            if (errno != EINVAL && errno != ENOLCK) {
+                perror("fcntl");
+                exit(1);
+            }
+            return;
+        }
+    }
+}
+
+// reserves length bytes at the end of the drop open for writing on fd
+// returns the offset of the range, which is locked until
+// release_drop_range; the drop is grown to cover it
+off_t reserve_drop_range(int fd, uint64_t length) {
+    if (flock(fd, LOCK_EX) != 0) {
+        perror("flock");
+        exit(1);
+    }
+    struct stat stats;
+    if (fstat(fd, &stats) != 0) {
+        perror("fstat");
+        exit(1);
+    }
+    // compact renames a new drop over the one this writer opened
+    if (stats.st_nlink == 0) {
+        fprintf(stderr, "error: drop was replaced while appending to it\n");
+        exit(1);
+    }
+    off_t offset = stats.st_size;
+    if (length > 0) {
+        lock_range(fd, F_WRLCK, offset, length);
+        if (fallocate(fd, 0, offset, length) != 0 && ftruncate(fd, offset + length) != 0) {
+            perror("ftruncate");
+            exit(1);
+        }
+    }
+    if (flock(fd, LOCK_UN) != 0) {
+        perror("flock");
+        exit(1);
+    }
+    return offset;
+}
+
+// lets readers see a range reserved with reserve_drop_range, once every
+// droplet in it has been written
+void release_drop_range(int fd, off_t offset, uint64_t length) {
+    if (length > 0) {
+        lock_range(fd, F_UNLCK, offset, length);
+    }
+}
+
+// writes a chunk droplet of zeroes over the length bytes from offset of
+// the drop open on fd, so they hold one whole droplet
+// length is at least that of a droplet with no pathname or contents
+static void write_padding_droplet(int fd, off_t offset, uint64_t length) {
+    uint8_t header[DROP_OFFSET_PATHNLEN + DROP_LENGTH_PATHNLEN + DROP_LENGTH_CONTLEN];
+    uint64_t content_length = length - sizeof header - DROP_LENGTH_HASH;
+    header[DROP_OFFSET_MAGIC] = DROPLET_MAGIC;
+    header[DROP_OFFSET_FORMAT] = DROPLET_FMT_CHUNK;
+    memset(header + DROP_OFFSET_MODE, '-', DROP_LENGTH_MODE);
+    store_little_endian(header + DROP_OFFSET_PATHNLEN, 0, DROP_LENGTH_PATHNLEN);
+    store_little_endian(header + DROP_OFFSET_PATHNLEN + DROP_LENGTH_PATHNLEN, content_length,
+        DROP_LENGTH_CONTLEN);
+    uint8_t hash = droplet_hash_bytes(0, header, sizeof header);
+    bool written = pwrite(fd, header, sizeof header, offset) == (ssize_t)sizeof header;
+
+    uint8_t *zeroes = calloc(PADDING_WRITE, 1);
+    for (uint64_t done = 0; written && done < content_length;) {
+        size_t n = content_length - done < PADDING_WRITE ? content_length - done : PADDING_WRITE;
+        ssize_t n_written = pwrite(fd, zeroes, n, offset + sizeof header + done);
+        written = n_written > 0;
+        hash = droplet_hash_bytes(hash, zeroes, written ? n_written : 0);
+        done += written ? n_written : 0;
+    }
+    free(zeroes);
+    if (!written || pwrite(fd, &hash, DROP_LENGTH_HASH, offset + length - DROP_LENGTH_HASH) != DROP_LENGTH_HASH) {
+        perror("pwrite");
+        exit(1);
+    }
+}
+
+// gives back a range reserved with reserve_drop_range whose droplets
+// could not all be written, leaving the drop as if it had not been
+// reserved, or with the range holding one droplet which is passed over
+void abandon_drop_range(int fd, off_t offset, uint64_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        perror("flock");
+        exit(1);
+    }
+    struct stat stats;
+    if (fstat(fd, &stats) != 0) {
+        perror("fstat");
+        exit(1);
+    }
+    if ((uint64_t)stats.st_size != offset + length || ftruncate(fd, offset) != 0) {
+        write_padding_droplet(fd, offset, length);
+    }
+    if (flock(fd, LOCK_UN) != 0) {
+        perror("flock");
+        exit(1);
+    }
+    release_drop_range(fd, offset, length);
+}
+
+// returns the length of the drop open for reading on fd, once every
+// droplet appended within that length has been written, or -1 if fstat
+// fails
+off_t settled_drop_size(int fd) {
+    struct stat stats;
+    if (fstat(fd, &stats) != 0) {
+        return -1;
+    }
+    if (stats.st_size > 0) {
+        lock_range(fd, F_RDLCK, 0, stats.st_size);
+        lock_range(fd, F_UNLCK, 0, stats.st_size);
+    }
+    return stats.st_size;
+}
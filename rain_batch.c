@@ -0,0 +1,251 @@
+// This file provides batch mode, which runs a manifest of operations on
+// many drops in one process
+//
+// Each line of the manifest is one operation: a mode, a drop and, for
+// extract, a directory to extract into, separated by tabs.  Operations
+// run on the threads of the pool, as many at once as there are threads,
+// and each writes what it prints to buffers of its own.  As each one
+// finishes its result is printed on stdout as one line of JSON, so a
+// thousand small drops cost one process rather than a thousand.
+//
+// The working directory is shared by every thread of a process, so an
+// extract into a directory first gives its thread a working directory
+// of its own with unshare(CLONE_FS).  The threads it starts to decode
+// files share that working directory with it.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+enum batch_mode {
+    BATCH_LIST,
+    BATCH_LIST_LONG,
+    BATCH_CHECK,
+    BATCH_EXTRACT,
+};
+
+static const char *batch_mode_name[] = {
+    [BATCH_LIST]      = "list",
+    [BATCH_LIST_LONG] = "list-long",
+    [BATCH_CHECK]     = "check",
+    [BATCH_EXTRACT]   = "extract",
+};
+
+struct batch_operation {
+    size_t line;                 /**< Line of the manifest it is on. */
+    enum batch_mode mode;
+    char *drop_pathname;
+    char *destination;           /**< NULL to extract where rain runs. */
+};
+
+struct batch {
+    struct batch_operation *operations;
+    size_t n_operations;
+    enum bad_hash_policy policy;
+    int check_options;
+    pthread_mutex_t print_lock;
+    size_t n_failed;
+};
+
+// prints bytes as the contents of a JSON string
+static void print_json_string(FILE *stream, const char *bytes, size_t length) {
+    fputc('"', stream);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char byte = bytes[i];
+        if (byte == '"' || byte == '\\') {
+            fprintf(stream, "\\%c", byte);
+        } else if (byte == '\n') {
+            fputs("\\n", stream);
+        } else if (byte == '\t') {
+            fputs("\\t", stream);
+        } else if (byte < 0x20 || byte == 0x7f) {
+            fprintf(stream, "\\u%04x", byte);
+        } else {
+            fputc(byte, stream);
+        }
+    }
+    fputc('"', stream);
+}
+
+// extracts a drop into operation->destination, which is made if need be
+// relative pathnames in the operation are taken from where rain runs
+static bool extract_into(struct batch *batch, struct batch_operation *operation, FILE *output_stream,
+    FILE *error_stream) {
+    char *drop_pathname = realpath(operation->drop_pathname, NULL);
+    if (drop_pathname == NULL) {
+        fprintf(error_stream, "%s: %s\n", operation->drop_pathname, strerror(errno));
+        return false;
+    }
+    if (mkdir(operation->destination, 0777) != 0 && errno != EEXIST) {
+        fprintf(error_stream, "%s: %s\n", operation->destination, strerror(errno));
+        free(drop_pathname);
+        return false;
+    }
+
+    // from here on this thread's working directory is its own
+    if (unshare(CLONE_FS) != 0) {
+        perror("unshare");
+        exit(1);
+    }
+    int cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    bool correct = false;
+    if (chdir(operation->destination) != 0) {
+        fprintf(error_stream, "%s: %s\n", operation->destination, strerror(errno));
+    } else {
+        correct = extract_drop(drop_pathname, batch->policy, output_stream, error_stream);
+    }
+    if (fchdir(cwd_fd) != 0) {
+        perror("fchdir");
+        exit(1);
+    }
+    close(cwd_fd);
+    free(drop_pathname);
+    return correct;
+}
+
+static void run_operation(void *context, size_t item) {
+    struct batch *batch = context;
+    struct batch_operation *operation = &batch->operations[item];
+    char *output, *errors;
+    size_t output_length, errors_length;
+    FILE *output_stream = open_memstream(&output, &output_length);
+    FILE *error_stream = open_memstream(&errors, &errors_length);
+    if (output_stream == NULL || error_stream == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+
+    bool correct;
+    if (operation->mode == BATCH_LIST || operation->mode == BATCH_LIST_LONG) {
+        correct = list_drop(operation->drop_pathname, operation->mode == BATCH_LIST_LONG,
+            output_stream, error_stream);
+    } else if (operation->mode == BATCH_CHECK) {
+        correct = check_drop(operation->drop_pathname, batch->check_options, output_stream, error_stream);
+    } else if (operation->destination != NULL) {
+        correct = extract_into(batch, operation, output_stream, error_stream);
+    } else {
+        correct = extract_drop(operation->drop_pathname, batch->policy, output_stream, error_stream);
+    }
+    fclose(output_stream);
+    fclose(error_stream);
+
+    pthread_mutex_lock(&batch->print_lock);
+    printf("{\"line\":%zu,\"mode\":\"%s\",\"drop\":", operation->line, batch_mode_name[operation->mode]);
+    print_json_string(stdout, operation->drop_pathname, strlen(operation->drop_pathname));
+    if (operation->destination != NULL) {
+        printf(",\"destination\":");
+        print_json_string(stdout, operation->destination, strlen(operation->destination));
+    }
+    printf(",\"ok\":%s,\"output\":", correct ? "true" : "false");
+    print_json_string(stdout, output, output_length);
+    printf(",\"errors\":");
+    print_json_string(stdout, errors, errors_length);
+    printf("}\n");
+    fflush(stdout);
+    batch->n_failed += !correct;
+    pthread_mutex_unlock(&batch->print_lock);
+    free(output);
+    free(errors);
+}
+
+// parses one line of the manifest, which is changed in place
+// returns false if the line is not a valid operation
+static bool parse_operation(char *line, struct batch_operation *operation) {
+    char *fields[4];
+    int n_fields = 0;
+    char *rest = line;
+    while (n_fields < 4 && rest != NULL) {
+        fields[n_fields++] = strsep(&rest, "\t");
+    }
+    if (n_fields < 2 || n_fields > 3 || rest != NULL || fields[1][0] == '\0') {
+        return false;
+    }
+
+    int mode;
+    for (mode = BATCH_LIST; mode <= BATCH_EXTRACT; mode++) {
+        if (strcmp(fields[0], batch_mode_name[mode]) == 0) {
+            break;
+        }
+    }
+    if (mode > BATCH_EXTRACT || (n_fields == 3 && (mode != BATCH_EXTRACT || fields[2][0] == '\0'))) {
+        return false;
+    }
+    operation->mode = mode;
+    operation->drop_pathname = strdup(fields[1]);
+    operation->destination = n_fields == 3 ? strdup(fields[2]) : NULL;
+    return true;
+}
+
+// runs every operation of the manifest at manifest_pathname, "-" for
+// stdin, printing a line of JSON with the result of each as it finishes
+// policy and check_options apply to every extract and check
+// exits with status 1 if the manifest is invalid or any operation failed
+void run_batch(char *manifest_pathname, enum bad_hash_policy policy, int check_options) {
+    FILE *manifest = strcmp(manifest_pathname, "-") == 0 ? stdin : fopen(manifest_pathname, "r");
+    if (manifest == NULL) {
+        perror(manifest_pathname);
+        exit(1);
+    }
+
+    struct batch batch = {
+        .policy = policy,
+        .check_options = check_options,
+    };
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    for (size_t line_number = 1; (line_length = getline(&line, &line_capacity, manifest)) != -1; line_number++) {
+        if (line_length > 0 && line[line_length - 1] == '\n') {
+            line[--line_length] = '\0';
+        }
+        // blank lines and comments are skipped
+        if (line_length == 0 || line[0] == '#') {
+            continue;
+        }
+        if (batch.n_operations == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            batch.operations = realloc(batch.operations, capacity * sizeof *batch.operations);
+        }
+        struct batch_operation *operation = &batch.operations[batch.n_operations++];
+        operation->line = line_number;
+        if (!parse_operation(line, operation)) {
+            fprintf(stderr, "error: %s line %zu should be: list|list-long|check|extract<TAB>drop"
+                "[<TAB>directory]\n", manifest_pathname, line_number);
+            exit(1);
+        }
+    }
+    free(line);
+    if (manifest != stdin) {
+        fclose(manifest);
+    }
+
+    pthread_mutex_init(&batch.print_lock, NULL);
+    parallel_for(batch.n_operations, run_operation, &batch);
+    pthread_mutex_destroy(&batch.print_lock);
+
+    for (size_t i = 0; i < batch.n_operations; i++) {
+        free(batch.operations[i].drop_pathname);
+        free(batch.operations[i].destination);
+    }
+    free(batch.operations);
+    if (batch.n_failed > 0) {
+        fprintf(stderr, "%zu of %zu operations failed\n", batch.n_failed, batch.n_operations);
+        exit(1);
+    }
+}
@@ -0,0 +1,398 @@
+// This file provides the optional checksum file kept next to a drop
+//
+// droplet_hash is a single byte, so it misses 1 in 256 corruptions.
+// Drops created with -K, and drops which already have a checksum file,
+// get a CRC32C of every droplet recorded in <drop>.sums, plus a CRC32C
+// of each block of droplets longer than one block, so check can say
+// where damage starts.  Each droplet's SHA-256 digest is recorded too,
+// along with the Merkle root of them all (see rain_digest.c).  The drop
+// itself is unchanged and stays readable by anything that understands
+// the drop format.
+//
+// the checksum file is text, a fixed width first line which is
+// rewritten in place as droplets are added, then one line per droplet:
+//     rain-checksums crc32c <block-size> sha256 <bytes-covered> <n-droplets> <root>
+//     <offset> <length> <digest> <crc> [<block-crc> ...]
+// droplets are recorded from the start of the drop with no gaps
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "rain.h"
+
+#define CHECKSUM_SUFFIX ".sums"
+#define CHECKSUM_MAGIC "rain-checksums"
+#define CHECKSUM_ALGORITHM "crc32c"
+#define CHECKSUM_DIGEST "sha256"
+#define CHECKSUM_BLOCK (1024 * 1024)
+#define CHECKSUM_HEADER_FORMAT CHECKSUM_MAGIC " " CHECKSUM_ALGORITHM " %" PRIu64 " " \
+    CHECKSUM_DIGEST " %016" PRIu64 " %016zu %64s\n"
+
+// returns the malloc'd pathname of the checksum file for drop_pathname
+char *checksum_pathname(char *drop_pathname) {
+    char *pathname = malloc(strlen(drop_pathname) + sizeof CHECKSUM_SUFFIX);
+    strcpy(pathname, drop_pathname);
+    strcat(pathname, CHECKSUM_SUFFIX);
+    return pathname;
+}
+
+bool checksums_exist(char *drop_pathname) {
+    char *pathname = checksum_pathname(drop_pathname);
+    bool exists = access(pathname, F_OK) == 0;
+    free(pathname);
+    return exists;
+}
+
+void remove_checksums(char *drop_pathname) {
+    char *pathname = checksum_pathname(drop_pathname);
+    if (unlink(pathname) != 0 && errno != ENOENT) {
+        perror(pathname);
+        exit(1);
+    }
+    free(pathname);
+}
+
+// reads a digest written as hex
+// returns false if text does not start with one
+bool parse_digest(const char *text, uint8_t digest[SHA256_LENGTH]) {
+    for (int i = 0; i < SHA256_LENGTH; i++) {
+        unsigned byte;
+        if (sscanf(text + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        digest[i] = byte;
+    }
+    return true;
+}
+
+void format_digest(const uint8_t digest[SHA256_LENGTH], char text[2 * SHA256_LENGTH + 1]) {
+    for (int i = 0; i < SHA256_LENGTH; i++) {
+        sprintf(text + 2 * i, "%02x", digest[i]);
+    }
+}
+
+static void checksum_file_error(char *pathname) {
+    fprintf(stderr, "error: %s is not a valid checksum file\n", pathname);
+    exit(1);
+}
+
+// reads the checksum file of drop_pathname
+// returns NULL if the drop has none
+struct drop_checksums *load_checksums(char *drop_pathname) {
+    char *pathname = checksum_pathname(drop_pathname);
+    FILE *input_stream = fopen(pathname, "r");
+    if (input_stream == NULL) {
+        if (errno != ENOENT) {
+            perror(pathname);
+            exit(1);
+        }
+        free(pathname);
+        return NULL;
+    }
+
+    struct drop_checksums *checksums = calloc(1, sizeof *checksums);
+    char root[2 * SHA256_LENGTH + 1];
+    if (fscanf(input_stream, CHECKSUM_HEADER_FORMAT, &checksums->block_size,
+            &checksums->covered_length, &checksums->n_recorded, root) != 4 ||
+        checksums->block_size == 0 || !parse_digest(root, checksums->root)) {
+        checksum_file_error(pathname);
+    }
+
+    size_t capacity = 64;
+    checksums->droplets = malloc(capacity * sizeof *checksums->droplets);
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, input_stream) > 0) {
+        if (checksums->n_droplets == capacity) {
+            capacity *= 2;
+            checksums->droplets = realloc(checksums->droplets, capacity * sizeof *checksums->droplets);
+        }
+        struct droplet_checksum *droplet = &checksums->droplets[checksums->n_droplets];
+        char *end;
+        droplet->offset = strtoull(line, &end, 10);
+        droplet->length = strtoull(end, &end, 10);
+        while (*end == ' ') {
+            end++;
+        }
+        if (!parse_digest(end, droplet->digest)) {
+            checksum_file_error(pathname);
+        }
+        droplet->crc = strtoul(end + 2 * SHA256_LENGTH, &end, 16);
+        droplet->n_blocks = 0;
+        droplet->block_crcs = NULL;
+        if (droplet->length > checksums->block_size) {
+            droplet->n_blocks = (droplet->length + checksums->block_size - 1) / checksums->block_size;
+            droplet->block_crcs = malloc(droplet->n_blocks * sizeof (uint32_t));
+            for (size_t i = 0; i < droplet->n_blocks; i++) {
+                char *start = end;
+                droplet->block_crcs[i] = strtoul(start, &end, 16);
+                if (end == start) {
+                    checksum_file_error(pathname);
+                }
+            }
+        }
+        checksums->n_droplets++;
+    }
+    free(line);
+    fclose(input_stream);
+    free(pathname);
+    return checksums;
+}
+
+void free_checksums(struct drop_checksums *checksums) {
+    if (checksums == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < checksums->n_droplets; i++) {
+        free(checksums->droplets[i].block_crcs);
+    }
+    free(checksums->droplets);
+    free(checksums);
+}
+
+// returns the checksum of the droplet at offset, or NULL if it has none
+// droplets are recorded in order so a binary search finds it
+struct droplet_checksum *find_checksum(struct drop_checksums *checksums, off_t offset) {
+    if (checksums == NULL) {
+        return NULL;
+    }
+    size_t low = 0;
+    size_t high = checksums->n_droplets;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (checksums->droplets[middle].offset < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < checksums->n_droplets && checksums->droplets[low].offset == offset) {
+        return &checksums->droplets[low];
+    }
+    return NULL;
+}
+
+// droplets longer than a block are checked block by block, a droplet
+// whose blocks are all correct has the correct CRC as a whole
+static bool block_correct(struct droplet_checksum *checksum, size_t block, const uint8_t *bytes, size_t n) {
+    if (checksum->n_blocks == 0) {
+        return crc32c(0, bytes, n) == checksum->crc;
+    }
+    return block < checksum->n_blocks && crc32c(0, bytes, n) == checksum->block_crcs[block];
+}
+
+// checks the length bytes of a droplet at bytes against its checksum
+// returns the offset in the droplet of the first bad block, or -1
+int64_t verify_droplet_checksum(struct drop_checksums *checksums, struct droplet_checksum *checksum,
+    const uint8_t *bytes, uint64_t length) {
+    if (checksum->length != length) {
+        return 0;
+    }
+    uint64_t block_size = checksum->n_blocks > 0 ? checksums->block_size : length;
+    for (uint64_t start = 0, block = 0; start < length; start += block_size, block++) {
+        size_t n = length - start < block_size ? length - start : block_size;
+        if (!block_correct(checksum, block, bytes + start, n)) {
+            return start;
+        }
+    }
+    return -1;
+}
+
+// checks a droplet of the drop open on fd against its checksum a block
+// at a time, for droplets too big to read at once
+// returns the offset in the droplet of the first bad block, or -1
+int64_t verify_droplet_checksum_range(int fd, struct drop_checksums *checksums,
+    struct droplet_checksum *checksum, uint64_t length) {
+    if (checksum->length != length) {
+        return 0;
+    }
+    uint64_t block_size = checksum->n_blocks > 0 ? checksums->block_size : length;
+    uint8_t *block = malloc(block_size);
+    int64_t bad_offset = -1;
+    for (uint64_t start = 0, i = 0; start < length; start += block_size, i++) {
+        size_t n = length - start < block_size ? length - start : block_size;
+        if (pread(fd, block, n, checksum->offset + start) != (ssize_t)n) {
+            perror("partially created droplet/EOF found");
+            exit(1);
+        }
+        if (!block_correct(checksum, i, block, n)) {
+            bad_offset = start;
+            break;
+        }
+    }
+    free(block);
+    return bad_offset;
+}
+
+// reads the first line of the checksum file of drop_pathname, enough to
+// know the Merkle root without reading the rest
+// returns false if the drop has no checksum file
+bool read_checksum_root(char *drop_pathname, uint64_t *covered_length, size_t *n_droplets,
+    uint8_t root[SHA256_LENGTH]) {
+    char *pathname = checksum_pathname(drop_pathname);
+    FILE *input_stream = fopen(pathname, "r");
+    if (input_stream == NULL) {
+        free(pathname);
+        return false;
+    }
+    uint64_t block_size;
+    char root_text[2 * SHA256_LENGTH + 1];
+    if (fscanf(input_stream, CHECKSUM_HEADER_FORMAT, &block_size, covered_length,
+            n_droplets, root_text) != 4 || !parse_digest(root_text, root)) {
+        checksum_file_error(pathname);
+    }
+    fclose(input_stream);
+    free(pathname);
+    return true;
+}
+
+struct checksum_job {
+    int fd;
+    struct droplet_header *headers;
+    struct droplet_checksum *checksums;
+};
+
+// works out the CRCs and digest of one droplet, a block at a time
+static void checksum_droplet(void *context, size_t item) {
+    struct checksum_job *job = context;
+    struct droplet_header *header = &job->headers[item];
+    struct droplet_checksum *checksum = &job->checksums[item];
+    checksum->offset = header->offset;
+    checksum->length = header->length;
+    checksum->crc = 0;
+    checksum->n_blocks = header->length > CHECKSUM_BLOCK ?
+        (header->length + CHECKSUM_BLOCK - 1) / CHECKSUM_BLOCK : 0;
+    checksum->block_crcs = malloc((checksum->n_blocks + 1) * sizeof (uint32_t));
+
+    struct sha256 sha;
+    sha256_init(&sha);
+    sha256_update(&sha, (const uint8_t *)MERKLE_LEAF_PREFIX, 1);
+    size_t block_length = header->length < CHECKSUM_BLOCK ? header->length : CHECKSUM_BLOCK;
+    uint8_t *block = malloc(block_length);
+    for (uint64_t start = 0, i = 0; start < header->length; start += CHECKSUM_BLOCK, i++) {
+        size_t n = header->length - start < CHECKSUM_BLOCK ? header->length - start : CHECKSUM_BLOCK;
+        if (pread(job->fd, block, n, header->offset + start) != (ssize_t)n) {
+            perror("partially created droplet/EOF found");
+            exit(1);
+        }
+        if (i < checksum->n_blocks) {
+            checksum->block_crcs[i] = crc32c(0, block, n);
+        }
+        checksum->crc = crc32c(checksum->crc, block, n);
+        sha256_update(&sha, block, n);
+    }
+    sha256_final(&sha, checksum->digest);
+    free(block);
+}
+
+// records the checksums of every droplet of drop_pathname not yet in its
+// checksum file, starting the file if there is none, then updates the root
+void update_checksums(char *drop_pathname) {
+    int input_fd = open(drop_pathname, O_RDONLY);
+    // writers appending at once take turns to update the checksums
+    if (input_fd < 0 || flock(input_fd, LOCK_EX) != 0) {
+        perror(drop_pathname);
+        exit(1);
+    }
+    off_t drop_size = settled_drop_size(input_fd);
+    if (drop_size < 0) {
+        perror(drop_pathname);
+        exit(1);
+    }
+
+    struct drop_checksums *checksums = load_checksums(drop_pathname);
+    if (checksums != NULL && checksums->covered_length > (uint64_t)drop_size) {
+        // the drop has been rewritten since, start again
+        free_checksums(checksums);
+        checksums = NULL;
+    }
+    off_t offset = checksums != NULL ? (off_t)checksums->covered_length : 0;
+
+    size_t n_new = 0;
+    size_t capacity = 64;
+    struct droplet_header *headers = malloc(capacity * sizeof *headers);
+    enum scan_result result;
+    while ((result = read_droplet_header(input_fd, offset, drop_size, &headers[n_new])) == SCAN_OK) {
+        offset += headers[n_new].length;
+        if (++n_new == capacity) {
+            capacity *= 2;
+            headers = realloc(headers, capacity * sizeof *headers);
+        }
+    }
+    if (result != SCAN_END) {
+        scan_error(result, &headers[n_new]);
+    }
+
+    struct checksum_job job = {
+        .fd = input_fd,
+        .headers = headers,
+        .checksums = malloc((n_new + 1) * sizeof (struct droplet_checksum)),
+    };
+    parallel_for(n_new, checksum_droplet, &job);
+
+    char *pathname = checksum_pathname(drop_pathname);
+    FILE *output_stream = fopen(pathname, checksums != NULL ? "r+" : "w");
+    if (output_stream == NULL) {
+        perror(pathname);
+        exit(1);
+    }
+    fseek(output_stream, 0, SEEK_END);
+    if (checksums == NULL) {
+        // a placeholder first line, filled in below
+        fprintf(output_stream, CHECKSUM_HEADER_FORMAT, (uint64_t)CHECKSUM_BLOCK, (uint64_t)0,
+            (size_t)0, "");
+        fseek(output_stream, 0, SEEK_SET);
+        fprintf(output_stream, "%*s", (int)ftell(output_stream), "");
+        fseek(output_stream, 0, SEEK_END);
+    }
+
+    size_t n_old = checksums != NULL ? checksums->n_droplets : 0;
+    uint8_t (*leaves)[SHA256_LENGTH] = malloc((n_old + n_new + 1) * SHA256_LENGTH);
+    for (size_t i = 0; i < n_old; i++) {
+        memcpy(leaves[i], checksums->droplets[i].digest, SHA256_LENGTH);
+    }
+    for (size_t i = 0; i < n_new; i++) {
+        struct droplet_checksum *checksum = &job.checksums[i];
+        char digest[2 * SHA256_LENGTH + 1];
+        format_digest(checksum->digest, digest);
+        fprintf(output_stream, "%jd %" PRIu64 " %s %08" PRIx32, (intmax_t)checksum->offset,
+            checksum->length, digest, checksum->crc);
+        for (size_t j = 0; j < checksum->n_blocks; j++) {
+            fprintf(output_stream, " %08" PRIx32, checksum->block_crcs[j]);
+        }
+        fputc('\n', output_stream);
+        memcpy(leaves[n_old + i], checksum->digest, SHA256_LENGTH);
+        free(checksum->block_crcs);
+        free(headers[i].pathname);
+    }
+
+    // now every droplet is recorded fill in the first line
+    uint8_t root[SHA256_LENGTH];
+    char root_text[2 * SHA256_LENGTH + 1];
+    merkle_root(leaves, n_old + n_new, root);
+    format_digest(root, root_text);
+    fseek(output_stream, 0, SEEK_SET);
+    fprintf(output_stream, CHECKSUM_HEADER_FORMAT, (uint64_t)CHECKSUM_BLOCK, (uint64_t)offset,
+        n_old + n_new, root_text);
+
+    free(leaves);
+    free(job.checksums);
+    free(headers);
+    free_checksums(checksums);
+    if (fclose(output_stream) != 0) {
+        perror(pathname);
+        exit(1);
+    }
+    close(input_fd);
+    free(pathname);
+}
@@ -0,0 +1,392 @@
+// This file provides chunked files, stored as chunk droplets (0x6b, 'k')
+// each holding one piece of a file's contents and chunk map droplets
+// (0x6d, 'm') listing the chunks a file is made of
+//
+// Files are cut into chunks where a Gear rolling hash of the bytes
+// before hits a mask (FastCDC), so an edit only changes the chunks
+// around it and the chunks of the rest of the file are the same as
+// before.  Each chunk is named by its SHA-256; a chunk already in the
+// drop, or added earlier, is not stored again, so appending a new
+// version of a tree stores roughly the bytes that changed.
+//
+// 'k' droplet: an empty mode, the chunk's SHA-256 in hex as pathname,
+// and the chunk's bytes, stored as-is, as contents.
+//
+// 'm' droplet contents:
+//
+//  - chunk count:   6 bytes, little-endian
+//  - chunks:        per chunk, in order; a 6 byte distance back from the
+//                   'm' droplet to the 'k' droplet holding it
+//
+// content_length is the length of the file.  Chunks are only ever
+// referred to backwards, by distance, so a run of droplets can be moved
+// as a whole.  Extract reads each chunk of a file with one pread,
+// checks its droplet hash and writes it out.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+// FastCDC cut points, with normalised chunking to narrow the sizes
+#define CHUNK_MIN (2 * 1024)
+#define CHUNK_AVERAGE (8 * 1024)
+#define CHUNK_MAX (64 * 1024)
+#define CHUNK_MASK_SMALL 0x0003590703530000ULL
+#define CHUNK_MASK_LARGE 0x0000d90003530000ULL
+#define CHUNK_READ (1024 * 1024)
+
+#define CHUNK_PATHNAME_LENGTH (2 * SHA256_LENGTH)
+#define CHUNK_HEADER_LENGTH (DROP_OFFSET_PATHNLEN + DROP_LENGTH_PATHNLEN + CHUNK_PATHNAME_LENGTH + \
+    DROP_LENGTH_CONTLEN)
+#define CHUNK_TABLE_INITIAL 1024
+
+struct chunk_table {
+    uint8_t (*digests)[SHA256_LENGTH];
+    off_t *offsets;              /**< -1 where a slot is empty. */
+    size_t capacity;             /**< Always a power of two. */
+    size_t n_chunks;
+};
+
+static uint64_t gear[256];
+
+// fills the Gear table with splitmix64, the same on every run
+static void init_gear(void) {
+    uint64_t state = 0x7261696e63686b73;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// returns true if a regular file of this size is cut into chunks
+bool chunk_eligible(struct stat *stats) {
+    // files with holes are stored as their extents instead
+    return S_ISREG(stats->st_mode) && stats->st_size >= CHUNK_MIN && !sparse_candidate(stats);
+}
+
+// returns the length of the chunk at the start of the n bytes
+static size_t chunk_cut(const uint8_t *bytes, size_t n) {
+    if (n <= CHUNK_MIN) {
+        return n;
+    }
+    if (n > CHUNK_MAX) {
+        n = CHUNK_MAX;
+    }
+    size_t normal = n < CHUNK_AVERAGE ? n : CHUNK_AVERAGE;
+    uint64_t fingerprint = 0;
+    size_t i = CHUNK_MIN;
+    for (; i < normal; i++) {
+        fingerprint = (fingerprint << 1) + gear[bytes[i]];
+        if (!(fingerprint & CHUNK_MASK_SMALL)) {
+            return i + 1;
+        }
+    }
+    for (; i < n; i++) {
+        fingerprint = (fingerprint << 1) + gear[bytes[i]];
+        if (!(fingerprint & CHUNK_MASK_LARGE)) {
+            return i + 1;
+        }
+    }
+    return n;
+}
+
+struct chunk_table *chunk_table_new(void) {
+    if (gear[0] == 0) {
+        init_gear();
+    }
+    struct chunk_table *table = malloc(sizeof *table);
+    table->capacity = CHUNK_TABLE_INITIAL;
+    table->digests = malloc(table->capacity * sizeof *table->digests);
+    table->offsets = malloc(table->capacity * sizeof *table->offsets);
+    memset(table->offsets, 0xff, table->capacity * sizeof *table->offsets);
+    table->n_chunks = 0;
+    return table;
+}
+
+void chunk_table_free(struct chunk_table *table) {
+    free(table->digests);
+    free(table->offsets);
+    free(table);
+}
+
+// returns the slot holding digest, or the empty slot it would go in
+static size_t find_slot(struct chunk_table *table, const uint8_t digest[SHA256_LENGTH]) {
+    // a SHA-256 is already evenly spread, its first bytes do as a hash
+    size_t slot = load_little_endian(digest, 8) & (table->capacity - 1);
+    while (table->offsets[slot] >= 0 && memcmp(table->digests[slot], digest, SHA256_LENGTH) != 0) {
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    return slot;
+}
+
+// returns the offset of the chunk with this digest, or -1
+static off_t chunk_table_find(struct chunk_table *table, const uint8_t digest[SHA256_LENGTH]) {
+    return table->offsets[find_slot(table, digest)];
+}
+
+static void chunk_table_add(struct chunk_table *table, const uint8_t digest[SHA256_LENGTH], off_t offset) {
+    // kept at most half full so probes stay short
+    if (2 * (table->n_chunks + 1) > table->capacity) {
+        uint8_t (*digests)[SHA256_LENGTH] = table->digests;
+        off_t *offsets = table->offsets;
+        size_t capacity = table->capacity;
+        table->capacity *= 2;
+        table->digests = malloc(table->capacity * sizeof *table->digests);
+        table->offsets = malloc(table->capacity * sizeof *table->offsets);
+        memset(table->offsets, 0xff, table->capacity * sizeof *table->offsets);
+        for (size_t i = 0; i < capacity; i++) {
+            if (offsets[i] >= 0) {
+                size_t slot = find_slot(table, digests[i]);
+                memcpy(table->digests[slot], digests[i], SHA256_LENGTH);
+                table->offsets[slot] = offsets[i];
+            }
+        }
+        free(digests);
+        free(offsets);
+    }
+    size_t slot = find_slot(table, digest);
+    if (table->offsets[slot] < 0) {
+        memcpy(table->digests[slot], digest, SHA256_LENGTH);
+        table->offsets[slot] = offset;
+        table->n_chunks++;
+    }
+}
+
+// adds every chunk droplet of the first drop_size bytes of the drop open
+// on fd, read header by header
+// a damaged drop is only read up to the damage
+void chunk_table_add_drop_chunks(struct chunk_table *table, int fd, off_t drop_size) {
+    off_t offset = 0;
+    struct droplet_header header;
+    while (drop_size > 0 && read_droplet_header(fd, offset, drop_size, &header) == SCAN_OK) {
+        uint8_t digest[SHA256_LENGTH];
+        if (header.format == DROPLET_FMT_CHUNK && parse_digest(header.pathname, digest)) {
+            chunk_table_add(table, digest, offset);
+        }
+        offset += header.length;
+        free(header.pathname);
+    }
+}
+
+// writes the chunk droplet of the n bytes, named by digest, at the
+// position of output_stream
+// returns its length
+static size_t write_chunk_droplet(FILE *output_stream, const uint8_t *bytes, size_t n,
+    const uint8_t digest[SHA256_LENGTH]) {
+    uint8_t header[CHUNK_HEADER_LENGTH];
+    char pathname[CHUNK_PATHNAME_LENGTH + 1];
+    format_digest(digest, pathname);
+    header[DROP_OFFSET_MAGIC] = DROPLET_MAGIC;
+    header[DROP_OFFSET_FORMAT] = DROPLET_FMT_CHUNK;
+    memset(header + DROP_OFFSET_MODE, '-', DROP_LENGTH_MODE);
+    store_little_endian(header + DROP_OFFSET_PATHNLEN, CHUNK_PATHNAME_LENGTH, DROP_LENGTH_PATHNLEN);
+    memcpy(header + DROP_OFFSET_PATHNLEN + DROP_LENGTH_PATHNLEN, pathname, CHUNK_PATHNAME_LENGTH);
+    store_little_endian(header + CHUNK_HEADER_LENGTH - DROP_LENGTH_CONTLEN, n, DROP_LENGTH_CONTLEN);
+    uint8_t hash = droplet_hash_bytes(droplet_hash_bytes(0, header, CHUNK_HEADER_LENGTH), bytes, n);
+    if (fwrite(header, 1, sizeof header, output_stream) != sizeof header ||
+        fwrite(bytes, 1, n, output_stream) != n || fputc(hash, output_stream) == EOF) {
+        perror("fwrite");
+        exit(1);
+    }
+    return CHUNK_HEADER_LENGTH + n + DROP_LENGTH_HASH;
+}
+
+// adds the file at pathname as the chunk droplets of the chunks not in
+// table yet, then its 'm' droplet, writing them from amount_of_bytes on
+// base is the offset in the drop of the start of output_stream, as the
+// drop may be written to a file of its own first
+// returns amount of bytes so position can be recorded, and where the 'm'
+// droplet starts in *map_offset unless it is NULL
+long create_chunked_droplet(FILE *output_stream, struct chunk_table *table, off_t base, char *pathname,
+    struct stat *stats, long amount_of_bytes, long *map_offset) {
+    FILE *input_stream = fopen(pathname, "rb");
+    if (input_stream == NULL) {
+        perror(pathname);
+        exit(1);
+    }
+    printf("Adding: %s\n", pathname);
+    fseek(output_stream, amount_of_bytes, SEEK_SET);
+
+    uint8_t *bytes = malloc(CHUNK_READ + CHUNK_MAX);
+    off_t *chunk_offsets = NULL;
+    size_t n_chunks = 0, capacity = 0;
+    size_t start = 0, end = 0;
+    uint64_t remaining = stats->st_size;
+    while (remaining > 0 || start < end) {
+        // keep at least a whole chunk of the file buffered
+        if (end - start < CHUNK_MAX && remaining > 0) {
+            memmove(bytes, bytes + start, end - start);
+            end -= start;
+            start = 0;
+            size_t n = remaining < CHUNK_READ ? remaining : CHUNK_READ;
+            if (fread(bytes + end, 1, n, input_stream) != n) {
+                fprintf(stderr, "error: file changed size while being added\n");
+                exit(1);
+            }
+            end += n;
+            remaining -= n;
+        }
+        size_t length = chunk_cut(bytes + start, end - start);
+
+        uint8_t digest[SHA256_LENGTH];
+        struct sha256 sha;
+        sha256_init(&sha);
+        sha256_update(&sha, bytes + start, length);
+        sha256_final(&sha, digest);
+        off_t offset = chunk_table_find(table, digest);
+        if (offset < 0) {
+            offset = base + amount_of_bytes;
+            amount_of_bytes += write_chunk_droplet(output_stream, bytes + start, length, digest);
+            chunk_table_add(table, digest, offset);
+        }
+        if (n_chunks == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            chunk_offsets = realloc(chunk_offsets, capacity * sizeof *chunk_offsets);
+        }
+        chunk_offsets[n_chunks++] = offset;
+        start += length;
+    }
+    free(bytes);
+    if (fclose(input_stream) != 0) {
+        fprintf(stderr, "error: problem encounted with fclose\n");
+        exit(1);
+    }
+
+    size_t pathname_length = strlen(pathname);
+    size_t header_length = DROP_OFFSET_PATHNLEN + DROP_LENGTH_PATHNLEN + pathname_length + DROP_LENGTH_CONTLEN;
+    size_t droplet_length = header_length + CHUNK_COUNT_LENGTH + n_chunks * CHUNK_DISTANCE_LENGTH;
+    uint8_t *droplet = malloc(droplet_length + DROP_LENGTH_HASH);
+    char *permissions = convert_permissions_to_array(stats->st_mode);
+    droplet[DROP_OFFSET_MAGIC] = DROPLET_MAGIC;
+    droplet[DROP_OFFSET_FORMAT] = DROPLET_FMT_CHUNK_MAP;
+    memcpy(droplet + DROP_OFFSET_MODE, permissions, DROP_LENGTH_MODE);
+    free(permissions);
+    store_little_endian(droplet + DROP_OFFSET_PATHNLEN, pathname_length, DROP_LENGTH_PATHNLEN);
+    memcpy(droplet + DROP_OFFSET_PATHNLEN + DROP_LENGTH_PATHNLEN, pathname, pathname_length);
+    store_little_endian(droplet + header_length - DROP_LENGTH_CONTLEN, stats->st_size, DROP_LENGTH_CONTLEN);
+    store_little_endian(droplet + header_length, n_chunks, CHUNK_COUNT_LENGTH);
+    if (map_offset != NULL) {
+        *map_offset = amount_of_bytes;
+    }
+    for (size_t i = 0; i < n_chunks; i++) {
+        store_little_endian(droplet + header_length + CHUNK_COUNT_LENGTH + i * CHUNK_DISTANCE_LENGTH,
+            base + amount_of_bytes - chunk_offsets[i], CHUNK_DISTANCE_LENGTH);
+    }
+    droplet[droplet_length] = droplet_hash_bytes(0, droplet, droplet_length);
+    if (fwrite(droplet, 1, droplet_length + DROP_LENGTH_HASH, output_stream) != droplet_length + DROP_LENGTH_HASH) {
+        perror("fwrite");
+        exit(1);
+    }
+    free(droplet);
+    free(chunk_offsets);
+    return amount_of_bytes + droplet_length + DROP_LENGTH_HASH;
+}
+
+// returns a malloc'd copy of the whole 'm' droplet whose header is
+// header, in the drop open on fd, or NULL if it can not be read
+uint8_t *read_chunk_map(int fd, struct droplet_header *header) {
+    uint8_t *droplet = malloc(header->length);
+    if (pread(fd, droplet, header->length, header->offset) != (ssize_t)header->length) {
+        free(droplet);
+        return NULL;
+    }
+    return droplet;
+}
+
+// returns the offset of the i'th chunk of the 'm' droplet droplet, whose
+// header is header
+off_t chunk_map_offset(const uint8_t *droplet, struct droplet_header *header, uint64_t i) {
+    const uint8_t *distances = droplet + (header->content_offset - header->offset) + CHUNK_COUNT_LENGTH;
+    return header->offset - (off_t)load_little_endian(distances + i * CHUNK_DISTANCE_LENGTH,
+        CHUNK_DISTANCE_LENGTH);
+}
+
+// returns the number of chunks the 'm' droplet whose header is header lists
+uint64_t chunk_map_count(struct droplet_header *header) {
+    return (header->stored_length - CHUNK_COUNT_LENGTH) / CHUNK_DISTANCE_LENGTH;
+}
+
+// changes the offset of the i'th chunk of the 'm' droplet droplet, whose
+// header is header, to offset for a droplet now at new_offset
+// the hash is left for the caller to update
+void chunk_map_set_offset(uint8_t *droplet, struct droplet_header *header, uint64_t i, off_t new_offset,
+    off_t offset) {
+    uint8_t *distances = droplet + (header->content_offset - header->offset) + CHUNK_COUNT_LENGTH;
+    store_little_endian(distances + i * CHUNK_DISTANCE_LENGTH, new_offset - offset, CHUNK_DISTANCE_LENGTH);
+}
+
+// reads the chunk droplet at offset of the drop open on fd into bytes,
+// which holds CHUNK_HEADER_LENGTH + CHUNK_MAX + 1 bytes
+// returns the chunk's length, or -1 if it is not a whole chunk droplet
+// with a correct hash
+static long read_chunk(int fd, off_t offset, uint8_t *bytes) {
+    ssize_t n = pread(fd, bytes, CHUNK_HEADER_LENGTH + CHUNK_MAX + DROP_LENGTH_HASH, offset);
+    if (n < CHUNK_HEADER_LENGTH || bytes[DROP_OFFSET_MAGIC] != DROPLET_MAGIC ||
+        bytes[DROP_OFFSET_FORMAT] != DROPLET_FMT_CHUNK ||
+        load_little_endian(bytes + DROP_OFFSET_PATHNLEN, DROP_LENGTH_PATHNLEN) != CHUNK_PATHNAME_LENGTH) {
+        return -1;
+    }
+    uint64_t length = load_little_endian(bytes + CHUNK_HEADER_LENGTH - DROP_LENGTH_CONTLEN, DROP_LENGTH_CONTLEN);
+    if (length > CHUNK_MAX || n < (ssize_t)(CHUNK_HEADER_LENGTH + length + DROP_LENGTH_HASH) ||
+        droplet_hash_bytes(0, bytes, CHUNK_HEADER_LENGTH + length) != bytes[CHUNK_HEADER_LENGTH + length]) {
+        return -1;
+    }
+    return length;
+}
+
+// returns true if every chunk the 'm' droplet whose header is header
+// lists is a chunk droplet with a correct hash, and together they are
+// as long as the file
+bool chunk_map_valid(int fd, struct droplet_header *header) {
+    uint8_t *droplet = read_chunk_map(fd, header);
+    if (droplet == NULL) {
+        return false;
+    }
+    uint8_t *bytes = malloc(CHUNK_HEADER_LENGTH + CHUNK_MAX + DROP_LENGTH_HASH);
+    uint64_t total = 0;
+    bool valid = true;
+    for (uint64_t i = 0; valid && i < chunk_map_count(header); i++) {
+        long length = read_chunk(fd, chunk_map_offset(droplet, header, i), bytes);
+        valid = length >= 0;
+        total += length;
+    }
+    free(bytes);
+    free(droplet);
+    return valid && total == header->content_length;
+}
+
+// writes the file of the 'm' droplet whose header is header, in the drop
+// open on fd, to output_stream, putting the hash of the 'm' droplet
+// itself in *hash
+// returns false if a chunk is missing or damaged, or the chunks are not
+// as long as the file
+bool extract_chunked_file(int fd, struct droplet_header *header, FILE *output_stream, uint8_t *hash) {
+    uint8_t *droplet = read_chunk_map(fd, header);
+    if (droplet == NULL) {
+        perror("partially created droplet/EOF found");
+        exit(1);
+    }
+    *hash = droplet_hash_bytes(0, droplet, header->length - DROP_LENGTH_HASH);
+
+    uint8_t *bytes = malloc(CHUNK_HEADER_LENGTH + CHUNK_MAX + DROP_LENGTH_HASH);
+    uint64_t total = 0;
+    bool copied = true;
+    for (uint64_t i = 0; copied && i < chunk_map_count(header); i++) {
+        long length = read_chunk(fd, chunk_map_offset(droplet, header, i), bytes);
+        copied = length >= 0 && total + length <= header->content_length &&
+            fwrite(bytes + CHUNK_HEADER_LENGTH, 1, length, output_stream) == (size_t)length;
+        total += length;
+    }
+    free(bytes);
+    free(droplet);
+    return copied && total == header->content_length;
+}
@@ -0,0 +1,354 @@
+// This file provides the packed 6-bit and 7-bit codecs for droplet
+// contents, and streams that decode or encode droplet contents a chunk
+// at a time so no droplet ever has to fit in memory
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "rain.h"
+
+// bytes of stored contents decoded or encoded per step
+#define CODEC_CHUNK (256 * 1024)
+
+struct content_reader {
+    FILE *input_stream;
+    uint8_t format;
+    uint64_t remaining;         // content bytes not yet decoded
+    uint64_t stored_remaining;  // stored bytes not yet read
+    struct droplet_codec codec;
+    uint8_t *stored;
+    uint8_t *decoded;
+    size_t decoded_length;
+    size_t decoded_position;
+    struct lz_reader *lz;
+};
+
+static int codec_width(int format) {
+    if (format == DROPLET_FMT_6) {
+        return 6;
+    } else if (format == DROPLET_FMT_7) {
+        return 7;
+    }
+    return 8;
+}
+
+void codec_init(struct droplet_codec *codec, int format) {
+    codec->format = format;
+    codec->width = codec_width(format);
+    codec->bits = 0;
+    codec->n_bits = 0;
+}
+
+// packs n content bytes into output, which needs room for n bytes
+// returns the number of bytes written, or -1 if a byte can not be stored
+// in the codec's format (it is left in codec->bad_byte)
+long codec_encode(struct droplet_codec *codec, const uint8_t *input, size_t n, uint8_t *output) {
+    if (codec->width == 8) {
+        memcpy(output, input, n);
+        return n;
+    }
+
+    uint32_t bits = codec->bits;
+    int n_bits = codec->n_bits;
+    size_t op = 0;
+    for (size_t i = 0; i < n; i++) {
+        int value = input[i];
+        if (codec->format == DROPLET_FMT_6) {
+            value = droplet_to_6_bit(value);
+        } else if (value > 0x7f) {
+            value = -1;
+        }
+        if (value < 0) {
+            codec->bad_byte = input[i];
+            return -1;
+        }
+
+        bits = (bits << codec->width) | value;
+        n_bits += codec->width;
+        while (n_bits >= 8) {
+            n_bits -= 8;
+            output[op++] = bits >> n_bits;
+        }
+        bits &= (1u << n_bits) - 1;
+    }
+    codec->bits = bits;
+    codec->n_bits = n_bits;
+    return op;
+}
+
+// returns the first of the n bytes which can not be stored in format, or
+// -1 if every one of them can
+int codec_find_bad_byte(int format, const uint8_t *input, size_t n) {
+    if (format != DROPLET_FMT_6 && format != DROPLET_FMT_7) {
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (format == DROPLET_FMT_6 ? droplet_to_6_bit(input[i]) < 0 : input[i] > 0x7f) {
+            return input[i];
+        }
+    }
+    return -1;
+}
+
+// writes out any leftover bits, padded with trailing zeroes
+// returns the number of bytes written (0 or 1)
+size_t codec_encode_finish(struct droplet_codec *codec, uint8_t *output) {
+    if (codec->n_bits == 0) {
+        return 0;
+    }
+    output[0] = codec->bits << (8 - codec->n_bits);
+    codec->bits = 0;
+    codec->n_bits = 0;
+    return 1;
+}
+
+// unpacks n stored bytes into at most max_values content bytes
+// output needs room for (n * 8) / width + 1 bytes
+// returns the number of content bytes written
+size_t codec_decode(struct droplet_codec *codec, const uint8_t *input, size_t n, uint8_t *output, uint64_t max_values) {
+    if (codec->width == 8) {
+        size_t length = n < max_values ? n : max_values;
+        memcpy(output, input, length);
+        return length;
+    }
+
+    uint32_t bits = codec->bits;
+    int n_bits = codec->n_bits;
+    uint32_t mask = (1u << codec->width) - 1;
+    size_t op = 0;
+    for (size_t i = 0; i < n && op < max_values; i++) {
+        bits = (bits << 8) | input[i];
+        n_bits += 8;
+        while (n_bits >= codec->width && op < max_values) {
+            n_bits -= codec->width;
+            uint8_t value = (bits >> n_bits) & mask;
+            if (codec->format == DROPLET_FMT_6) {
+                // every six bit value has a translation
+                value = droplet_from_6_bit(value);
+            }
+            output[op++] = value;
+        }
+        bits &= (1u << n_bits) - 1;
+    }
+    codec->bits = bits;
+    codec->n_bits = n_bits;
+    return op;
+}
+
+// decodes the next chunk of contents into reader->decoded
+// returns false if the contents are corrupt
+static bool content_refill(struct content_reader *reader) {
+    reader->decoded_position = 0;
+    reader->decoded_length = 0;
+
+    if (reader->format == DROPLET_FMT_LZ) {
+        uint8_t *data;
+        long length = lz_reader_next(reader->lz, &data);
+        if (length <= 0 || (uint64_t)length > reader->remaining) {
+            return false;
+        }
+        reader->decoded = data;
+        reader->decoded_length = length;
+        reader->remaining -= length;
+        return true;
+    }
+
+    size_t n = reader->stored_remaining < CODEC_CHUNK ? reader->stored_remaining : CODEC_CHUNK;
+    if (fread(reader->stored, 1, n, reader->input_stream) != n) {
+        perror("partially created droplet/EOF found");
+        exit(1);
+    }
+    reader->stored_remaining -= n;
+    reader->decoded_length = codec_decode(&reader->codec, reader->stored, n,
+        reader->decoded, reader->remaining);
+    reader->remaining -= reader->decoded_length;
+    return reader->decoded_length > 0 || n > 0;
+}
+
+static ssize_t content_read(void *cookie, char *buffer, size_t size) {
+    struct content_reader *reader = cookie;
+    size_t copied = 0;
+    while (copied < size) {
+        if (reader->decoded_position == reader->decoded_length) {
+            if (reader->remaining == 0) {
+                break;
+            }
+            if (!content_refill(reader)) {
+                return -1;
+            }
+            continue;
+        }
+        size_t length = reader->decoded_length - reader->decoded_position;
+        if (length > size - copied) {
+            length = size - copied;
+        }
+        memcpy(buffer + copied, reader->decoded + reader->decoded_position, length);
+        reader->decoded_position += length;
+        copied += length;
+    }
+    return copied;
+}
+
+static int content_close(void *cookie) {
+    struct content_reader *reader = cookie;
+    if (reader->lz != NULL) {
+        lz_reader_close(reader->lz);
+    } else {
+        free(reader->decoded);
+    }
+    free(reader->stored);
+    free(reader);
+    return 0;
+}
+
+// returns a stream of the decoded contents of a droplet whose stored
+// contents start at the current position of input_stream
+// reading it reads input_stream up to the end of the contents
+// returns NULL if the format has no file contents or a block table is corrupt
+FILE *open_droplet_content(FILE *input_stream, uint8_t format, uint64_t content_length) {
+    if (format != DROPLET_FMT_6 && format != DROPLET_FMT_7 &&
+        format != DROPLET_FMT_8 && format != DROPLET_FMT_LZ) {
+        return NULL;
+    }
+
+    struct content_reader *reader = calloc(1, sizeof *reader);
+    reader->input_stream = input_stream;
+    reader->format = format;
+    reader->remaining = content_length;
+    codec_init(&reader->codec, format);
+
+    if (format == DROPLET_FMT_LZ) {
+        reader->lz = lz_reader_open(input_stream, content_length);
+        if (reader->lz == NULL) {
+            free(reader);
+            return NULL;
+        }
+    } else {
+        reader->stored_remaining = (content_length * reader->codec.width + 7) / 8;
+        reader->stored = malloc(CODEC_CHUNK);
+        reader->decoded = malloc(CODEC_CHUNK * 8 / 6 + 1);
+    }
+
+    cookie_io_functions_t functions = {
+        .read = content_read,
+        .close = content_close,
+    };
+    return fopencookie(reader, "rb", functions);
+}
+
+// decodes the contents of a droplet at the current position of
+// input_stream and writes the content_length bytes to output_stream
+// returns false if the contents are corrupt or the format unknown
+bool copy_droplet_content(FILE *input_stream, FILE *output_stream, uint8_t format, uint64_t content_length) {
+    FILE *content_stream = open_droplet_content(input_stream, format, content_length);
+    if (content_stream == NULL) {
+        return false;
+    }
+
+    uint8_t *buffer = malloc(CODEC_CHUNK);
+    uint64_t remaining = content_length;
+    while (remaining > 0) {
+        size_t n = remaining < CODEC_CHUNK ? remaining : CODEC_CHUNK;
+        size_t length = fread(buffer, 1, n, content_stream);
+        if (length == 0) {
+            break;
+        }
+        fwrite(buffer, 1, length, output_stream);
+        remaining -= length;
+    }
+    free(buffer);
+    fclose(content_stream);
+    return remaining == 0;
+}
+
+// reads content_length bytes from content_stream and writes them to
+// output_stream as the contents of a droplet of the given format
+// returns the number of bytes stored, or -1 if a byte can not be stored
+// in the format, which is left in *bad_byte, or -1 with *bad_byte -1 if
+// content_stream ended early, which has been reported
+int64_t write_droplet_content(FILE *content_stream, FILE *output_stream, int format, uint64_t content_length, int *bad_byte) {
+    if (format == DROPLET_FMT_LZ) {
+        return write_lz_content(content_stream, output_stream, content_length);
+    }
+
+    struct droplet_codec codec;
+    codec_init(&codec, format);
+    uint8_t *input = malloc(CODEC_CHUNK);
+    uint8_t *output = malloc(CODEC_CHUNK + 1);
+    uint64_t remaining = content_length;
+    int64_t stored_length = 0;
+    while (remaining > 0) {
+        size_t n = remaining < CODEC_CHUNK ? remaining : CODEC_CHUNK;
+        if (fread(input, 1, n, content_stream) != n) {
+            fprintf(stderr, "error: droplet contents ended early\n");
+            *bad_byte = -1;
+            stored_length = -1;
+            break;
+        }
+        long length = codec_encode(&codec, input, n, output);
+        if (length < 0) {
+            *bad_byte = codec.bad_byte;
+            stored_length = -1;
+            break;
+        }
+        fwrite(output, 1, length, output_stream);
+        stored_length += length;
+        remaining -= n;
+    }
+    if (stored_length >= 0) {
+        size_t length = codec_encode_finish(&codec, output);
+        fwrite(output, 1, length, output_stream);
+        stored_length += length;
+    }
+    free(input);
+    free(output);
+    return stored_length;
+}
+
+struct hashing_reader {
+    FILE *input_stream;
+    uint64_t remaining;
+    uint8_t *hash;
+};
+
+static ssize_t hashing_read(void *cookie, char *buffer, size_t size) {
+    struct hashing_reader *reader = cookie;
+    if (size > reader->remaining) {
+        size = reader->remaining;
+    }
+    size_t length = fread(buffer, 1, size, reader->input_stream);
+    *reader->hash = droplet_hash_bytes(*reader->hash, (uint8_t *)buffer, length);
+    reader->remaining -= length;
+    return length;
+}
+
+// the rest of the bytes still count towards the hash
+static int hashing_close(void *cookie) {
+    struct hashing_reader *reader = cookie;
+    char buffer[BUFSIZ];
+    while (reader->remaining > 0 && hashing_read(reader, buffer, sizeof buffer) > 0) {
+    }
+    free(reader);
+    return 0;
+}
+
+// returns a stream of the next length bytes of input_stream which folds
+// every byte read into *hash, so a droplet is hashed as it is decoded
+// closing it reads any of the length bytes left unread
+FILE *open_hashing_stream(FILE *input_stream, uint64_t length, uint8_t *hash) {
+    struct hashing_reader *reader = malloc(sizeof *reader);
+    reader->input_stream = input_stream;
+    reader->remaining = length;
+    reader->hash = hash;
+
+    cookie_io_functions_t functions = {
+        .read = hashing_read,
+        .close = hashing_close,
+    };
+    return fopencookie(reader, "rb", functions);
+}
@@ -0,0 +1,226 @@
+// This file provides compact mode, which rewrites a drop keeping only the
+// latest droplet of each pathname
+//
+// The droplet headers are gone through from the last back: a droplet is
+// kept if no later droplet has its pathname, or if a kept reference or
+// chunk map refers to it, which can only be to an earlier droplet.  A
+// solid block is kept if any of its members is the latest, and chunks
+// only if a kept chunk map lists them.  The first droplet of each
+// directory is kept as well as the last, as the files kept under it may
+// come before the last, and extract makes a directory from its droplet.
+// Droplets are position independent, so nothing is decoded: the droplets
+// kept are copied a run at a time with copy_file_range into a file next
+// to the drop, which is then renamed over it, and only references and
+// chunk maps are rewritten, with their distances changed.
+//
+// The drop is held under flock throughout, so appends wait for it, and
+// an append which was waiting finds the drop it opened gone and stops.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "rain.h"
+
+struct solid_latest {
+    struct pathname_set *seen;
+    bool latest;                 /**< Whether any member has not been seen. */
+};
+
+static void see_member(void *context, char *mode, char *pathname, uint64_t content_length) {
+    (void)mode;
+    (void)content_length;
+    struct solid_latest *solid = context;
+    solid->latest |= pathname_set_add(solid->seen, pathname);
+}
+
+static void compact_error(struct droplet_header *header, char *problem) {
+    fprintf(stderr, "error: %s %s, not compacting\n", header->pathname, problem);
+    exit(1);
+}
+
+// marks the droplets the reference or 'm' droplet headers[i] refers to
+// as kept
+static void keep_referred(int fd, struct droplet_header *headers, size_t i, bool *keep) {
+    struct droplet_header *header = &headers[i];
+    if (header->format == DROPLET_FMT_REF) {
+        char kind;
+        off_t target_offset;
+        size_t target = i;
+        if (read_reference(fd, header, &kind, &target_offset)) {
+            target = find_droplet(headers, i, target_offset);
+        }
+        if (target == i) {
+            compact_error(header, "has an incorrect reference");
+        }
+        keep[target] = true;
+    } else if (header->format == DROPLET_FMT_CHUNK_MAP) {
+        uint8_t *droplet = read_chunk_map(fd, header);
+        if (droplet == NULL) {
+            compact_error(header, "has incorrect chunks");
+        }
+        for (uint64_t j = 0; j < chunk_map_count(header); j++) {
+            size_t chunk = find_droplet(headers, i, chunk_map_offset(droplet, header, j));
+            if (chunk == i) {
+                compact_error(header, "has incorrect chunks");
+            }
+            keep[chunk] = true;
+        }
+        free(droplet);
+    }
+}
+
+// works out which of the n_droplets droplets of the drop open on fd to
+// keep
+// returns a malloc'd flag per droplet
+static bool *find_kept_droplets(int fd, struct droplet_header *headers, size_t n_droplets) {
+    bool *keep = calloc(n_droplets + 1, sizeof *keep);
+    struct pathname_set *seen = pathname_set_new();
+    for (size_t i = 0; i < n_droplets; i++) {
+        if (headers[i].format != DROPLET_FMT_SOLID && headers[i].mode[0] == 'd') {
+            keep[i] = pathname_set_add(seen, headers[i].pathname);
+        }
+    }
+    pathname_set_free(seen);
+
+    seen = pathname_set_new();
+    for (size_t i = n_droplets; i-- > 0;) {
+        struct droplet_header *header = &headers[i];
+        if (header->format == DROPLET_FMT_SOLID) {
+            struct solid_latest solid = { .seen = seen, .latest = false };
+            FILE *input_stream = open_pread_stream(fd, header->content_offset, header->stored_length);
+            if (!each_solid_member(input_stream, header->content_length, see_member, &solid)) {
+                fprintf(stderr, "error: solid block is corrupt, not compacting\n");
+                exit(1);
+            }
+            fclose(input_stream);
+            keep[i] |= solid.latest;
+        } else if (header->format != DROPLET_FMT_CHUNK) {
+            keep[i] |= pathname_set_add(seen, header->pathname);
+        }
+        if (keep[i]) {
+            keep_referred(fd, headers, i, keep);
+        }
+    }
+    pathname_set_free(seen);
+    return keep;
+}
+
+// copies the length bytes from offset of the drop open on input_fd to the
+// end of output_stream
+static void copy_run(int input_fd, off_t offset, uint64_t length, FILE *output_stream) {
+    if (length == 0) {
+        return;
+    }
+    fflush(output_stream);
+    off_t output_offset = ftell(output_stream);
+    if (!copy_file_bytes(input_fd, offset, fileno(output_stream), output_offset, length)) {
+        perror("copy_file_range");
+        exit(1);
+    }
+    fseek(output_stream, output_offset + length, SEEK_SET);
+}
+
+// opens a file next to drop_pathname, with the same permissions, to
+// write the compacted drop to; its name is put in *temp_pathname
+static FILE *open_compacted_drop(char *drop_pathname, int input_fd, char **temp_pathname) {
+    static const char suffix[] = ".rain-XXXXXX";
+    *temp_pathname = malloc(strlen(drop_pathname) + sizeof suffix);
+    strcpy(*temp_pathname, drop_pathname);
+    strcat(*temp_pathname, suffix);
+    int fd = mkstemp(*temp_pathname);
+    struct stat stats;
+    if (fd < 0 || fstat(input_fd, &stats) != 0 || fchmod(fd, stats.st_mode & 07777) != 0) {
+        perror(drop_pathname);
+        exit(1);
+    }
+    return fdopen(fd, "wb+");
+}
+
+// rewrites drop_pathname in place with only the latest droplet of each
+// pathname, and the droplets those refer to
+void compact_drop(char *drop_pathname) {
+    int input_fd = open(drop_pathname, O_RDWR);
+    if (input_fd < 0) {
+        perror(drop_pathname);
+        exit(1);
+    }
+    // appends wait until the compacted drop has replaced this one
+    if (flock(input_fd, LOCK_EX) != 0) {
+        perror("flock");
+        exit(1);
+    }
+
+    size_t n_droplets;
+    struct droplet_header *headers = scan_drop(input_fd, &n_droplets);
+    uint64_t drop_size = n_droplets > 0 ? headers[n_droplets - 1].offset + headers[n_droplets - 1].length : 0;
+    bool *keep = find_kept_droplets(input_fd, headers, n_droplets);
+    size_t n_removed = 0;
+    uint64_t kept_size = 0;
+    for (size_t i = 0; i < n_droplets; i++) {
+        n_removed += !keep[i];
+        kept_size += keep[i] ? headers[i].length : 0;
+    }
+
+    if (n_removed > 0) {
+        char *temp_pathname;
+        FILE *output_stream = open_compacted_drop(drop_pathname, input_fd, &temp_pathname);
+        off_t *new_offsets = malloc(n_droplets * sizeof *new_offsets);
+        off_t run_offset = 0;
+        uint64_t run_length = 0;
+        off_t new_offset = 0;
+        for (size_t i = 0; i < n_droplets; i++) {
+            struct droplet_header *header = &headers[i];
+            if (!keep[i]) {
+                continue;
+            }
+            new_offsets[i] = new_offset;
+            new_offset += header->length;
+            if (header->format == DROPLET_FMT_REF || header->format == DROPLET_FMT_CHUNK_MAP) {
+                copy_run(input_fd, run_offset, run_length, output_stream);
+                run_length = 0;
+                copy_rebased_droplet(input_fd, headers, new_offsets, header, output_stream);
+            } else if (run_length > 0 && run_offset + (off_t)run_length == header->offset) {
+                run_length += header->length;
+            } else {
+                copy_run(input_fd, run_offset, run_length, output_stream);
+                run_offset = header->offset;
+                run_length = header->length;
+            }
+        }
+        copy_run(input_fd, run_offset, run_length, output_stream);
+        if (fflush(output_stream) != 0 || fsync(fileno(output_stream)) != 0) {
+            perror(temp_pathname);
+            exit(1);
+        }
+        fclose(output_stream);
+        free(new_offsets);
+
+        if (rename(temp_pathname, drop_pathname) != 0) {
+            perror(drop_pathname);
+            exit(1);
+        }
+        free(temp_pathname);
+
+        // the checksums and the watermark are of droplets which have moved
+        remove_watermark(drop_pathname);
+        if (checksums_exist(drop_pathname)) {
+            remove_checksums(drop_pathname);
+            update_checksums(drop_pathname);
+        }
+    }
+
+    printf("%zu droplets removed, %" PRIu64 " bytes reclaimed\n", n_removed, drop_size - kept_size);
+    free(keep);
+    free_droplet_headers(headers, n_droplets);
+    close(input_fd);
+}
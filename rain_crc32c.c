@@ -0,0 +1,91 @@
+// This file provides CRC32C (the Castagnoli CRC used by iSCSI and ext4)
+// used for the optional droplet checksums
+//
+// x86-64 processors with SSE4.2 compute it with the crc32 instruction,
+// 8 bytes at a time; elsewhere a slicing-by-8 table is used.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "rain.h"
+
+#define CRC32C_POLYNOMIAL 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static bool crc32c_hardware_supported;
+
+static void crc32c_init(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            uint32_t crc = crc32c_table[slice - 1][i];
+            crc32c_table[slice][i] = (crc >> 8) ^ crc32c_table[0][crc & 0xff];
+        }
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc32c_hardware_supported = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_software(uint32_t crc, const uint8_t *bytes, size_t n) {
+    while (n >= 8) {
+        uint32_t low = crc ^ (bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+        crc = crc32c_table[7][low & 0xff] ^ crc32c_table[6][(low >> 8) & 0xff] ^
+            crc32c_table[5][(low >> 16) & 0xff] ^ crc32c_table[4][low >> 24] ^
+            crc32c_table[3][bytes[4]] ^ crc32c_table[2][bytes[5]] ^
+            crc32c_table[1][bytes[6]] ^ crc32c_table[0][bytes[7]];
+        bytes += 8;
+        n -= 8;
+    }
+    while (n-- > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *bytes++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t *bytes, size_t n) {
+    uint64_t crc64 = crc;
+    while (n >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += 8;
+        n -= 8;
+    }
+    crc = crc64;
+    while (n-- > 0) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+    }
+    return crc;
+}
+#endif
+
+// returns the CRC32C of n bytes continuing from crc, the CRC32C of the
+// bytes before them (0 to start)
+uint32_t crc32c(uint32_t crc, const uint8_t *bytes, size_t n) {
+    pthread_once(&crc32c_once, crc32c_init);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hardware_supported) {
+        return ~crc32c_hardware(crc, bytes, n);
+    }
+#endif
+    return ~crc32c_software(crc, bytes, n);
+}
@@ -0,0 +1,245 @@
+// This file provides the Merkle root of a drop and the digest mode
+//
+// Each droplet's leaf hash is SHA-256 of a 0 byte then the droplet's
+// bytes; each node is SHA-256 of a 1 byte then its two children.  As in
+// RFC 6962 the left subtree of n leaves holds the largest power of two
+// below n, so appending droplets only changes the right edge of the tree.
+// The root is kept on the first line of the checksum file, so comparing
+// two copies of a drop costs one short read of each, and when the roots
+// differ walking down both trees finds the droplets that differ.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+#define DIGEST_BLOCK (1024 * 1024)
+
+// the leaves, and where each droplet is, of one drop
+struct drop_digests {
+    char *pathname;
+    int fd;
+    size_t n_droplets;
+    off_t *offsets;
+    uint8_t (*leaves)[SHA256_LENGTH];
+    uint8_t root[SHA256_LENGTH];
+};
+
+static size_t largest_power_of_two_below(size_t n) {
+    size_t k = 1;
+    while (k * 2 < n) {
+        k *= 2;
+    }
+    return k;
+}
+
+static void merkle_node(const uint8_t left[SHA256_LENGTH], const uint8_t right[SHA256_LENGTH],
+    uint8_t node[SHA256_LENGTH]) {
+    struct sha256 sha;
+    sha256_init(&sha);
+    sha256_update(&sha, (const uint8_t *)MERKLE_NODE_PREFIX, 1);
+    sha256_update(&sha, left, SHA256_LENGTH);
+    sha256_update(&sha, right, SHA256_LENGTH);
+    sha256_final(&sha, node);
+}
+
+// sets root to the Merkle root of n_leaves leaf hashes
+// a drop with no droplets has the SHA-256 of nothing as its root
+void merkle_root(uint8_t (*leaves)[SHA256_LENGTH], size_t n_leaves, uint8_t root[SHA256_LENGTH]) {
+    if (n_leaves == 0) {
+        struct sha256 sha;
+        sha256_init(&sha);
+        sha256_final(&sha, root);
+        return;
+    }
+    if (n_leaves == 1) {
+        memcpy(root, leaves[0], SHA256_LENGTH);
+        return;
+    }
+    size_t k = largest_power_of_two_below(n_leaves);
+    uint8_t left[SHA256_LENGTH];
+    uint8_t right[SHA256_LENGTH];
+    merkle_root(leaves, k, left);
+    merkle_root(leaves + k, n_leaves - k, right);
+    merkle_node(left, right, root);
+}
+
+struct leaf_job {
+    int fd;
+    struct droplet_header *headers;
+    uint8_t (*leaves)[SHA256_LENGTH];
+};
+
+static void hash_leaf(void *context, size_t item) {
+    struct leaf_job *job = context;
+    struct droplet_header *header = &job->headers[item];
+    struct sha256 sha;
+    sha256_init(&sha);
+    sha256_update(&sha, (const uint8_t *)MERKLE_LEAF_PREFIX, 1);
+    size_t block_length = header->length < DIGEST_BLOCK ? header->length : DIGEST_BLOCK;
+    uint8_t *block = malloc(block_length + 1);
+    for (uint64_t start = 0; start < header->length; start += DIGEST_BLOCK) {
+        size_t n = header->length - start < DIGEST_BLOCK ? header->length - start : DIGEST_BLOCK;
+        if (pread(job->fd, block, n, header->offset + start) != (ssize_t)n) {
+            perror("partially created droplet/EOF found");
+            exit(1);
+        }
+        sha256_update(&sha, block, n);
+    }
+    sha256_final(&sha, job->leaves[item]);
+    free(block);
+}
+
+// finds the leaves of a drop from its checksum file if that covers the
+// whole drop, otherwise by hashing every droplet, many at once
+static void load_digests(struct drop_digests *drop) {
+    drop->fd = open(drop->pathname, O_RDONLY);
+    struct stat stats;
+    if (drop->fd < 0 || fstat(drop->fd, &stats) != 0) {
+        perror(drop->pathname);
+        exit(1);
+    }
+
+    struct drop_checksums *checksums = load_checksums(drop->pathname);
+    if (checksums != NULL && checksums->covered_length == (uint64_t)stats.st_size &&
+        checksums->n_droplets == checksums->n_recorded) {
+        drop->n_droplets = checksums->n_droplets;
+        drop->offsets = malloc((drop->n_droplets + 1) * sizeof *drop->offsets);
+        drop->leaves = malloc((drop->n_droplets + 1) * SHA256_LENGTH);
+        for (size_t i = 0; i < drop->n_droplets; i++) {
+            drop->offsets[i] = checksums->droplets[i].offset;
+            memcpy(drop->leaves[i], checksums->droplets[i].digest, SHA256_LENGTH);
+        }
+        free_checksums(checksums);
+        return;
+    }
+    free_checksums(checksums);
+
+    struct droplet_header *headers = scan_drop(drop->fd, &drop->n_droplets);
+    drop->offsets = malloc((drop->n_droplets + 1) * sizeof *drop->offsets);
+    drop->leaves = malloc((drop->n_droplets + 1) * SHA256_LENGTH);
+    for (size_t i = 0; i < drop->n_droplets; i++) {
+        drop->offsets[i] = headers[i].offset;
+    }
+    struct leaf_job job = {
+        .fd = drop->fd,
+        .headers = headers,
+        .leaves = drop->leaves,
+    };
+    parallel_for(drop->n_droplets, hash_leaf, &job);
+    free_droplet_headers(headers, drop->n_droplets);
+}
+
+// sets root to the root of drop, read from the first line of its
+// checksum file when that is up to date
+static void drop_root(struct drop_digests *drop) {
+    struct stat stats;
+    uint64_t covered_length;
+    size_t n_droplets;
+    if (stat(drop->pathname, &stats) != 0) {
+        perror(drop->pathname);
+        exit(1);
+    }
+    if (read_checksum_root(drop->pathname, &covered_length, &n_droplets, drop->root) &&
+        covered_length == (uint64_t)stats.st_size) {
+        return;
+    }
+    load_digests(drop);
+    merkle_root(drop->leaves, drop->n_droplets, drop->root);
+}
+
+static void report_droplet(struct drop_digests *drop, size_t i, char *difference) {
+    struct droplet_header header;
+    struct stat stats;
+    if (fstat(drop->fd, &stats) != 0) {
+        perror(drop->pathname);
+        exit(1);
+    }
+    enum scan_result result = read_droplet_header(drop->fd, drop->offsets[i], stats.st_size, &header);
+    if (result != SCAN_OK) {
+        scan_error(result, &header);
+    }
+    printf("droplet %zu at byte %jd: %s %s\n", i, (intmax_t)drop->offsets[i], header.pathname, difference);
+    free(header.pathname);
+}
+
+// walks down the trees of n leaves of both drops from first, only into
+// subtrees whose hashes differ, reporting the droplets that differ
+static void compare_subtrees(struct drop_digests *a, struct drop_digests *b, size_t first, size_t n) {
+    uint8_t root_a[SHA256_LENGTH];
+    uint8_t root_b[SHA256_LENGTH];
+    merkle_root(a->leaves + first, n, root_a);
+    merkle_root(b->leaves + first, n, root_b);
+    if (memcmp(root_a, root_b, SHA256_LENGTH) == 0) {
+        return;
+    }
+    if (n == 1) {
+        report_droplet(b, first, "differs");
+        return;
+    }
+    size_t k = largest_power_of_two_below(n);
+    compare_subtrees(a, b, first, k);
+    compare_subtrees(a, b, first + k, n - k);
+}
+
+static void free_digests(struct drop_digests *drop) {
+    if (drop->fd >= 0) {
+        close(drop->fd);
+    }
+    free(drop->offsets);
+    free(drop->leaves);
+}
+
+// prints the Merkle root of each drop, and if more than one is given
+// the droplets of each that differ from the first
+// exits with status 1 if any drop differs from the first
+void digest_drops(char **drop_pathnames, int n_drops) {
+    struct drop_digests *drops = calloc(n_drops, sizeof *drops);
+    for (int i = 0; i < n_drops; i++) {
+        drops[i].pathname = drop_pathnames[i];
+        drops[i].fd = -1;
+        drop_root(&drops[i]);
+        char root[2 * SHA256_LENGTH + 1];
+        format_digest(drops[i].root, root);
+        printf("%s  %s\n", root, drops[i].pathname);
+    }
+
+    bool differ = false;
+    for (int i = 1; i < n_drops; i++) {
+        if (memcmp(drops[0].root, drops[i].root, SHA256_LENGTH) == 0) {
+            continue;
+        }
+        differ = true;
+        printf("%s differs from %s\n", drops[i].pathname, drops[0].pathname);
+        if (drops[0].leaves == NULL) {
+            load_digests(&drops[0]);
+        }
+        if (drops[i].leaves == NULL) {
+            load_digests(&drops[i]);
+        }
+        size_t n_common = drops[0].n_droplets < drops[i].n_droplets ?
+            drops[0].n_droplets : drops[i].n_droplets;
+        compare_subtrees(&drops[0], &drops[i], 0, n_common);
+        for (size_t j = n_common; j < drops[i].n_droplets; j++) {
+            report_droplet(&drops[i], j, "is extra");
+        }
+        for (size_t j = n_common; j < drops[0].n_droplets; j++) {
+            report_droplet(&drops[0], j, "is missing");
+        }
+    }
+
+    for (int i = 0; i < n_drops; i++) {
+        free_digests(&drops[i]);
+    }
+    free(drops);
+    if (differ) {
+        exit(1);
+    }
+}
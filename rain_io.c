@@ -0,0 +1,178 @@
+// This file provides helpers for reading and writing the little-endian
+// integers used throughout the drop format, for copying droplets, and
+// for reading or writing part of a drop as a stream
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "rain.h"
+
+#define PREAD_STREAM_BUFFER (256 * 1024)
+
+// writes the low n_bytes of value to output_stream, smallest byte first
+void write_little_endian(FILE *output_stream, uint64_t value, int n_bytes) {
+    for (int i = 0; i < n_bytes; i++) {
+        fputc((value >> (i * 8)) & 0xff, output_stream);
+    }
+}
+
+// reads an n_bytes little-endian integer from input_stream
+// exits if the drop ends part way through
+uint64_t read_little_endian(FILE *input_stream, int n_bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < n_bytes; i++) {
+        int byte = fgetc(input_stream);
+        if (byte == EOF) {
+            fprintf(stderr, "error: partially created droplet/EOF found\n");
+            exit(1);
+        }
+        value |= (uint64_t)byte << (i * 8);
+    }
+    return value;
+}
+
+// stores the low n_bytes of value at bytes, smallest byte first
+void store_little_endian(uint8_t *bytes, uint64_t value, int n_bytes) {
+    for (int i = 0; i < n_bytes; i++) {
+        bytes[i] = (value >> (i * 8)) & 0xff;
+    }
+}
+
+// loads an n_bytes little-endian integer from bytes
+uint64_t load_little_endian(const uint8_t *bytes, int n_bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < n_bytes; i++) {
+        value |= (uint64_t)bytes[i] << (i * 8);
+    }
+    return value;
+}
+
+#define COPY_CHUNK (1024 * 1024)
+
+// copies length bytes from input_offset of input_fd to output_offset of
+// output_fd, inside the kernel when the file system allows it
+// returns false if the input ends early or a write fails
+bool copy_file_bytes(int input_fd, off_t input_offset, int output_fd, off_t output_offset, uint64_t length) {
+    while (length > 0) {
+        ssize_t copied = copy_file_range(input_fd, &input_offset, output_fd, &output_offset,
+            length < COPY_CHUNK ? length : COPY_CHUNK, 0);
+        if (copied > 0) {
+            length -= copied;
+            continue;
+        } else if (copied == 0) {
+            return false;
+        } else if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+            errno != EOPNOTSUPP) {
+            return false;
+        }
+
+        // fall back to copying through a buffer
+        uint8_t *buffer = malloc(COPY_CHUNK);
+        while (length > 0) {
+            ssize_t n = pread(input_fd, buffer, length < COPY_CHUNK ? length : COPY_CHUNK, input_offset);
+            if (n <= 0 || pwrite(output_fd, buffer, n, output_offset) != n) {
+                free(buffer);
+                return false;
+            }
+            input_offset += n;
+            output_offset += n;
+            length -= n;
+        }
+        free(buffer);
+    }
+    return true;
+}
+
+struct pread_reader {
+    int fd;
+    off_t offset;
+    uint64_t remaining;
+};
+
+static ssize_t pread_read(void *cookie, char *buffer, size_t size) {
+    struct pread_reader *reader = cookie;
+    if (size > reader->remaining) {
+        size = reader->remaining;
+    }
+    ssize_t length = pread(reader->fd, buffer, size, reader->offset);
+    if (length < 0) {
+        return -1;
+    }
+    reader->offset += length;
+    reader->remaining -= length;
+    return length;
+}
+
+static int pread_close(void *cookie) {
+    free(cookie);
+    return 0;
+}
+
+// returns a stream of length bytes at offset of the file open on fd,
+// read with pread so many threads can share the fd
+FILE *open_pread_stream(int fd, off_t offset, uint64_t length) {
+    struct pread_reader *reader = malloc(sizeof *reader);
+    reader->fd = fd;
+    reader->offset = offset;
+    reader->remaining = length;
+
+    cookie_io_functions_t functions = {
+        .read = pread_read,
+        .close = pread_close,
+    };
+    FILE *stream = fopencookie(reader, "rb", functions);
+    setvbuf(stream, NULL, _IOFBF, PREAD_STREAM_BUFFER);
+    return stream;
+}
+
+struct pwrite_writer {
+    int fd;
+    off_t offset;
+    uint8_t *hash;
+};
+
+static ssize_t pwrite_write(void *cookie, const char *buffer, size_t size) {
+    struct pwrite_writer *writer = cookie;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t length = pwrite(writer->fd, buffer + done, size - done, writer->offset + done);
+        if (length <= 0) {
+            // fopencookie takes 0, not -1, as a write error
+            return 0;
+        }
+        done += length;
+    }
+    if (writer->hash != NULL) {
+        *writer->hash = droplet_hash_bytes(*writer->hash, (const uint8_t *)buffer, size);
+    }
+    writer->offset += size;
+    return size;
+}
+
+static int pwrite_close(void *cookie) {
+    free(cookie);
+    return 0;
+}
+
+// returns a stream writing to offset of the file open on fd onwards with
+// pwrite, so many threads can share the fd
+// unless hash is NULL every byte written is carried on into *hash
+FILE *open_pwrite_stream(int fd, off_t offset, uint8_t *hash) {
+    struct pwrite_writer *writer = malloc(sizeof *writer);
+    writer->fd = fd;
+    writer->offset = offset;
+    writer->hash = hash;
+
+    cookie_io_functions_t functions = {
+        .write = pwrite_write,
+        .close = pwrite_close,
+    };
+    FILE *stream = fopencookie(writer, "wb", functions);
+    setvbuf(stream, NULL, _IOFBF, PREAD_STREAM_BUFFER);
+    return stream;
+}
@@ -0,0 +1,528 @@
+// This file provides the block-compressed droplet format (0x7a, 'z')
+//
+// The compressor is an LZ77 coder using the LZ4 block layout:
+// every sequence is a token byte (literal count in the high nibble,
+// match length - 4 in the low nibble), optional length extension bytes,
+// the literals, a 2-byte little-endian match offset and optional match
+// length extension bytes. The last sequence only has literals.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "rain.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_LOG 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_FIND_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_SKIP_TRIGGER 6
+
+#define LZ_STORED_LENGTH_BYTES 6
+#define LZ_BLOCK_SIZE_BYTES 4
+#define LZ_BLOCK_LENGTH_BYTES 4
+#define LZ_RAW_BLOCK 0x80000000u
+#define LZ_BLOCK_SIZE (128 * 1024)
+#define LZ_MAX_BLOCK_SIZE (64 * 1024 * 1024)
+
+// blocks handed to the thread pool per round, per thread
+#define LZ_BLOCKS_PER_THREAD 4
+// bytes of blocks of the usual size decoded per round, per thread, which
+// droplets with bigger blocks decode fewer blocks at a time to stay within
+#define LZ_BATCH_BYTES_PER_THREAD (LZ_BLOCKS_PER_THREAD * LZ_BLOCK_SIZE)
+
+static uint32_t lz_read_32(const uint8_t *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof value);
+    return value;
+}
+
+static uint32_t lz_hash_sequence(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+// writes a sequence length that did not fit in its token nibble
+static size_t lz_write_length(uint8_t *dst, size_t op, size_t length) {
+    while (length >= 255) {
+        dst[op++] = 255;
+        length -= 255;
+    }
+    dst[op++] = length;
+    return op;
+}
+
+// the worst case size of compressing src_length bytes
+size_t lz_compress_bound(size_t src_length) {
+    return src_length + src_length / 255 + 16;
+}
+
+// compresses src into dst, returning the compressed length
+// returns 0 if the result would not fit in dst_capacity bytes
+size_t lz_compress(const uint8_t *src, size_t src_length, uint8_t *dst, size_t dst_capacity) {
+    uint32_t table[1 << LZ_HASH_LOG] = { 0 };
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+
+    if (src_length > LZ_MATCH_FIND_LIMIT) {
+        size_t match_find_limit = src_length - LZ_MATCH_FIND_LIMIT;
+        size_t match_end_limit = src_length - LZ_LAST_LITERALS;
+        ip = 1;
+        while (ip < match_find_limit) {
+            uint32_t sequence = lz_read_32(src + ip);
+            uint32_t hash = lz_hash_sequence(sequence);
+            size_t ref = table[hash];
+            table[hash] = ip;
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read_32(src + ref) != sequence) {
+                // skip faster through data that is not compressing
+                ip += 1 + ((ip - anchor) >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+
+            // grow the match backwards over literals, then forwards
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            size_t match_length = LZ_MIN_MATCH;
+            while (ip + match_length < match_end_limit &&
+                src[ip + match_length] == src[ref + match_length]) {
+                match_length++;
+            }
+
+            size_t literal_length = ip - anchor;
+            if (op + 1 + literal_length + literal_length / 255 + 1 + 2 +
+                match_length / 255 + 1 > dst_capacity) {
+                return 0;
+            }
+
+            size_t token = op++;
+            if (literal_length >= 15) {
+                dst[token] = 15 << 4;
+                op = lz_write_length(dst, op, literal_length - 15);
+            } else {
+                dst[token] = literal_length << 4;
+            }
+            memcpy(dst + op, src + anchor, literal_length);
+            op += literal_length;
+
+            size_t offset = ip - ref;
+            dst[op++] = offset;
+            dst[op++] = offset >> 8;
+
+            if (match_length - LZ_MIN_MATCH >= 15) {
+                dst[token] |= 15;
+                op = lz_write_length(dst, op, match_length - LZ_MIN_MATCH - 15);
+            } else {
+                dst[token] |= match_length - LZ_MIN_MATCH;
+            }
+
+            ip += match_length;
+            anchor = ip;
+        }
+    }
+
+    // the remaining bytes are stored as literals
+    size_t literal_length = src_length - anchor;
+    if (op + 1 + literal_length + literal_length / 255 + 1 > dst_capacity) {
+        return 0;
+    }
+    size_t token = op++;
+    if (literal_length >= 15) {
+        dst[token] = 15 << 4;
+        op = lz_write_length(dst, op, literal_length - 15);
+    } else {
+        dst[token] = literal_length << 4;
+    }
+    memcpy(dst + op, src + anchor, literal_length);
+    op += literal_length;
+
+    return op;
+}
+
+// decompresses src into dst, which has room for dst_capacity bytes
+// returns the decompressed length or -1 if src is not a valid block
+long lz_decompress(const uint8_t *src, size_t src_length, uint8_t *dst, size_t dst_capacity) {
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < src_length) {
+        uint8_t token = src[ip++];
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= src_length) {
+                    return -1;
+                }
+                byte = src[ip++];
+                literal_length += byte;
+            } while (byte == 255);
+        }
+        if (literal_length > src_length - ip || literal_length > dst_capacity - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        // the last sequence has no match
+        if (ip == src_length) {
+            break;
+        }
+
+        if (src_length - ip < 2) {
+            return -1;
+        }
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+
+        size_t match_length = token & 15;
+        if (match_length == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= src_length) {
+                    return -1;
+                }
+                byte = src[ip++];
+                match_length += byte;
+            } while (byte == 255);
+        }
+        match_length += LZ_MIN_MATCH;
+        if (match_length > dst_capacity - op) {
+            return -1;
+        }
+
+        // matches may overlap the bytes they produce
+        uint8_t *match = dst + op - offset;
+        if (offset >= match_length) {
+            memcpy(dst + op, match, match_length);
+        } else {
+            for (size_t i = 0; i < match_length; i++) {
+                dst[op + i] = match[i];
+            }
+        }
+        op += match_length;
+    }
+    return op;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+//
+// 'z' droplet contents:
+//
+//  - stored length:  6 bytes, little-endian, the number of content
+//                    bytes following this field
+//  - block size:     4 bytes, little-endian, uncompressed size of every
+//                    block except the last
+//  - block table:    4 bytes, little-endian, per block; the compressed
+//                    length of the block, with the top bit set if the
+//                    block is stored uncompressed
+//  - blocks:         the compressed blocks, in order
+//
+// The droplet's content_length stays the uncompressed file length, so
+// the number of blocks is ceil(content_length / block size).
+// Droplets with a content_length of 0 (e.g. directories) store nothing.
+//
+
+struct lz_batch {
+    uint8_t *input;
+    size_t input_length;
+    size_t block_size;
+    uint8_t **outputs;
+    uint32_t *lengths;
+    size_t output_capacity;
+    atomic_int failed;
+};
+
+static size_t lz_n_blocks(uint64_t content_length, size_t block_size) {
+    return (content_length + block_size - 1) / block_size;
+}
+
+static void compress_block(void *context, size_t block) {
+    struct lz_batch *batch = context;
+    size_t start = block * batch->block_size;
+    size_t length = batch->input_length - start;
+    if (length > batch->block_size) {
+        length = batch->block_size;
+    }
+
+    size_t compressed = lz_compress(batch->input + start, length,
+        batch->outputs[block], batch->output_capacity);
+    if (compressed == 0 || compressed >= length) {
+        // not worth compressing, keep the raw bytes
+        memcpy(batch->outputs[block], batch->input + start, length);
+        batch->lengths[block] = length | LZ_RAW_BLOCK;
+    } else {
+        batch->lengths[block] = compressed;
+    }
+}
+
+static void decompress_block(void *context, size_t block) {
+    struct lz_batch *batch = context;
+    size_t length = batch->lengths[block] & ~LZ_RAW_BLOCK;
+    uint8_t *src = batch->outputs[block];
+    uint8_t *dst = batch->input + block * batch->block_size;
+    size_t expected = batch->input_length - block * batch->block_size;
+    if (expected > batch->block_size) {
+        expected = batch->block_size;
+    }
+
+    if (batch->lengths[block] & LZ_RAW_BLOCK) {
+        if (length != expected) {
+            batch->failed = 1;
+            return;
+        }
+        memcpy(dst, src, length);
+    } else if (lz_decompress(src, length, dst, expected) != (long)expected) {
+        batch->failed = 1;
+    }
+}
+
+// reads content_length bytes from input_stream and writes them to
+// output_stream as 'z' droplet contents, compressing blocks in parallel
+// returns the number of content bytes written
+// output_stream must be seekable, the block table is filled in last
+uint64_t write_lz_content(FILE *input_stream, FILE *output_stream, uint64_t content_length) {
+    if (content_length == 0) {
+        return 0;
+    }
+    size_t block_size = LZ_BLOCK_SIZE;
+    size_t n_blocks = lz_n_blocks(content_length, block_size);
+    uint32_t *table = calloc(n_blocks + 1, sizeof *table);
+
+    long table_offset = ftell(output_stream);
+    write_little_endian(output_stream, 0, LZ_STORED_LENGTH_BYTES);
+    write_little_endian(output_stream, block_size, LZ_BLOCK_SIZE_BYTES);
+    for (size_t i = 0; i < n_blocks; i++) {
+        write_little_endian(output_stream, 0, LZ_BLOCK_LENGTH_BYTES);
+    }
+    uint64_t stored_length = LZ_BLOCK_SIZE_BYTES + n_blocks * LZ_BLOCK_LENGTH_BYTES;
+
+    size_t batch_blocks = rain_thread_count() * LZ_BLOCKS_PER_THREAD;
+    struct lz_batch batch = {
+        .input = malloc(batch_blocks * block_size),
+        .block_size = block_size,
+        .outputs = malloc(batch_blocks * sizeof (uint8_t *)),
+        .output_capacity = lz_compress_bound(block_size),
+    };
+    for (size_t i = 0; i < batch_blocks; i++) {
+        batch.outputs[i] = malloc(batch.output_capacity);
+    }
+
+    size_t done = 0;
+    while (done < n_blocks) {
+        size_t n = n_blocks - done < batch_blocks ? n_blocks - done : batch_blocks;
+        uint64_t remaining = content_length - (uint64_t)done * block_size;
+        batch.input_length = remaining < n * block_size ? remaining : n * block_size;
+        if (fread(batch.input, 1, batch.input_length, input_stream) != batch.input_length) {
+            fprintf(stderr, "error: file changed size while being added\n");
+            exit(1);
+        }
+        batch.lengths = table + done;
+
+        parallel_for(n, compress_block, &batch);
+
+        for (size_t i = 0; i < n; i++) {
+            size_t length = batch.lengths[i] & ~LZ_RAW_BLOCK;
+            if (fwrite(batch.outputs[i], 1, length, output_stream) != length) {
+                perror("fwrite");
+                exit(1);
+            }
+            stored_length += length;
+        }
+        done += n;
+    }
+
+    for (size_t i = 0; i < batch_blocks; i++) {
+        free(batch.outputs[i]);
+    }
+    free(batch.outputs);
+    free(batch.input);
+
+    // now the lengths are known go back and fill in the table
+    fseek(output_stream, table_offset, SEEK_SET);
+    write_little_endian(output_stream, stored_length, LZ_STORED_LENGTH_BYTES);
+    write_little_endian(output_stream, block_size, LZ_BLOCK_SIZE_BYTES);
+    for (size_t i = 0; i < n_blocks; i++) {
+        write_little_endian(output_stream, table[i], LZ_BLOCK_LENGTH_BYTES);
+    }
+    fseek(output_stream, table_offset + LZ_STORED_LENGTH_BYTES + stored_length, SEEK_SET);
+    free(table);
+
+    return LZ_STORED_LENGTH_BYTES + stored_length;
+}
+
+// returns the number of bytes of 'z' droplet contents starting at the
+// current position of input_stream, which is left unchanged
+uint64_t lz_content_length(FILE *input_stream) {
+    long position = ftell(input_stream);
+    uint64_t stored_length = read_little_endian(input_stream, LZ_STORED_LENGTH_BYTES);
+    fseek(input_stream, position, SEEK_SET);
+    return LZ_STORED_LENGTH_BYTES + stored_length;
+}
+
+// reads the block table of the 'z' droplet contents at the current
+// position of input_stream and checks the block lengths add up
+// returns the malloc'd table, or NULL if the table is inconsistent
+// input_stream is left at the first block
+uint32_t *read_lz_block_table(FILE *input_stream, uint64_t content_length, size_t *block_size, size_t *n_blocks) {
+    uint64_t stored_length = read_little_endian(input_stream, LZ_STORED_LENGTH_BYTES);
+    *block_size = read_little_endian(input_stream, LZ_BLOCK_SIZE_BYTES);
+    if (*block_size == 0 || *block_size > LZ_MAX_BLOCK_SIZE) {
+        return NULL;
+    }
+    // content_length comes from the droplet, so the number of blocks is
+    // checked against what the droplet holds before anything is allocated
+    uint64_t n_table_blocks = (content_length + *block_size - 1) / *block_size;
+    if (stored_length < LZ_BLOCK_SIZE_BYTES ||
+        n_table_blocks > (stored_length - LZ_BLOCK_SIZE_BYTES) / LZ_BLOCK_LENGTH_BYTES) {
+        return NULL;
+    }
+    *n_blocks = n_table_blocks;
+    uint64_t table_length = LZ_BLOCK_SIZE_BYTES + (uint64_t)*n_blocks * LZ_BLOCK_LENGTH_BYTES;
+
+    uint32_t *table = malloc((*n_blocks + 1) * sizeof *table);
+    if (table == NULL) {
+        return NULL;
+    }
+    uint64_t total = table_length;
+    for (size_t i = 0; i < *n_blocks; i++) {
+        table[i] = read_little_endian(input_stream, LZ_BLOCK_LENGTH_BYTES);
+        size_t length = table[i] & ~LZ_RAW_BLOCK;
+        if (length > lz_compress_bound(*block_size)) {
+            free(table);
+            return NULL;
+        }
+        total += length;
+    }
+    if (total != stored_length) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+struct lz_reader {
+    FILE *input_stream;
+    uint64_t content_length;
+    size_t n_blocks;
+    size_t done;
+    size_t batch_blocks;
+    uint32_t *table;
+    uint8_t *compressed;
+    struct lz_batch batch;
+};
+
+// starts decoding the 'z' droplet contents at the current position of
+// input_stream, for a file of content_length bytes
+// returns NULL if the block table is corrupt, or the buffers for it can
+// not be allocated
+struct lz_reader *lz_reader_open(FILE *input_stream, uint64_t content_length) {
+    struct lz_reader *reader = calloc(1, sizeof *reader);
+    reader->input_stream = input_stream;
+    reader->content_length = content_length;
+    if (content_length == 0) {
+        return reader;
+    }
+
+    size_t block_size;
+    reader->table = read_lz_block_table(input_stream, content_length, &block_size, &reader->n_blocks);
+    if (reader->table == NULL) {
+        free(reader);
+        return NULL;
+    }
+    // the block size comes from the droplet, so a batch is limited to as
+    // many bytes as one of blocks of the usual size, and to the blocks
+    // there are
+    reader->batch_blocks = rain_thread_count() * LZ_BATCH_BYTES_PER_THREAD / block_size;
+    if (reader->batch_blocks == 0) {
+        reader->batch_blocks = 1;
+    }
+    if (reader->batch_blocks > reader->n_blocks) {
+        reader->batch_blocks = reader->n_blocks;
+    }
+    reader->compressed = malloc(reader->batch_blocks * lz_compress_bound(block_size));
+    reader->batch.input = malloc(reader->batch_blocks * block_size);
+    reader->batch.block_size = block_size;
+    reader->batch.outputs = malloc(reader->batch_blocks * sizeof (uint8_t *));
+    if (reader->compressed == NULL || reader->batch.input == NULL || reader->batch.outputs == NULL) {
+        lz_reader_close(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+// decompresses the next batch of blocks in parallel
+// sets *data to the decompressed bytes and returns how many there are,
+// 0 once every block has been read, or -1 if a block is corrupt
+long lz_reader_next(struct lz_reader *reader, uint8_t **data) {
+    if (reader->done == reader->n_blocks) {
+        return 0;
+    }
+    struct lz_batch *batch = &reader->batch;
+    size_t block_size = batch->block_size;
+    size_t n = reader->n_blocks - reader->done;
+    if (n > reader->batch_blocks) {
+        n = reader->batch_blocks;
+    }
+    uint64_t remaining = reader->content_length - (uint64_t)reader->done * block_size;
+    batch->input_length = remaining < n * block_size ? remaining : n * block_size;
+    batch->lengths = reader->table + reader->done;
+
+    // blocks are read back to back into one buffer
+    size_t position = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t length = batch->lengths[i] & ~LZ_RAW_BLOCK;
+        batch->outputs[i] = reader->compressed + position;
+        if (fread(reader->compressed + position, 1, length, reader->input_stream) != length) {
+            perror("partially created droplet/EOF found");
+            exit(1);
+        }
+        position += length;
+    }
+
+    parallel_for(n, decompress_block, batch);
+    if (batch->failed) {
+        return -1;
+    }
+
+    reader->done += n;
+    *data = batch->input;
+    return batch->input_length;
+}
+
+void lz_reader_close(struct lz_reader *reader) {
+    free(reader->batch.outputs);
+    free(reader->batch.input);
+    free(reader->compressed);
+    free(reader->table);
+    free(reader);
+}
+
+// reads 'z' droplet contents from input_stream and decompresses the
+// content_length bytes into output
+// returns false if the block table or a block is corrupt
+bool read_lz_content(FILE *input_stream, uint8_t *output, uint64_t content_length) {
+    struct lz_reader *reader = lz_reader_open(input_stream, content_length);
+    if (reader == NULL) {
+        return false;
+    }
+    uint8_t *data;
+    long length;
+    while ((length = lz_reader_next(reader, &data)) > 0) {
+        memcpy(output, data, length);
+        output += length;
+    }
+    lz_reader_close(reader);
+    return length == 0;
+}
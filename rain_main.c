@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <string.h>
+#include <time.h>
 #include <getopt.h>
 #include <err.h>
 #include <sysexits.h>
@@ -19,11 +21,23 @@ enum a_mode {
     A_EXTRACT,   /**< Invoked with `-e'. */
     A_CREATE,    /**< Invoked with `-c'. */
     A_APPEND,    /**< Invoked with `-a'. */
+    A_REPACK,    /**< Invoked with `-r'. */
+    A_DIGEST,    /**< Invoked with `-D'. */
+    A_SCRUB,     /**< Invoked with `-s'. */
+    A_SALVAGE,   /**< Invoked with `-X'. */
+    A_BATCH,     /**< Invoked with `-b'. */
+    A_COMPACT,   /**< Invoked with `-O'. */
 };
 
 typedef struct args {
     enum a_mode mode;
     enum droplet_fmt format; /**< Format to archive into. */
+    int options;             /**< create_option flags. */
+    enum bad_hash_policy policy; /**< What extract does with bad hashes. */
+    int check_options;       /**< check_option flags. */
+    double rate;             /**< MB/s scrub reads at most. */
+    size_t n_samples;        /**< Droplets check samples, 0 for all. */
+    uint64_t seed;           /**< Seed for choosing the sample. */
     char *drop_file;         /**< Archive file name. */
     size_t n_paths;         /**< Number of file paths to archive. */
     char **paths;           /**< Array of file paths to archive. */
@@ -36,6 +50,12 @@ static const char *a_mode_name[] = {
     [A_EXTRACT]   = "extract",
     [A_CREATE]    = "create",
     [A_APPEND]    = "append",
+    [A_REPACK]    = "repack",
+    [A_DIGEST]    = "digest",
+    [A_SCRUB]     = "scrub",
+    [A_SALVAGE]   = "salvage",
+    [A_BATCH]     = "batch",
+    [A_COMPACT]   = "compact",
 };
 
 static args rain_parse_args(int, char **);
@@ -49,27 +69,71 @@ int main(int argc, char *argv[]) {
 
     switch (arguments.mode) {
     case A_CHECK: {
-        check_drop(arguments.drop_file);
+        if (arguments.n_samples > 0) {
+            // every drop is sampled, then any bad droplet fails the check
+            bool all_correct = true;
+            for (size_t i = 0; i < arguments.n_paths; i++) {
+                all_correct &= sample_drop(arguments.paths[i], arguments.check_options,
+                                           arguments.n_samples, arguments.seed);
+            }
+            if (!all_correct) {
+                exit(1);
+            }
+        } else {
+            check_drops(arguments.paths, arguments.n_paths, arguments.check_options);
+        }
         break;
     }
     case A_LIST: {
-        list_drop(arguments.drop_file, false);
+        if (!list_drop(arguments.drop_file, false, stdout, stderr)) {
+            exit(1);
+        }
         break;
     }
     case A_LIST_LONG: {
-        list_drop(arguments.drop_file, true);
+        if (!list_drop(arguments.drop_file, true, stdout, stderr)) {
+            exit(1);
+        }
         break;
     }
     case A_EXTRACT: {
-        extract_drop(arguments.drop_file);
+        if (!extract_drop(arguments.drop_file, arguments.policy, stdout, stderr)) {
+            exit(1);
+        }
         break;
     }
     case A_CREATE: {
-        create_drop(arguments.drop_file, false, arguments.format, arguments.n_paths, arguments.paths);
+        create_drop(arguments.drop_file, false, arguments.format, arguments.options,
+                    arguments.n_paths, arguments.paths);
         break;
     }
     case A_APPEND: {
-        create_drop(arguments.drop_file, true, arguments.format, arguments.n_paths, arguments.paths);
+        create_drop(arguments.drop_file, true, arguments.format, arguments.options,
+                    arguments.n_paths, arguments.paths);
+        break;
+    }
+    case A_REPACK: {
+        repack_drop(arguments.drop_file, arguments.paths[0], arguments.format);
+        break;
+    }
+    case A_DIGEST: {
+        digest_drops(arguments.paths, arguments.n_paths);
+        break;
+    }
+    case A_SALVAGE: {
+        salvage_drop(arguments.drop_file, arguments.n_paths > 0 ? arguments.paths[0] : NULL);
+        break;
+    }
+    case A_SCRUB: {
+        scrub_directory(arguments.drop_file, arguments.rate);
+        break;
+    }
+    case A_BATCH: {
+        run_batch(arguments.drop_file, arguments.policy, arguments.check_options);
+        break;
+    }
+    case A_COMPACT: {
+        compact_drop(arguments.drop_file);
         break;
     }
     default: {
@@ -81,12 +145,18 @@ int main(int argc, char *argv[]) {
 
 ////////////////////////////////////////////////////////////////////////
 
-#define INVALID_MODE_MESSAGE "Requires exactly one of: 'C|check', 'l|list', 'L|list-long', 'c|create', 'a|append', 'x|extract'"
+#define INVALID_MODE_MESSAGE "Requires exactly one of: 'C|check', 'l|list', 'L|list-long', 'c|create', 'a|append', 'x|extract', 'r|repack', 'D|digest', 's|scrub', 'X|salvage', 'b|batch', 'O|compact'"
 
 struct args rain_parse_args(int argc, char **argv) {
     struct args arguments = {
         .mode     = A_NONE,
         .format   = DROPLET_FMT_8,
+        .options  = 0,
+        .policy   = BAD_HASH_ABORT,
+        .check_options = 0,
+        .rate     = SCRUB_DEFAULT_MB_PER_SECOND,
+        .n_samples = 0,
+        .seed     = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32),
         .drop_file = NULL,
         .n_paths  = 0,
         .paths    = NULL,
@@ -95,17 +165,36 @@ struct args rain_parse_args(int argc, char **argv) {
     opterr = 0;
     int opt;
     while ((opt = getopt_long(
-                argc, argv, "678acClLxh",
+                argc, argv, "678zSKdkuacClLxrDsXbOh",
                 (struct option[]){
                     (struct option){ "6-bit-format", no_argument, 0, '6' },
                     (struct option){ "7-bit-format", no_argument, 0, '7' },
                     (struct option){ "8-bit-format", no_argument, 0, '8' },
+                    (struct option){ "lz-format",    no_argument, 0, 'z' },
+                    (struct option){ "solid",        no_argument, 0, 'S' },
+                    (struct option){ "checksums",    no_argument, 0, 'K' },
+                    (struct option){ "dedup",        no_argument, 0, 'd' },
+                    (struct option){ "chunk",        no_argument, 0, 'k' },
+                    (struct option){ "update",       no_argument, 0, 'u' },
                     (struct option){ "append",       no_argument, 0, 'a' },
                     (struct option){ "create",       no_argument, 0, 'c' },
                     (struct option){ "check",        no_argument, 0, 'C' },
                     (struct option){ "list",         no_argument, 0, 'l' },
                     (struct option){ "list-long",    no_argument, 0, 'L' },
                     (struct option){ "extract",      no_argument, 0, 'x' },
+                    (struct option){ "repack",       no_argument, 0, 'r' },
+                    (struct option){ "digest",       no_argument, 0, 'D' },
+                    (struct option){ "scrub",        no_argument, 0, 's' },
+                    (struct option){ "salvage",      no_argument, 0, 'X' },
+                    (struct option){ "batch",        no_argument, 0, 'b' },
+                    (struct option){ "compact",      no_argument, 0, 'O' },
+                    (struct option){ "rate",         required_argument, 0, 'R' },
+                    (struct option){ "bad-hash",     required_argument, 0, 'B' },
+                    (struct option){ "full",         no_argument, 0, 'F' },
+                    (struct option){ "incremental",  no_argument, 0, 'I' },
+                    (struct option){ "sample",       required_argument, 0, 'N' },
+                    (struct option){ "sample-by",    required_argument, 0, 'W' },
+                    (struct option){ "seed",         required_argument, 0, 'E' },
                     (struct option){ "help",         no_argument, 0, 'h' },
                     (struct option){ 0,              0,           0,  0  },
                 },
@@ -126,6 +215,89 @@ struct args rain_parse_args(int argc, char **argv) {
             arguments.format = DROPLET_FMT_8;
             break;
         }
+        case 'z': {
+            arguments.format = DROPLET_FMT_LZ;
+            break;
+        }
+        case 'S': {
+            arguments.options |= CREATE_SOLID;
+            break;
+        }
+        case 'K': {
+            arguments.options |= CREATE_CHECKSUMS;
+            break;
+        }
+        case 'd': {
+            arguments.options |= CREATE_DEDUP;
+            break;
+        }
+        case 'k': {
+            arguments.options |= CREATE_CHUNK;
+            break;
+        }
+        case 'u': {
+            arguments.options |= CREATE_UPDATE;
+            break;
+        }
+        case 'B': {
+            if (strcmp(optarg, "abort") == 0) {
+                arguments.policy = BAD_HASH_ABORT;
+            } else if (strcmp(optarg, "skip") == 0) {
+                arguments.policy = BAD_HASH_SKIP;
+            } else if (strcmp(optarg, "keep") == 0) {
+                arguments.policy = BAD_HASH_KEEP;
+            } else {
+                warnx("--bad-hash must be one of: 'abort', 'skip', 'keep'");
+                usage_short();
+            }
+            break;
+        }
+        case 'R': {
+            char *end;
+            arguments.rate = strtod(optarg, &end);
+            if (*end != '\0' || end == optarg || arguments.rate < 0) {
+                warnx("--rate must be a number of MB/s, or 0 for no limit");
+                usage_short();
+            }
+            break;
+        }
+        case 'N': {
+            char *end;
+            arguments.n_samples = strtoull(optarg, &end, 10);
+            if (*end != '\0' || end == optarg || arguments.n_samples == 0) {
+                warnx("--sample must be a number of droplets");
+                usage_short();
+            }
+            break;
+        }
+        case 'W': {
+            if (strcmp(optarg, "droplet") == 0) {
+                arguments.check_options &= ~CHECK_SAMPLE_BY_SIZE;
+            } else if (strcmp(optarg, "size") == 0) {
+                arguments.check_options |= CHECK_SAMPLE_BY_SIZE;
+            } else {
+                warnx("--sample-by must be one of: 'droplet', 'size'");
+                usage_short();
+            }
+            break;
+        }
+        case 'E': {
+            char *end;
+            arguments.seed = strtoull(optarg, &end, 10);
+            if (*end != '\0' || end == optarg) {
+                warnx("--seed must be a number");
+                usage_short();
+            }
+            break;
+        }
+        case 'F': {
+            arguments.check_options |= CHECK_FULL;
+            break;
+        }
+        case 'I': {
+            arguments.check_options |= CHECK_INCREMENTAL;
+            break;
+        }
         case 'C': {
             if (arguments.mode != A_NONE) {
                 warnx(INVALID_MODE_MESSAGE);
@@ -186,6 +358,66 @@ struct args rain_parse_args(int argc, char **argv) {
             arguments.mode = A_EXTRACT;
             break;
         }
+        case 'r': {
+            if (arguments.mode != A_NONE) {
+                warnx(INVALID_MODE_MESSAGE);
+                warnx("Both \"%s\" and \"%s\" were given.",
+                      a_mode_name[arguments.mode], a_mode_name[A_REPACK]);
+                usage_short();
+            }
+            arguments.mode = A_REPACK;
+            break;
+        }
+        case 'D': {
+            if (arguments.mode != A_NONE) {
+                warnx(INVALID_MODE_MESSAGE);
+                warnx("Both \"%s\" and \"%s\" were given.",
+                      a_mode_name[arguments.mode], a_mode_name[A_DIGEST]);
+                usage_short();
+            }
+            arguments.mode = A_DIGEST;
+            break;
+        }
+        case 'X': {
+            if (arguments.mode != A_NONE) {
+                warnx(INVALID_MODE_MESSAGE);
+                warnx("Both \"%s\" and \"%s\" were given.",
+                      a_mode_name[arguments.mode], a_mode_name[A_SALVAGE]);
+                usage_short();
+            }
+            arguments.mode = A_SALVAGE;
+            break;
+        }
+        case 'b': {
+            if (arguments.mode != A_NONE) {
+                warnx(INVALID_MODE_MESSAGE);
+                warnx("Both \"%s\" and \"%s\" were given.",
+                      a_mode_name[arguments.mode], a_mode_name[A_BATCH]);
+                usage_short();
+            }
+            arguments.mode = A_BATCH;
+            break;
+        }
+        case 's': {
+            if (arguments.mode != A_NONE) {
+                warnx(INVALID_MODE_MESSAGE);
+                warnx("Both \"%s\" and \"%s\" were given.",
+                      a_mode_name[arguments.mode], a_mode_name[A_SCRUB]);
+                usage_short();
+            }
+            arguments.mode = A_SCRUB;
+            break;
+        }
+        case 'O': {
+            if (arguments.mode != A_NONE) {
+                warnx(INVALID_MODE_MESSAGE);
+                warnx("Both \"%s\" and \"%s\" were given.",
+                      a_mode_name[arguments.mode], a_mode_name[A_COMPACT]);
+                usage_short();
+            }
+            arguments.mode = A_COMPACT;
+            break;
+        }
         default: {
             warnx("Unknown option \"%d\" given.", optopt);
             usage_short();
@@ -205,6 +437,12 @@ struct args rain_parse_args(int argc, char **argv) {
         usage_short();
     }
 
+    if ((arguments.options & CREATE_SOLID) &&
+        arguments.format != DROPLET_FMT_8 && arguments.format != DROPLET_FMT_LZ) {
+        warnx("Solid blocks can only use the 8-bit or block-compressed format");
+        usage_short();
+    }
+
     arguments.drop_file = argv[optind++];
 
     if (arguments.mode == A_CREATE || arguments.mode == A_APPEND) {
@@ -218,6 +456,38 @@ struct args rain_parse_args(int argc, char **argv) {
         arguments.paths = &(argv[optind]);
     }
 
+    if (arguments.mode == A_REPACK) {
+        if (argc - optind != 1) {
+            warnx("\"%s\" Requires exactly one new archive file",
+                  a_mode_name[arguments.mode]);
+            usage_short();
+        }
+        arguments.n_paths = 1;
+        arguments.paths = &(argv[optind]);
+    }
+
+    if (arguments.mode == A_SALVAGE) {
+        if (argc - optind > 1) {
+            warnx("\"%s\" Takes at most one new archive file",
+                  a_mode_name[arguments.mode]);
+            usage_short();
+        }
+        arguments.n_paths = argc - optind;
+        arguments.paths = &(argv[optind]);
+    }
+
+    if (arguments.mode == A_CHECK) {
+        // the archive file and any more to check with it
+        arguments.n_paths = argc - optind + 1;
+        arguments.paths = &(argv[optind - 1]);
+    }
+
+    if (arguments.mode == A_DIGEST) {
+        // the archive file and any more to compare with it
+        arguments.n_paths = argc - optind + 1;
+        arguments.paths = &(argv[optind - 1]);
+    }
+
     return arguments;
 }
 
@@ -234,6 +504,13 @@ static const char *long_usage_message =
     "\n"
     "USAGE:\n"
     "    rain [<FORMAT>] <MODE> <ARCHIVE-FILE> [<FILE...>]\n"
+    "    rain [<FORMAT>] -r <ARCHIVE-FILE> <NEW-ARCHIVE-FILE>\n"
+    "    rain -C <ARCHIVE-FILE> [<ARCHIVE-FILE...>]\n"
+    "    rain -D <ARCHIVE-FILE> [<ARCHIVE-FILE...>]\n"
+    "    rain -s [--rate=<MB/s>] <DIRECTORY>\n"
+    "    rain -X <ARCHIVE-FILE> [<NEW-ARCHIVE-FILE>]\n"
+    "    rain -b <MANIFEST-FILE>\n"
+    "    rain -O <ARCHIVE-FILE>\n"
     "\n"
     "COMMON MODES:\n"
     "    -l, --list\n"
@@ -241,13 +518,35 @@ static const char *long_usage_message =
     "    -L, --list-long\n"
     "        list additional information about all files in ARCHIVE-FILE.\n"
     "    -C, --check\n"
-    "        check hash of ARCHIVE-FILE.\n"
+    "        check the hash of every droplet of ARCHIVE-FILE (see\n"
+    "        --incremental to skip those already found correct).  More\n"
+    "        ARCHIVE-FILEs may be given to check them all at once.\n"
     "    -c, --create\n"
     "        create ARCHIVE-FILE containing the listed FILEs.\n"
     "    -a, --append\n"
     "        append the listed FILEs to ARCHIVE-FILE.\n"
     "    -x, --extract\n"
     "        extract all files from ARCHIVE-FILE\n"
+    "    -r, --repack\n"
+    "        rewrite ARCHIVE-FILE as NEW-ARCHIVE-FILE using FORMAT.\n"
+    "    -D, --digest\n"
+    "        print the Merkle root of each ARCHIVE-FILE, and the files\n"
+    "        of later ARCHIVE-FILEs which differ from the first.\n"
+    "    -X, --salvage\n"
+    "        find the intact files of a damaged ARCHIVE-FILE, and copy\n"
+    "        them to NEW-ARCHIVE-FILE if given.\n"
+    "    -s, --scrub\n"
+    "        check every .drop file under DIRECTORY at idle priority,\n"
+    "        carrying on from where the last scrub stopped.\n"
+    "    -b, --batch\n"
+    "        run each operation of MANIFEST-FILE, - for stdin, on a shared\n"
+    "        pool of threads, printing a line of JSON with the result of\n"
+    "        each.  Lines are MODE<TAB>ARCHIVE-FILE, MODE being list,\n"
+    "        list-long, check or extract, and extract may be followed by\n"
+    "        <TAB>DIRECTORY to extract into.\n"
+    "    -O, --compact\n"
+    "        rewrite ARCHIVE-FILE keeping only the latest version of\n"
+    "        each file, and print how many bytes that reclaimed.\n"
     "\n"
     "COMMON FORMATS:\n"
     "    -6\n"
@@ -256,6 +555,46 @@ static const char *long_usage_message =
     "        create or append to ARCHIVE-FILE using 7-bit format\n"
     "    -8\n"
     "        create or append to ARCHIVE-FILE using 8-bit format [DEFAULT]\n"
+    "    -z\n"
+    "        create or append to ARCHIVE-FILE using block-compressed format\n"
+    "\n"
+    "OPTIONS:\n"
+    "    -S, --solid\n"
+    "        pack small files into shared solid-block droplets\n"
+    "    -K, --checksums\n"
+    "        record CRC32C checksums and SHA-256 digests of droplets\n"
+    "        in ARCHIVE-FILE.sums\n"
+    "    -d, --dedup\n"
+    "        store files with the same contents as a file added before\n"
+    "        them, and hardlinks to it, as references to it\n"
+    "    -k, --chunk\n"
+    "        cut files into content-defined chunks and store each chunk\n"
+    "        only once across the whole of ARCHIVE-FILE\n"
+    "    -u, --update\n"
+    "        when appending, leave out files which have not changed\n"
+    "        since they were last added, by mode, length and\n"
+    "        modification time, kept in ARCHIVE-FILE.times\n"
+    "    --incremental\n"
+    "        when checking, only check what was added since the last\n"
+    "        incremental check found every droplet correct, recorded in\n"
+    "        ARCHIVE-FILE.checked\n"
+    "    --full\n"
+    "        with --incremental, check all of ARCHIVE-FILE, not just\n"
+    "        what was added since it was last checked\n"
+    "    --sample=N\n"
+    "        when checking, check only N droplets chosen at random and\n"
+    "        estimate how many of all of them are bad\n"
+    "    --sample-by=droplet|size\n"
+    "        choose each droplet with the same chance [DEFAULT], or in\n"
+    "        proportion to its length\n"
+    "    --seed=S\n"
+    "        choose the sample from S, to repeat an earlier spot-check\n"
+    "    --rate=MB/s\n"
+    "        when scrubbing, read at most this many MB/s, 0 for no limit\n"
+    "        [DEFAULT 50]\n"
+    "    --bad-hash=abort|skip|keep\n"
+    "        when extracting, stop at [DEFAULT], leave out or keep files\n"
+    "        whose droplet hash is incorrect\n"
     "\n";
 
 /// Print a longer, more helpful usage message.
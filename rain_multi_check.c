@@ -0,0 +1,94 @@
+// This file provides checking many drops at once
+//
+// Each drop is checked by check_drop on a thread of the pool, which
+// writes what it finds to buffers of its own rather than stdout.  When a
+// drop is done, whichever thread finished it prints the buffers of every
+// drop done in order so far, so the output is exactly what checking the
+// drops one after another prints, and a slow drop only holds back the
+// output of those after it.  Droplets of one drop are still hashed on
+// the threads its worker has to spare.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "rain.h"
+
+struct checked_drop {
+    char *output;
+    size_t output_length;
+    char *errors;
+    size_t errors_length;
+    bool done;
+    bool correct;
+};
+
+struct check_job {
+    char **drop_pathnames;
+    int options;
+    struct checked_drop *drops;
+    pthread_mutex_t print_lock;
+    size_t n_printed;            /**< Drops whose output has been printed. */
+    size_t n_bad;
+};
+
+static void check_drop_item(void *context, size_t item) {
+    struct check_job *job = context;
+    struct checked_drop *drop = &job->drops[item];
+    FILE *output_stream = open_memstream(&drop->output, &drop->output_length);
+    FILE *error_stream = open_memstream(&drop->errors, &drop->errors_length);
+    if (output_stream == NULL || error_stream == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+    fprintf(output_stream, "%s:\n", job->drop_pathnames[item]);
+    drop->correct = check_drop(job->drop_pathnames[item], job->options, output_stream, error_stream);
+    fclose(output_stream);
+    fclose(error_stream);
+
+    pthread_mutex_lock(&job->print_lock);
+    drop->done = true;
+    while (job->drops[job->n_printed].done) {
+        struct checked_drop *next = &job->drops[job->n_printed];
+        fwrite(next->output, 1, next->output_length, stdout);
+        fflush(stdout);
+        fwrite(next->errors, 1, next->errors_length, stderr);
+        free(next->output);
+        free(next->errors);
+        job->n_bad += !next->correct;
+        job->n_printed++;
+    }
+    pthread_mutex_unlock(&job->print_lock);
+}
+
+// checks each of n_drops drops, many at once, printing the name then
+// the results of each drop in turn
+// exits with status 1 if any droplet of any drop is incorrect, or a drop
+// could not be checked
+void check_drops(char **drop_pathnames, int n_drops, int options) {
+    if (n_drops == 1) {
+        // one drop keeps every thread for its droplets
+        if (!check_drop(drop_pathnames[0], options, stdout, stderr)) {
+            exit(1);
+        }
+        return;
+    }
+
+    struct check_job job = {
+        .drop_pathnames = drop_pathnames,
+        .options = options,
+        // one past the end, never done, stops printing
+        .drops = calloc(n_drops + 1, sizeof (struct checked_drop)),
+    };
+    pthread_mutex_init(&job.print_lock, NULL);
+    parallel_for(n_drops, check_drop_item, &job);
+    pthread_mutex_destroy(&job.print_lock);
+    free(job.drops);
+
+    if (job.n_bad > 0) {
+        printf("%zu of %d drops failed their check\n", job.n_bad, n_drops);
+        exit(1);
+    }
+}
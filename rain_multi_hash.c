@@ -0,0 +1,304 @@
+// This file provides droplet hashing of many droplets at once, and of
+// one huge droplet on many threads
+//
+// droplet_hash is serial: every step depends on the hash of the byte
+// before, so one droplet can only be hashed a byte at a time.  Separate
+// droplets are independent though.  On x86-64 sixteen droplets are
+// hashed side by side, one per byte lane of an SSE2 register: sixteen
+// bytes of each droplet are loaded, transposed so that each register
+// holds one byte of every droplet, then folded into the hashes.  Lanes
+// are refilled with the next droplet as droplets finish.
+//
+// A huge droplet is split into chunks instead.  Each step of the hash
+// is a permutation of the 256 possible hash values, so the effect of a
+// chunk is a 256-entry table, computed from many start values at once
+// (one per SIMD lane).  Tables of consecutive chunks are computed on
+// separate threads then applied in order, giving the exact hash.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "rain.h"
+
+#define HASH_LANES 16
+
+// droplets shorter than this are hashed a byte at a time
+#define HASH_LANE_MIN (4 * HASH_LANES)
+
+// droplets handed to each thread at once
+#define HASH_GROUP 256
+
+#define HASH_STATES 256
+#define HASH_TABLE_LANES 64
+#define HASH_CHUNK (4 * 1024 * 1024)
+
+// a chunk table costs as much as hashing the chunk several times over,
+// so it only pays off with at least this many threads to hand
+#define HASH_TABLE_MIN_THREADS 8
+
+// returns the droplet_hash of n more bytes, starting from hash
+uint8_t droplet_hash_bytes(uint8_t hash, const uint8_t *bytes, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        hash = (uint8_t)(hash * 33) ^ bytes[i];
+    }
+    return hash;
+}
+
+#if defined(__SSE2__)
+
+// transposes a 16x16 matrix of bytes held one row per register
+static void transpose_16x16(__m128i rows[HASH_LANES]) {
+    for (int stage = 0; stage < 4; stage++) {
+        __m128i result[HASH_LANES];
+        for (int i = 0; i < HASH_LANES / 2; i++) {
+            result[2 * i] = _mm_unpacklo_epi8(rows[i], rows[i + HASH_LANES / 2]);
+            result[2 * i + 1] = _mm_unpackhi_epi8(rows[i], rows[i + HASH_LANES / 2]);
+        }
+        memcpy(rows, result, sizeof result);
+    }
+}
+
+// hashes n_blocks blocks of HASH_LANES bytes from every lane
+// idle lanes have a stride of 0 and read the same zero bytes each block
+static void hash_lane_blocks(uint8_t hashes[HASH_LANES], const uint8_t *bytes[HASH_LANES],
+    const size_t strides[HASH_LANES], size_t n_blocks) {
+    const __m128i high_bits = _mm_set1_epi8((char)0xe0);
+    __m128i hash = _mm_loadu_si128((const __m128i *)hashes);
+    for (size_t block = 0; block < n_blocks; block++) {
+        __m128i rows[HASH_LANES];
+        for (int lane = 0; lane < HASH_LANES; lane++) {
+            rows[lane] = _mm_loadu_si128((const __m128i *)bytes[lane]);
+            bytes[lane] += strides[lane];
+        }
+        transpose_16x16(rows);
+        for (int i = 0; i < HASH_LANES; i++) {
+            // hash * 33 is hash + (hash << 5) in each byte lane
+            __m128i shifted = _mm_and_si128(_mm_slli_epi16(hash, 5), high_bits);
+            hash = _mm_xor_si128(_mm_add_epi8(hash, shifted), rows[i]);
+        }
+    }
+    _mm_storeu_si128((__m128i *)hashes, hash);
+}
+
+static void hash_many_lanes(size_t n, const uint8_t *const *buffers, const size_t *lengths, uint8_t *hashes) {
+    static const uint8_t idle_bytes[HASH_LANES];
+    const uint8_t *lane_bytes[HASH_LANES];
+    size_t lane_strides[HASH_LANES];
+    size_t lane_remaining[HASH_LANES];
+    size_t lane_buffer[HASH_LANES];
+    uint8_t lane_hashes[HASH_LANES];
+    for (int lane = 0; lane < HASH_LANES; lane++) {
+        lane_buffer[lane] = n;
+    }
+
+    size_t next = 0;
+    int n_active = 0;
+    for (;;) {
+        // finish lanes with less than a block left and give them the next droplet
+        for (int lane = 0; lane < HASH_LANES; lane++) {
+            if (lane_buffer[lane] < n && lane_remaining[lane] < HASH_LANES) {
+                hashes[lane_buffer[lane]] = droplet_hash_bytes(lane_hashes[lane],
+                    lane_bytes[lane], lane_remaining[lane]);
+                lane_buffer[lane] = n;
+                n_active--;
+            }
+            while (lane_buffer[lane] == n && next < n) {
+                if (lengths[next] < HASH_LANE_MIN) {
+                    hashes[next] = droplet_hash_bytes(0, buffers[next], lengths[next]);
+                } else {
+                    lane_buffer[lane] = next;
+                    lane_bytes[lane] = buffers[next];
+                    lane_strides[lane] = HASH_LANES;
+                    lane_remaining[lane] = lengths[next];
+                    lane_hashes[lane] = 0;
+                    n_active++;
+                }
+                next++;
+            }
+            if (lane_buffer[lane] == n) {
+                lane_bytes[lane] = idle_bytes;
+                lane_strides[lane] = 0;
+                lane_hashes[lane] = 0;
+            }
+        }
+
+        // a few long droplets left over are quicker hashed on their own
+        if (n_active < HASH_LANES / 4) {
+            break;
+        }
+
+        // run every lane until the shortest droplet is nearly done
+        size_t n_blocks = SIZE_MAX;
+        for (int lane = 0; lane < HASH_LANES; lane++) {
+            if (lane_buffer[lane] < n && lane_remaining[lane] / HASH_LANES < n_blocks) {
+                n_blocks = lane_remaining[lane] / HASH_LANES;
+            }
+        }
+        hash_lane_blocks(lane_hashes, lane_bytes, lane_strides, n_blocks);
+        for (int lane = 0; lane < HASH_LANES; lane++) {
+            if (lane_buffer[lane] < n) {
+                lane_remaining[lane] -= n_blocks * HASH_LANES;
+            }
+        }
+    }
+
+    for (int lane = 0; lane < HASH_LANES; lane++) {
+        if (lane_buffer[lane] < n) {
+            hashes[lane_buffer[lane]] = droplet_hash_bytes(lane_hashes[lane],
+                lane_bytes[lane], lane_remaining[lane]);
+        }
+    }
+}
+
+#else
+
+static void hash_many_lanes(size_t n, const uint8_t *const *buffers, const size_t *lengths, uint8_t *hashes) {
+    for (size_t i = 0; i < n; i++) {
+        hashes[i] = droplet_hash_bytes(0, buffers[i], lengths[i]);
+    }
+}
+
+#endif
+
+struct hash_many_job {
+    size_t n;
+    const uint8_t *const *buffers;
+    const size_t *lengths;
+    uint8_t *hashes;
+};
+
+static void hash_group(void *context, size_t group) {
+    struct hash_many_job *job = context;
+    size_t first = group * HASH_GROUP;
+    size_t n = job->n - first < HASH_GROUP ? job->n - first : HASH_GROUP;
+    hash_many_lanes(n, job->buffers + first, job->lengths + first, job->hashes + first);
+}
+
+// sets hashes[i] to the droplet_hash of lengths[i] bytes at buffers[i]
+// for each of the n buffers, spread across threads and SIMD lanes
+void droplet_hash_many(size_t n, const uint8_t *const *buffers, const size_t *lengths, uint8_t *hashes) {
+    struct hash_many_job job = {
+        .n = n,
+        .buffers = buffers,
+        .lengths = lengths,
+        .hashes = hashes,
+    };
+    parallel_for((n + HASH_GROUP - 1) / HASH_GROUP, hash_group, &job);
+}
+
+// a hash step only carries from the low three bits into the top three:
+// bits 3 and 4 of the start just pass through to the result, so the
+// table needs running from the 64 values with those bits clear
+static int table_lane(int h) {
+    return ((h & 0x07) << 3) | (h >> 5);
+}
+
+// sets table[h] to the hash after n bytes starting from hash h, for all h
+static void chunk_table(const uint8_t *bytes, size_t n, uint8_t table[HASH_STATES]) {
+    uint8_t lanes[HASH_TABLE_LANES];
+    for (int h = 0; h < HASH_STATES; h++) {
+        if ((h & 0x18) == 0) {
+            lanes[table_lane(h)] = h;
+        }
+    }
+#if defined(__SSE2__)
+    const __m128i high_bits = _mm_set1_epi8((char)0xe0);
+    __m128i states[HASH_TABLE_LANES / HASH_LANES];
+    for (int r = 0; r < HASH_TABLE_LANES / HASH_LANES; r++) {
+        states[r] = _mm_loadu_si128((const __m128i *)(lanes + r * HASH_LANES));
+    }
+    for (size_t i = 0; i < n; i++) {
+        __m128i byte = _mm_set1_epi8((char)bytes[i]);
+        for (int r = 0; r < HASH_TABLE_LANES / HASH_LANES; r++) {
+            __m128i shifted = _mm_and_si128(_mm_slli_epi16(states[r], 5), high_bits);
+            states[r] = _mm_xor_si128(_mm_add_epi8(states[r], shifted), byte);
+        }
+    }
+    for (int r = 0; r < HASH_TABLE_LANES / HASH_LANES; r++) {
+        _mm_storeu_si128((__m128i *)(lanes + r * HASH_LANES), states[r]);
+    }
+#else
+    for (int lane = 0; lane < HASH_TABLE_LANES; lane++) {
+        lanes[lane] = droplet_hash_bytes(lanes[lane], bytes, n);
+    }
+#endif
+    for (int h = 0; h < HASH_STATES; h++) {
+        table[h] = lanes[table_lane(h)] ^ (h & 0x18);
+    }
+}
+
+struct hash_range_job {
+    int fd;
+    off_t offset;
+    uint64_t length;
+    uint8_t *tables;
+};
+
+// the first chunk starts from hash 0 so only needs hashing once
+static void hash_range_chunk(void *context, size_t chunk) {
+    struct hash_range_job *job = context;
+    uint64_t start = (uint64_t)chunk * HASH_CHUNK;
+    size_t n = job->length - start < HASH_CHUNK ? job->length - start : HASH_CHUNK;
+    uint8_t *bytes = malloc(n);
+    if (pread(job->fd, bytes, n, job->offset + start) != (ssize_t)n) {
+        perror("partially created droplet/EOF found");
+        exit(1);
+    }
+    uint8_t *table = job->tables + chunk * HASH_STATES;
+    if (chunk == 0) {
+        table[0] = droplet_hash_bytes(0, bytes, n);
+    } else {
+        chunk_table(bytes, n, table);
+    }
+    free(bytes);
+}
+
+// returns whether droplet_hash_range would hash length bytes in chunks
+// on many threads, given the threads this thread has
+bool droplet_hash_range_parallel(uint64_t length) {
+    return length > HASH_CHUNK && rain_thread_budget() >= HASH_TABLE_MIN_THREADS;
+}
+
+// returns the droplet_hash of length bytes at offset of the file open on fd
+// huge ranges are hashed in chunks on many threads
+uint8_t droplet_hash_range(int fd, off_t offset, uint64_t length) {
+    uint64_t n_chunks = (length + HASH_CHUNK - 1) / HASH_CHUNK;
+    if (!droplet_hash_range_parallel(length)) {
+        uint8_t *bytes = malloc(length < HASH_CHUNK ? length + 1 : HASH_CHUNK);
+        uint8_t hash = 0;
+        for (uint64_t done = 0; done < length;) {
+            size_t n = length - done < HASH_CHUNK ? length - done : HASH_CHUNK;
+            if (pread(fd, bytes, n, offset + done) != (ssize_t)n) {
+                perror("partially created droplet/EOF found");
+                exit(1);
+            }
+            hash = droplet_hash_bytes(hash, bytes, n);
+            done += n;
+        }
+        free(bytes);
+        return hash;
+    }
+
+    struct hash_range_job job = {
+        .fd = fd,
+        .offset = offset,
+        .length = length,
+        .tables = malloc(n_chunks * HASH_STATES),
+    };
+    parallel_for(n_chunks, hash_range_chunk, &job);
+
+    uint8_t hash = job.tables[0];
+    for (uint64_t chunk = 1; chunk < n_chunks; chunk++) {
+        hash = job.tables[chunk * HASH_STATES + hash];
+    }
+    free(job.tables);
+    return hash;
+}
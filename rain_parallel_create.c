@@ -0,0 +1,427 @@
+// This file provides creating and appending to a drop on many threads
+//
+// In the 6, 7 and 8-bit formats the length of every droplet follows
+// from its pathname and the size stat gives, so the files are first
+// walked in the order the sequential writer takes, planning each
+// droplet and the offset it will start at.  The range the droplets take
+// is then reserved at the end of the drop at once, and workers each
+// read, encode and hash one droplet at a time and pwrite it at its own
+// offset.  "Adding:" lines are printed in droplet order as the droplets
+// are finished, so the output and the drop are the same as writing them
+// one at a time.
+//
+// With --dedup, offsets are only given out once the walk is done: files
+// of a length shared by another file are hashed on every thread first,
+// then each file is looked up in the index of those before it and, if
+// its contents are already planned, planned as a reference droplet.
+// Files with holes are planned as sparse droplets from their extents.
+//
+// In the 6 and 7-bit formats every file is read through once before the
+// range is reserved, so a file with a byte the format can not store
+// stops the create with the drop as it was.  A droplet which still can
+// not be written, as its file changed or a write failed, is reported
+// and the whole range is given back with abandon_drop_range.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+#define PLAN_SCAN_READ (1024 * 1024)
+
+struct planned_droplet {
+    char *pathname;
+    mode_t mode;
+    uint64_t content_length;     /**< 0 for a directory. */
+    struct stat stats;
+    off_t offset;
+    struct sparse_extent *extents; /**< NULL unless the file has holes. */
+    size_t n_extents;
+    uint64_t data_length;        /**< Bytes in the extents. */
+    char reference_kind;         /**< 0 unless it is a reference droplet. */
+    off_t target_offset;         /**< The droplet a reference refers to. */
+    bool hashed;
+    uint8_t digest[SHA256_LENGTH];
+    int bad_byte;                /**< -1 unless the format can not store a byte. */
+    bool done;
+    bool failed;                 /**< Whether it could not be written. */
+};
+
+struct create_plan {
+    int format;
+    int output_fd;
+    struct planned_droplet *droplets;
+    size_t n_droplets;
+    size_t capacity;
+    off_t end;                   /**< Where the next droplet will start. */
+    struct pathname_set *drop_directories; /**< Directories in the drop before this append. */
+    struct pathname_set *directories; /**< Directories planned so far. */
+    size_t *to_hash;             /**< Droplets whose files need hashing. */
+    pthread_mutex_t print_lock;
+    size_t n_printed;
+    bool failed;                 /**< Whether any droplet could not be written. */
+};
+
+static size_t droplet_header_length(size_t pathname_length) {
+    return DROP_LENGTH_MAGIC + DROP_LENGTH_FORMAT + DROP_LENGTH_MODE + DROP_LENGTH_PATHNLEN +
+        pathname_length + DROP_LENGTH_CONTLEN;
+}
+
+// plans the droplet of pathname, which the plan takes over
+static void plan_droplet(struct create_plan *plan, char *pathname, struct stat *stats) {
+    if (plan->n_droplets == plan->capacity) {
+        plan->capacity = plan->capacity == 0 ? 256 : plan->capacity * 2;
+        plan->droplets = realloc(plan->droplets, plan->capacity * sizeof *plan->droplets);
+    }
+    struct planned_droplet *droplet = &plan->droplets[plan->n_droplets++];
+    droplet->pathname = pathname;
+    droplet->mode = stats->st_mode;
+    droplet->content_length = (stats->st_mode & S_IFDIR) ? 0 : (uint64_t)stats->st_size;
+    droplet->stats = *stats;
+    droplet->extents = sparse_extents(pathname, stats, &droplet->n_extents, &droplet->data_length);
+    droplet->reference_kind = 0;
+    droplet->hashed = false;
+    droplet->bad_byte = -1;
+    droplet->done = false;
+    droplet->failed = false;
+}
+
+struct sized_file {
+    uint64_t size;
+    dev_t dev;
+    ino_t ino;
+    size_t droplet;
+};
+
+static int compare_sized_files(const void *a, const void *b) {
+    const struct sized_file *x = a, *y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    return x->droplet < y->droplet ? -1 : x->droplet > y->droplet;
+}
+
+static void hash_planned_file(void *context, size_t item) {
+    struct create_plan *plan = context;
+    struct planned_droplet *droplet = &plan->droplets[plan->to_hash[item]];
+    dedup_hash_file(droplet->pathname, droplet->content_length, droplet->digest);
+    droplet->hashed = true;
+}
+
+// hashes, on every thread, each file which has the same length as a
+// file that is not a hardlink to it, as only those can be copies
+static void hash_same_length_files(struct create_plan *plan) {
+    struct sized_file *files = malloc(plan->n_droplets * sizeof *files);
+    size_t n_files = 0;
+    for (size_t i = 0; i < plan->n_droplets; i++) {
+        struct planned_droplet *droplet = &plan->droplets[i];
+        if (dedup_eligible(&droplet->stats)) {
+            files[n_files++] = (struct sized_file){
+                droplet->content_length, droplet->stats.st_dev, droplet->stats.st_ino, i,
+            };
+        }
+    }
+    qsort(files, n_files, sizeof *files, compare_sized_files);
+
+    plan->to_hash = malloc(n_files * sizeof *plan->to_hash);
+    size_t n_to_hash = 0;
+    for (size_t start = 0, end; start < n_files; start = end) {
+        bool distinct = false;
+        for (end = start + 1; end < n_files && files[end].size == files[start].size; end++) {
+            distinct |= files[end].dev != files[start].dev || files[end].ino != files[start].ino;
+        }
+        for (size_t i = start; distinct && i < end; i++) {
+            plan->to_hash[n_to_hash++] = files[i].droplet;
+        }
+    }
+    parallel_for(n_to_hash, hash_planned_file, plan);
+    free(plan->to_hash);
+    free(files);
+}
+
+// gives each planned droplet its offset from 0, planning files whose
+// contents are in written_files, or planned before them, as references
+// written_files is NULL unless creating with --dedup
+static void place_droplets(struct create_plan *plan, struct dedup_index *written_files) {
+    if (written_files != NULL) {
+        hash_same_length_files(plan);
+    }
+    for (size_t i = 0; i < plan->n_droplets; i++) {
+        struct planned_droplet *droplet = &plan->droplets[i];
+        droplet->offset = plan->end;
+        uint64_t stored_length = droplet->extents != NULL ?
+            sparse_stored_length(droplet->n_extents, droplet->data_length) :
+            packed_content_length(plan->format, droplet->content_length);
+        if (written_files != NULL && dedup_eligible(&droplet->stats)) {
+            droplet->reference_kind = dedup_find(written_files, droplet->pathname, &droplet->stats,
+                &droplet->hashed, droplet->digest, &droplet->target_offset);
+            if (droplet->reference_kind == REFERENCE_COPY) {
+                dedup_add_copy(written_files, &droplet->stats, droplet->offset);
+            }
+            if (droplet->reference_kind != 0) {
+                stored_length = packed_content_length(DROPLET_FMT_REF, droplet->content_length);
+            } else {
+                dedup_add(written_files, droplet->pathname, &droplet->stats, &droplet->hashed,
+                    droplet->digest, droplet->offset);
+            }
+        }
+        plan->end += droplet_header_length(strlen(droplet->pathname)) + stored_length + DROP_LENGTH_HASH;
+    }
+}
+
+static void plan_stat(char *pathname, struct stat *stats) {
+    if (stat(pathname, stats) != 0) {
+        perror(pathname);
+        exit(1);
+    }
+}
+
+// plans a directory droplet for each directory leading to pathname not
+// already planned or in the drop, as create_drop_backwards adds them
+static void plan_ancestors(struct create_plan *plan, char *pathname) {
+    char *copy = strdup(pathname);
+    char *prefix = malloc(strlen(pathname) + 1);
+    prefix[0] = '\0';
+    char *directory = strtok(copy, "/");
+    char *next = strtok(NULL, "/");
+    while (next != NULL) {
+        strcat(prefix, directory);
+        if (!pathname_set_contains(plan->drop_directories, prefix) &&
+            pathname_set_add(plan->directories, prefix)) {
+            struct stat stats;
+            plan_stat(prefix, &stats);
+            plan_droplet(plan, strdup(prefix), &stats);
+        }
+        strcat(prefix, "/");
+        directory = next;
+        next = strtok(NULL, "/");
+    }
+    free(prefix);
+    free(copy);
+}
+
+// finds the first byte of a planned file which can not be stored in the
+// plan's format
+static void scan_planned_file(void *context, size_t item) {
+    struct create_plan *plan = context;
+    struct planned_droplet *droplet = &plan->droplets[item];
+    // references and sparse droplets store no encoded contents
+    if ((droplet->mode & S_IFDIR) || droplet->reference_kind != 0 || droplet->extents != NULL) {
+        return;
+    }
+    int fd = open(droplet->pathname, O_RDONLY);
+    if (fd < 0) {
+        perror(droplet->pathname);
+        exit(1);
+    }
+    uint8_t *bytes = malloc(PLAN_SCAN_READ);
+    for (uint64_t done = 0; done < droplet->content_length && droplet->bad_byte < 0;) {
+        size_t n = droplet->content_length - done < PLAN_SCAN_READ ? droplet->content_length - done : PLAN_SCAN_READ;
+        ssize_t length = pread(fd, bytes, n, done);
+        if (length < 0) {
+            perror(droplet->pathname);
+            exit(1);
+        } else if (length == 0) {
+            fprintf(stderr, "error: %s changed size while being added\n", droplet->pathname);
+            exit(1);
+        }
+        droplet->bad_byte = codec_find_bad_byte(plan->format, bytes, length);
+        done += length;
+    }
+    free(bytes);
+    close(fd);
+}
+
+// stops the create, before anything is reserved, if a planned file has
+// a byte which can not be stored in the plan's format
+static void check_planned_files(struct create_plan *plan) {
+    parallel_for(plan->n_droplets, scan_planned_file, plan);
+    for (size_t i = 0; i < plan->n_droplets; i++) {
+        if (plan->droplets[i].bad_byte >= 0) {
+            fprintf(stderr, "error: byte 0x%02x in %s can not be stored in '%c' format\n",
+                plan->droplets[i].bad_byte, plan->droplets[i].pathname, plan->format);
+            exit(1);
+        }
+    }
+}
+
+// writes one planned droplet at its offset
+// returns false if it could not be, which has been reported
+static bool write_planned_droplet(struct create_plan *plan, struct planned_droplet *droplet) {
+    if (droplet->reference_kind != 0) {
+        size_t length;
+        uint8_t *reference = build_reference_droplet(droplet->pathname, droplet->mode,
+            droplet->content_length, droplet->reference_kind, droplet->offset - droplet->target_offset, &length);
+        bool written = pwrite(plan->output_fd, reference, length, droplet->offset) == (ssize_t)length;
+        if (!written) {
+            perror("pwrite");
+        }
+        free(reference);
+        return written;
+    }
+
+    size_t pathname_length = strlen(droplet->pathname);
+    size_t header_length = droplet_header_length(pathname_length);
+    uint8_t *header = malloc(header_length);
+    char *permissions = convert_permissions_to_array(droplet->mode);
+    header[DROP_OFFSET_MAGIC] = DROPLET_MAGIC;
+    header[DROP_OFFSET_FORMAT] = droplet->extents != NULL ? DROPLET_FMT_SPARSE : plan->format;
+    memcpy(header + DROP_OFFSET_MODE, permissions, DROP_LENGTH_MODE);
+    store_little_endian(header + DROP_OFFSET_PATHNLEN, pathname_length, DROP_LENGTH_PATHNLEN);
+    memcpy(header + DROP_OFFSET_PATHNLEN + DROP_LENGTH_PATHNLEN, droplet->pathname, pathname_length);
+    store_little_endian(header + header_length - DROP_LENGTH_CONTLEN, droplet->content_length,
+        DROP_LENGTH_CONTLEN);
+    free(permissions);
+
+    uint8_t hash = droplet_hash_bytes(0, header, header_length);
+    bool written = pwrite(plan->output_fd, header, header_length, droplet->offset) == (ssize_t)header_length;
+    free(header);
+    if (!written) {
+        perror("pwrite");
+        return false;
+    }
+
+    int64_t stored_length = 0;
+    int bad_byte = -1;
+    if (droplet->extents != NULL) {
+        FILE *output_stream = open_pwrite_stream(plan->output_fd, droplet->offset + header_length, &hash);
+        stored_length = write_sparse_content(droplet->pathname, droplet->extents, droplet->n_extents,
+            droplet->data_length, output_stream);
+        if (fclose(output_stream) != 0 && stored_length >= 0) {
+            perror("pwrite");
+            stored_length = -1;
+        }
+    } else if (!(droplet->mode & S_IFDIR) && droplet->content_length >= PIPELINE_MIN_LENGTH) {
+        int input_fd = open(droplet->pathname, O_RDONLY);
+        if (input_fd < 0) {
+            perror(droplet->pathname);
+            return false;
+        }
+        stored_length = pipeline_encode(input_fd, plan->output_fd, droplet->offset + header_length,
+            plan->format, droplet->content_length, &hash, &bad_byte);
+        close(input_fd);
+    } else if (!(droplet->mode & S_IFDIR)) {
+        FILE *input_stream = fopen(droplet->pathname, "rb");
+        if (input_stream == NULL) {
+            perror(droplet->pathname);
+            return false;
+        }
+        FILE *output_stream = open_pwrite_stream(plan->output_fd, droplet->offset + header_length, &hash);
+        stored_length = write_droplet_content(input_stream, output_stream, plan->format,
+            droplet->content_length, &bad_byte);
+        if (fclose(output_stream) != 0 && stored_length >= 0) {
+            perror("pwrite");
+            stored_length = -1;
+        }
+        fclose(input_stream);
+    }
+    if (stored_length < 0) {
+        // the file has changed since it was read through for bad bytes
+        if (bad_byte >= 0) {
+            fprintf(stderr, "error: byte 0x%02x in %s can not be stored in '%c' format\n",
+                bad_byte, droplet->pathname, plan->format);
+        }
+        return false;
+    }
+
+    off_t hash_offset = droplet->offset + header_length + stored_length;
+    if (pwrite(plan->output_fd, &hash, DROP_LENGTH_HASH, hash_offset) != DROP_LENGTH_HASH) {
+        perror("pwrite");
+        return false;
+    }
+    return true;
+}
+
+static void create_planned_droplet(void *context, size_t item) {
+    struct create_plan *plan = context;
+    struct planned_droplet *droplet = &plan->droplets[item];
+    bool written = write_planned_droplet(plan, droplet);
+
+    pthread_mutex_lock(&plan->print_lock);
+    droplet->done = true;
+    droplet->failed = !written;
+    plan->failed |= !written;
+    while (plan->n_printed < plan->n_droplets && plan->droplets[plan->n_printed].done) {
+        if (!plan->droplets[plan->n_printed].failed) {
+            printf("Adding: %s\n", plan->droplets[plan->n_printed].pathname);
+        }
+        plan->n_printed++;
+    }
+    pthread_mutex_unlock(&plan->print_lock);
+}
+
+// adds pathnames and everything under them, in the 6, 7 or 8-bit format,
+// to the end of the drop open on output_fd, in a range reserved for them
+// so other processes can append at the same time
+// drop_directories is the set of directories in the drop already, which
+// are not added again as ancestors, and added_directories those added so
+// far, which are not added again at all and has those planned added to it
+// written_files is the index of files to store duplicates of as
+// references, or NULL
+// known_files is the index of files to leave out if unchanged and to
+// record the files added in, or NULL
+void create_drop_parallel(int output_fd, int format, int n_pathnames, char *pathnames[n_pathnames],
+    struct pathname_set *drop_directories, struct pathname_set *added_directories,
+    struct dedup_index *written_files, struct update_index *known_files) {
+    struct create_plan plan = {
+        .format = format,
+        .output_fd = output_fd,
+        .drop_directories = drop_directories,
+        .directories = added_directories,
+    };
+    for (int i = 0; i < n_pathnames; i++) {
+        plan_ancestors(&plan, pathnames[i]);
+        size_t n_entries;
+        struct walk_entry *entries = walk_tree(pathnames[i], &n_entries);
+        if (known_files != NULL) {
+            n_entries = update_filter(known_files, entries, n_entries);
+        }
+        for (size_t j = 0; j < n_entries; j++) {
+            if ((entries[j].stats.st_mode & S_IFDIR) && !pathname_set_add(plan.directories, entries[j].pathname)) {
+                free(entries[j].pathname);
+                continue;
+            }
+            plan_droplet(&plan, entries[j].pathname, &entries[j].stats);
+        }
+        free(entries);
+    }
+    place_droplets(&plan, written_files);
+    if (format == DROPLET_FMT_6 || format == DROPLET_FMT_7) {
+        check_planned_files(&plan);
+    }
+
+    // offsets were planned from 0, the range is only reserved once the
+    // walk is done
+    off_t start = reserve_drop_range(output_fd, plan.end);
+    for (size_t i = 0; i < plan.n_droplets; i++) {
+        plan.droplets[i].offset += start;
+        if (plan.droplets[i].reference_kind != 0) {
+            plan.droplets[i].target_offset += start;
+        }
+    }
+
+    pthread_mutex_init(&plan.print_lock, NULL);
+    parallel_for(plan.n_droplets, create_planned_droplet, &plan);
+    pthread_mutex_destroy(&plan.print_lock);
+    if (plan.failed) {
+        // none of the droplets are kept if they were not all written
+        abandon_drop_range(output_fd, start, plan.end);
+        exit(1);
+    }
+    release_drop_range(output_fd, start, plan.end);
+
+    for (size_t i = 0; i < plan.n_droplets; i++) {
+        free(plan.droplets[i].pathname);
+        free(plan.droplets[i].extents);
+    }
+    free(plan.droplets);
+}
@@ -0,0 +1,112 @@
+// This file provides a set of pathnames, an open addressing hash table
+// of FNV-1a hashes probed linearly, which create uses to add each
+// directory to a drop only once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "rain.h"
+
+#define PATHNAME_SET_INITIAL 64
+
+struct pathname_set {
+    char **pathnames;            /**< NULL where a slot is empty. */
+    uint64_t *hashes;
+    size_t capacity;             /**< Always a power of two. */
+    size_t n_pathnames;
+};
+
+static uint64_t hash_pathname(const char *pathname) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const unsigned char *byte = (const unsigned char *)pathname; *byte != '\0'; byte++) {
+        hash = (hash ^ *byte) * 0x100000001b3;
+    }
+    return hash;
+}
+
+struct pathname_set *pathname_set_new(void) {
+    struct pathname_set *set = malloc(sizeof *set);
+    set->capacity = PATHNAME_SET_INITIAL;
+    set->pathnames = calloc(set->capacity, sizeof *set->pathnames);
+    set->hashes = malloc(set->capacity * sizeof *set->hashes);
+    set->n_pathnames = 0;
+    return set;
+}
+
+void pathname_set_free(struct pathname_set *set) {
+    for (size_t i = 0; i < set->capacity; i++) {
+        free(set->pathnames[i]);
+    }
+    free(set->pathnames);
+    free(set->hashes);
+    free(set);
+}
+
+// returns the slot holding pathname, or the empty slot it would go in
+static size_t find_slot(struct pathname_set *set, const char *pathname, uint64_t hash) {
+    size_t slot = hash & (set->capacity - 1);
+    while (set->pathnames[slot] != NULL &&
+        (set->hashes[slot] != hash || strcmp(set->pathnames[slot], pathname) != 0)) {
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    return slot;
+}
+
+static void grow(struct pathname_set *set) {
+    char **pathnames = set->pathnames;
+    uint64_t *hashes = set->hashes;
+    size_t capacity = set->capacity;
+    set->capacity *= 2;
+    set->pathnames = calloc(set->capacity, sizeof *set->pathnames);
+    set->hashes = malloc(set->capacity * sizeof *set->hashes);
+    for (size_t i = 0; i < capacity; i++) {
+        if (pathnames[i] != NULL) {
+            size_t slot = find_slot(set, pathnames[i], hashes[i]);
+            set->pathnames[slot] = pathnames[i];
+            set->hashes[slot] = hashes[i];
+        }
+    }
+    free(pathnames);
+    free(hashes);
+}
+
+// adds a copy of pathname to the set
+// returns false if it was already there
+bool pathname_set_add(struct pathname_set *set, const char *pathname) {
+    // kept at most half full so probes stay short
+    if (2 * (set->n_pathnames + 1) > set->capacity) {
+        grow(set);
+    }
+    uint64_t hash = hash_pathname(pathname);
+    size_t slot = find_slot(set, pathname, hash);
+    if (set->pathnames[slot] != NULL) {
+        return false;
+    }
+    set->pathnames[slot] = strdup(pathname);
+    set->hashes[slot] = hash;
+    set->n_pathnames++;
+    return true;
+}
+
+// returns whether pathname is in the set
+bool pathname_set_contains(struct pathname_set *set, const char *pathname) {
+    return set->pathnames[find_slot(set, pathname, hash_pathname(pathname))] != NULL;
+}
+
+// adds the pathname of every directory droplet of the drop open on fd
+// a damaged drop is only read up to the damage
+void pathname_set_add_drop_directories(struct pathname_set *set, int fd) {
+    off_t drop_size = settled_drop_size(fd);
+    off_t offset = 0;
+    struct droplet_header header;
+    while (drop_size > 0 && read_droplet_header(fd, offset, drop_size, &header) == SCAN_OK) {
+        if (header.format != DROPLET_FMT_SOLID && header.mode[0] == 'd') {
+            pathname_set_add(set, header.pathname);
+        }
+        offset += header.length;
+        free(header.pathname);
+    }
+}
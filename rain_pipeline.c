@@ -0,0 +1,341 @@
+// This file provides the pipeline large members are encoded and decoded
+// through, so reading, the n-bit codec, hashing and writing all overlap
+//
+// A pipeline is a ring of chunk slots which a fixed series of stages
+// pass over in turn, each on its own thread.  Every stage has a cursor,
+// the number of chunks it has finished, which only it writes: a stage
+// may work on a chunk once the stage before has finished it, and the
+// first stage may refill a slot once the last stage has finished with
+// it.  Each cursor has one writer and one reader, so the hand-offs are
+// single-producer, single-consumer and need no locks, and a member
+// moves at the speed of its slowest stage rather than the sum of them.
+// A stage with nothing to do spins briefly, then sleeps until a cursor
+// moves.  The stages only get threads of their own when the caller's
+// thread budget has one for each, otherwise each chunk goes through them
+// in turn on the calling thread.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "rain.h"
+
+#define PIPELINE_CHUNK (1024 * 1024)
+#define PIPELINE_SLOTS 8
+#define PIPELINE_MAX_STAGES 4
+// checks of the cursor a stage waits on before it sleeps
+#define PIPELINE_SPINS 1000
+
+struct pipeline_slot {
+    uint8_t *input;
+    size_t input_length;
+    uint8_t *output;             /**< The input encoded or decoded. */
+    size_t output_length;
+    bool last;                   /**< No chunks follow this one. */
+};
+
+struct pipeline;
+
+// processes one chunk, returns false to end the pipeline early, in
+// which case the slot is the last one the later stages see
+typedef bool (*pipeline_stage)(struct pipeline *pipeline, struct pipeline_slot *slot);
+
+struct pipeline {
+    struct pipeline_slot slots[PIPELINE_SLOTS];
+    pipeline_stage stages[PIPELINE_MAX_STAGES];
+    int n_stages;
+    atomic_size_t cursors[PIPELINE_MAX_STAGES];
+    atomic_bool finished;        /**< The last stage has stopped. */
+    pthread_mutex_t lock;
+    pthread_cond_t moved;        /**< Signalled when a cursor moves. */
+    atomic_int n_sleeping;       /**< Stages waiting on moved. */
+
+    int input_fd;
+    off_t input_offset;
+    uint64_t input_remaining;
+    int output_fd;
+    off_t output_offset;         /**< -1 to write at the fd's position. */
+    struct droplet_codec codec;
+    uint64_t values_remaining;   /**< Content bytes still to decode. */
+    uint8_t *hash;
+    uint64_t n_written;
+    bool failed;                 /**< A byte could not be encoded. */
+    bool broken;                 /**< Reading or writing failed, as reported. */
+};
+
+struct stage_thread {
+    struct pipeline *pipeline;
+    int stage;
+};
+
+// returns whether the chunk is ready for this stage
+static bool chunk_ready(struct pipeline *pipeline, int stage, size_t chunk) {
+    size_t ready = stage == 0 ?
+        atomic_load(&pipeline->cursors[pipeline->n_stages - 1]) + PIPELINE_SLOTS :
+        atomic_load(&pipeline->cursors[stage - 1]);
+    return chunk < ready;
+}
+
+// waits until the chunk the cursor is on is ready for this stage
+// returns false if the pipeline finished first
+static bool wait_for_chunk(struct pipeline *pipeline, int stage, size_t chunk) {
+    for (int i = 0; i < PIPELINE_SPINS; i++) {
+        if (chunk_ready(pipeline, stage, chunk)) {
+            return true;
+        }
+        if (atomic_load(&pipeline->finished)) {
+            return false;
+        }
+    }
+    // a stage which moves a cursor only takes the lock if a stage is
+    // asleep, and a stage counts itself asleep before it looks again, so
+    // every move is either seen here or signalled
+    pthread_mutex_lock(&pipeline->lock);
+    atomic_fetch_add(&pipeline->n_sleeping, 1);
+    while (!chunk_ready(pipeline, stage, chunk) && !atomic_load(&pipeline->finished)) {
+        pthread_cond_wait(&pipeline->moved, &pipeline->lock);
+    }
+    atomic_fetch_sub(&pipeline->n_sleeping, 1);
+    pthread_mutex_unlock(&pipeline->lock);
+    return chunk_ready(pipeline, stage, chunk);
+}
+
+// wakes the stages asleep in wait_for_chunk, if any
+static void wake_stages(struct pipeline *pipeline) {
+    if (atomic_load(&pipeline->n_sleeping) > 0) {
+        pthread_mutex_lock(&pipeline->lock);
+        pthread_cond_broadcast(&pipeline->moved);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+}
+
+static void *run_stage(void *argument) {
+    struct stage_thread *thread = argument;
+    struct pipeline *pipeline = thread->pipeline;
+    int stage = thread->stage;
+    for (size_t chunk = 0; wait_for_chunk(pipeline, stage, chunk); chunk++) {
+        struct pipeline_slot *slot = &pipeline->slots[chunk % PIPELINE_SLOTS];
+        if (!pipeline->stages[stage](pipeline, slot)) {
+            slot->last = true;
+        }
+        bool last = slot->last;
+        atomic_store(&pipeline->cursors[stage], chunk + 1);
+        wake_stages(pipeline);
+        if (last) {
+            break;
+        }
+    }
+    if (stage == pipeline->n_stages - 1) {
+        atomic_store(&pipeline->finished, true);
+        wake_stages(pipeline);
+    }
+    return NULL;
+}
+
+// runs each chunk through every stage in turn on the calling thread, for
+// when there are not the threads to spare for a stage each
+static void run_stages_in_turn(struct pipeline *pipeline) {
+    struct pipeline_slot *slot = &pipeline->slots[0];
+    do {
+        for (int stage = 0; stage < pipeline->n_stages; stage++) {
+            if (!pipeline->stages[stage](pipeline, slot)) {
+                slot->last = true;
+            }
+        }
+    } while (!slot->last);
+}
+
+// runs the pipeline's stages on a thread each, the last stage on the
+// calling thread, until its last chunk has been through all of them
+static void run_stage_threads(struct pipeline *pipeline) {
+    for (int i = 0; i < pipeline->n_stages; i++) {
+        atomic_init(&pipeline->cursors[i], 0);
+    }
+    atomic_init(&pipeline->finished, false);
+    atomic_init(&pipeline->n_sleeping, 0);
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->moved, NULL);
+
+    struct stage_thread threads[PIPELINE_MAX_STAGES];
+    pthread_t ids[PIPELINE_MAX_STAGES];
+    bool started[PIPELINE_MAX_STAGES] = { false };
+    for (int i = 0; i < pipeline->n_stages; i++) {
+        threads[i].pipeline = pipeline;
+        threads[i].stage = i;
+    }
+    for (int i = 0; i < pipeline->n_stages - 1; i++) {
+        if (pthread_create(&ids[i], NULL, run_stage, &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        started[i] = true;
+    }
+    run_stage(&threads[pipeline->n_stages - 1]);
+    for (int i = 0; i < pipeline->n_stages - 1; i++) {
+        if (started[i]) {
+            pthread_join(ids[i], NULL);
+        }
+    }
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->moved);
+}
+
+// runs the pipeline until its last chunk has been through every stage
+// the stages other than the last each take a thread of the calling
+// thread's budget, so a pipeline run from a parallel_for worker only
+// overlaps its stages if that worker has the threads to spare
+static void run_pipeline(struct pipeline *pipeline) {
+    bool threaded = rain_thread_budget() >= (size_t)pipeline->n_stages;
+    int n_slots = threaded ? PIPELINE_SLOTS : 1;
+    for (int i = 0; i < n_slots; i++) {
+        pipeline->slots[i].input = malloc(PIPELINE_CHUNK);
+        // decoding 6-bit contents gives 8 bytes for every 6
+        pipeline->slots[i].output = malloc(2 * PIPELINE_CHUNK + 1);
+        pipeline->slots[i].last = false;
+    }
+    if (threaded) {
+        run_stage_threads(pipeline);
+    } else {
+        run_stages_in_turn(pipeline);
+    }
+    for (int i = 0; i < n_slots; i++) {
+        free(pipeline->slots[i].input);
+        free(pipeline->slots[i].output);
+    }
+}
+
+static bool read_stage(struct pipeline *pipeline, struct pipeline_slot *slot) {
+    size_t n = pipeline->input_remaining < PIPELINE_CHUNK ? pipeline->input_remaining : PIPELINE_CHUNK;
+    ssize_t length = pipeline->input_offset < 0 ?
+        read(pipeline->input_fd, slot->input, n) :
+        pread(pipeline->input_fd, slot->input, n, pipeline->input_offset);
+    if (length < 0 || (length == 0 && n > 0)) {
+        if (length < 0) {
+            perror("read");
+        } else {
+            fprintf(stderr, "error: droplet contents ended early\n");
+        }
+        pipeline->broken = true;
+        slot->input_length = 0;
+        return false;
+    }
+    if (pipeline->input_offset >= 0) {
+        pipeline->input_offset += length;
+    }
+    pipeline->input_remaining -= length;
+    slot->input_length = length;
+    slot->last = pipeline->input_remaining == 0;
+    return true;
+}
+
+static bool encode_stage(struct pipeline *pipeline, struct pipeline_slot *slot) {
+    long length = codec_encode(&pipeline->codec, slot->input, slot->input_length, slot->output);
+    if (length < 0) {
+        pipeline->failed = true;
+        slot->output_length = 0;
+        return false;
+    }
+    slot->output_length = length;
+    if (slot->last) {
+        slot->output_length += codec_encode_finish(&pipeline->codec, slot->output + length);
+    }
+    return true;
+}
+
+static bool decode_stage(struct pipeline *pipeline, struct pipeline_slot *slot) {
+    slot->output_length = codec_decode(&pipeline->codec, slot->input, slot->input_length, slot->output,
+        pipeline->values_remaining);
+    pipeline->values_remaining -= slot->output_length;
+    return true;
+}
+
+// hashes the stored bytes: what is written when encoding, what is read
+// when decoding
+static bool hash_encoded_stage(struct pipeline *pipeline, struct pipeline_slot *slot) {
+    *pipeline->hash = droplet_hash_bytes(*pipeline->hash, slot->output, slot->output_length);
+    return true;
+}
+
+static bool hash_stored_stage(struct pipeline *pipeline, struct pipeline_slot *slot) {
+    *pipeline->hash = droplet_hash_bytes(*pipeline->hash, slot->input, slot->input_length);
+    return true;
+}
+
+static bool write_stage(struct pipeline *pipeline, struct pipeline_slot *slot) {
+    for (size_t done = 0; done < slot->output_length;) {
+        ssize_t length = pipeline->output_offset < 0 ?
+            write(pipeline->output_fd, slot->output + done, slot->output_length - done) :
+            pwrite(pipeline->output_fd, slot->output + done, slot->output_length - done,
+                pipeline->output_offset + pipeline->n_written);
+        if (length <= 0) {
+            perror("write");
+            pipeline->broken = true;
+            return false;
+        }
+        done += length;
+        pipeline->n_written += length;
+    }
+    return true;
+}
+
+// encodes content_length bytes read from input_fd in format, writing
+// them at output_offset of output_fd and carrying *hash on over them
+// returns the number of bytes stored, or -1 if a byte can not be stored
+// in the format, which is left in *bad_byte, or -1 with *bad_byte -1 if
+// reading or writing failed, which has been reported
+int64_t pipeline_encode(int input_fd, int output_fd, off_t output_offset, int format,
+    uint64_t content_length, uint8_t *hash, int *bad_byte) {
+    struct pipeline pipeline = {
+        .stages = { read_stage, encode_stage, hash_encoded_stage, write_stage },
+        .n_stages = 4,
+        .input_fd = input_fd,
+        .input_offset = -1,
+        .input_remaining = content_length,
+        .output_fd = output_fd,
+        .output_offset = output_offset,
+        .hash = hash,
+    };
+    codec_init(&pipeline.codec, format);
+    posix_fadvise(input_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    run_pipeline(&pipeline);
+    if (pipeline.failed || pipeline.broken) {
+        *bad_byte = pipeline.failed ? pipeline.codec.bad_byte : -1;
+        return -1;
+    }
+    return pipeline.n_written;
+}
+
+// decodes the stored_length bytes of format contents at input_offset of
+// input_fd, carrying *hash on over them unless hash is NULL, and writes
+// the content_length bytes they hold to output_fd
+// returns false if the contents are too short or could not be written
+bool pipeline_decode(int input_fd, off_t input_offset, uint64_t stored_length, int format,
+    uint64_t content_length, int output_fd, uint8_t *hash) {
+    struct pipeline pipeline = {
+        .stages = { read_stage, hash_stored_stage, decode_stage, write_stage },
+        .n_stages = 4,
+        .input_fd = input_fd,
+        .input_offset = input_offset,
+        .input_remaining = stored_length,
+        .output_fd = output_fd,
+        .output_offset = -1,
+        .values_remaining = content_length,
+        .hash = hash,
+    };
+    if (hash == NULL) {
+        // the caller hashes the contents some other way
+        pipeline.stages[1] = decode_stage;
+        pipeline.stages[2] = write_stage;
+        pipeline.n_stages = 3;
+    }
+    codec_init(&pipeline.codec, format);
+    run_pipeline(&pipeline);
+    return !pipeline.broken && pipeline.values_remaining == 0;
+}
@@ -0,0 +1,268 @@
+// This file provides reference droplets, which store a file whose
+// contents are already in the drop as a pointer to the droplet that
+// holds them
+//
+// When creating with --dedup, files are looked up by their length in an
+// index of the files written so far.  A file with the same device and
+// inode as one of them is a hardlink to it; otherwise, only once two
+// files have the same length, both are hashed with SHA-256 and a file
+// whose digest matches is a copy.  Either way it is stored as an 'r'
+// droplet holding the kind of reference and how many bytes before it
+// the earlier droplet starts, so a run of droplets can be moved as a
+// whole without breaking its references.  Extract makes a hardlink to,
+// or a copy of, the file extracted from the earlier droplet.
+//
+// A file stored as a copy is indexed by its device and inode too, so a
+// later hardlink to it refers to its copy reference and is extracted as
+// a hardlink to the same file; it is never itself the target of a copy.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+#define DEDUP_READ (1024 * 1024)
+#define DEDUP_NO_FILE SIZE_MAX
+
+struct dedup_file {
+    dev_t dev;
+    ino_t ino;
+    uint64_t size;
+    char *pathname;              /**< NULL for a copy reference. */
+    off_t offset;                /**< Where its droplet starts. */
+    bool hashed;
+    uint8_t digest[SHA256_LENGTH];
+    size_t next;                 /**< The next file in its bucket. */
+};
+
+struct dedup_index {
+    struct dedup_file *files;
+    size_t n_files;
+    size_t capacity;
+    size_t *buckets;             /**< First file of each length's bucket. */
+    size_t n_buckets;            /**< Always a power of two. */
+};
+
+// returns true if the file stat gave is worth storing as a reference
+bool dedup_eligible(struct stat *stats) {
+    return S_ISREG(stats->st_mode) && stats->st_size >= REFERENCE_MIN_LENGTH;
+}
+
+struct dedup_index *dedup_index_new(void) {
+    struct dedup_index *index = calloc(1, sizeof *index);
+    index->n_buckets = 64;
+    index->buckets = malloc(index->n_buckets * sizeof *index->buckets);
+    for (size_t i = 0; i < index->n_buckets; i++) {
+        index->buckets[i] = DEDUP_NO_FILE;
+    }
+    return index;
+}
+
+void dedup_index_free(struct dedup_index *index) {
+    for (size_t i = 0; i < index->n_files; i++) {
+        free(index->files[i].pathname);
+    }
+    free(index->files);
+    free(index->buckets);
+    free(index);
+}
+
+static size_t bucket_of(struct dedup_index *index, uint64_t size) {
+    return (size * 0x9e3779b97f4a7c15) >> 32 & (index->n_buckets - 1);
+}
+
+// hashes the size bytes of the file at pathname
+void dedup_hash_file(char *pathname, uint64_t size, uint8_t digest[SHA256_LENGTH]) {
+    int fd = open(pathname, O_RDONLY);
+    if (fd < 0) {
+        perror(pathname);
+        exit(1);
+    }
+    struct sha256 sha;
+    sha256_init(&sha);
+    uint8_t *bytes = malloc(DEDUP_READ);
+    for (uint64_t done = 0; done < size;) {
+        size_t n = size - done < DEDUP_READ ? size - done : DEDUP_READ;
+        ssize_t length = pread(fd, bytes, n, done);
+        if (length <= 0) {
+            perror(pathname);
+            exit(1);
+        }
+        sha256_update(&sha, bytes, length);
+        done += length;
+    }
+    sha256_final(&sha, digest);
+    free(bytes);
+    close(fd);
+}
+
+// looks for a file already written with the same contents as pathname
+// *hashed and digest are pathname's SHA-256, which is worked out here if
+// it is needed and *hashed is false
+// returns the kind of reference to it, or 0 if there is none, and the
+// offset of its droplet in *offset
+char dedup_find(struct dedup_index *index, char *pathname, struct stat *stats, bool *hashed,
+    uint8_t digest[SHA256_LENGTH], off_t *offset) {
+    size_t first = index->buckets[bucket_of(index, stats->st_size)];
+    // hardlinks are looked for first, as they need nothing hashed
+    for (size_t i = first; i != DEDUP_NO_FILE; i = index->files[i].next) {
+        struct dedup_file *file = &index->files[i];
+        if (file->size == (uint64_t)stats->st_size && file->dev == stats->st_dev && file->ino == stats->st_ino) {
+            *offset = file->offset;
+            return REFERENCE_HARDLINK;
+        }
+    }
+    for (size_t i = first; i != DEDUP_NO_FILE; i = index->files[i].next) {
+        struct dedup_file *file = &index->files[i];
+        if (file->size != (uint64_t)stats->st_size || file->pathname == NULL) {
+            continue;
+        }
+        if (!*hashed) {
+            dedup_hash_file(pathname, stats->st_size, digest);
+            *hashed = true;
+        }
+        if (!file->hashed) {
+            dedup_hash_file(file->pathname, file->size, file->digest);
+            file->hashed = true;
+        }
+        if (memcmp(file->digest, digest, SHA256_LENGTH) == 0) {
+            *offset = file->offset;
+            return REFERENCE_COPY;
+        }
+    }
+    return 0;
+}
+
+// adds the file stat gave, whose droplet starts at offset, to the index
+// returns its entry, with only its inode and size set
+static struct dedup_file *add_file(struct dedup_index *index, struct stat *stats, off_t offset) {
+    if (index->n_files == index->capacity) {
+        index->capacity = index->capacity == 0 ? 256 : index->capacity * 2;
+        index->files = realloc(index->files, index->capacity * sizeof *index->files);
+    }
+    if (index->n_files == index->n_buckets) {
+        // rebuild the buckets twice as many
+        index->n_buckets *= 2;
+        index->buckets = realloc(index->buckets, index->n_buckets * sizeof *index->buckets);
+        for (size_t i = 0; i < index->n_buckets; i++) {
+            index->buckets[i] = DEDUP_NO_FILE;
+        }
+        for (size_t i = 0; i < index->n_files; i++) {
+            size_t bucket = bucket_of(index, index->files[i].size);
+            index->files[i].next = index->buckets[bucket];
+            index->buckets[bucket] = i;
+        }
+    }
+
+    struct dedup_file *file = &index->files[index->n_files];
+    file->dev = stats->st_dev;
+    file->ino = stats->st_ino;
+    file->size = stats->st_size;
+    file->pathname = NULL;
+    file->offset = offset;
+    file->hashed = false;
+    size_t bucket = bucket_of(index, file->size);
+    file->next = index->buckets[bucket];
+    index->buckets[bucket] = index->n_files++;
+    return file;
+}
+
+// adds pathname, whose droplet starts at offset, to the index
+// digest is its SHA-256 if *hashed is true
+void dedup_add(struct dedup_index *index, char *pathname, struct stat *stats, bool *hashed,
+    uint8_t digest[SHA256_LENGTH], off_t offset) {
+    struct dedup_file *file = add_file(index, stats, offset);
+    file->pathname = strdup(pathname);
+    file->hashed = *hashed;
+    if (*hashed) {
+        memcpy(file->digest, digest, SHA256_LENGTH);
+    }
+}
+
+// adds the file stat gave, stored as a copy reference starting at
+// offset, to the index, so later hardlinks to it refer to it
+void dedup_add_copy(struct dedup_index *index, struct stat *stats, off_t offset) {
+    add_file(index, stats, offset);
+}
+
+// returns a malloc'd reference droplet for pathname, referring to the
+// droplet distance bytes before it, and its length in *length
+uint8_t *build_reference_droplet(char *pathname, mode_t mode, uint64_t content_length, char kind,
+    uint64_t distance, size_t *length) {
+    size_t pathname_length = strlen(pathname);
+    *length = DROP_LENGTH_MAGIC + DROP_LENGTH_FORMAT + DROP_LENGTH_MODE + DROP_LENGTH_PATHNLEN +
+        pathname_length + DROP_LENGTH_CONTLEN + REFERENCE_LENGTH + DROP_LENGTH_HASH;
+    uint8_t *droplet = malloc(*length);
+    char *permissions = convert_permissions_to_array(mode);
+    droplet[DROP_OFFSET_MAGIC] = DROPLET_MAGIC;
+    droplet[DROP_OFFSET_FORMAT] = DROPLET_FMT_REF;
+    memcpy(droplet + DROP_OFFSET_MODE, permissions, DROP_LENGTH_MODE);
+    free(permissions);
+    store_little_endian(droplet + DROP_OFFSET_PATHNLEN, pathname_length, DROP_LENGTH_PATHNLEN);
+    uint8_t *position = droplet + DROP_OFFSET_PATHNLEN + DROP_LENGTH_PATHNLEN;
+    memcpy(position, pathname, pathname_length);
+    position += pathname_length;
+    store_little_endian(position, content_length, DROP_LENGTH_CONTLEN);
+    position += DROP_LENGTH_CONTLEN;
+    position[0] = kind;
+    store_little_endian(position + 1, distance, REFERENCE_LENGTH - 1);
+    droplet[*length - DROP_LENGTH_HASH] = droplet_hash_bytes(0, droplet, *length - DROP_LENGTH_HASH);
+    return droplet;
+}
+
+// returns a malloc'd copy of the reference droplet at droplet, whose
+// header is header, referring distance bytes back instead, hash updated
+uint8_t *rebase_reference_droplet(const uint8_t *droplet, struct droplet_header *header, uint64_t distance) {
+    uint8_t *rebased = malloc(header->length);
+    memcpy(rebased, droplet, header->length);
+    store_little_endian(rebased + (header->content_offset - header->offset) + 1, distance, REFERENCE_LENGTH - 1);
+    rebased[header->length - DROP_LENGTH_HASH] = droplet_hash_bytes(0, rebased, header->length - DROP_LENGTH_HASH);
+    return rebased;
+}
+
+// reads the kind of the reference droplet whose header is header, in
+// the drop open on fd, and the offset of the droplet it refers to
+// returns false if the reference can not be read or points nowhere
+bool read_reference(int fd, struct droplet_header *header, char *kind, off_t *target_offset) {
+    uint8_t contents[REFERENCE_LENGTH];
+    if (pread(fd, contents, REFERENCE_LENGTH, header->content_offset) != REFERENCE_LENGTH) {
+        return false;
+    }
+    uint64_t distance = load_little_endian(contents + 1, REFERENCE_LENGTH - 1);
+    *kind = contents[0];
+    *target_offset = header->offset - distance;
+    return (*kind == REFERENCE_HARDLINK || *kind == REFERENCE_COPY) &&
+        distance > 0 && distance <= (uint64_t)header->offset;
+}
+
+// returns true if the reference droplet whose header is header refers
+// to a droplet of a file with the same length, or, for a hardlink, to a
+// copy reference to one
+bool reference_target_valid(int fd, struct droplet_header *header) {
+    char kind;
+    off_t target_offset;
+    struct stat stats;
+    if (!read_reference(fd, header, &kind, &target_offset) || fstat(fd, &stats) != 0) {
+        return false;
+    }
+    struct droplet_header target;
+    if (read_droplet_header(fd, target_offset, stats.st_size, &target) != SCAN_OK) {
+        return false;
+    }
+    bool valid = target.format != DROPLET_FMT_SOLID && target.format != DROPLET_FMT_CHUNK &&
+        target.mode[0] == '-' && target.content_length == header->content_length;
+    if (valid && target.format == DROPLET_FMT_REF) {
+        char target_kind;
+        valid = kind == REFERENCE_HARDLINK && read_reference(fd, &target, &target_kind, &target_offset) &&
+            target_kind == REFERENCE_COPY && reference_target_valid(fd, &target);
+    }
+    free(target.pathname);
+    return valid;
+}
@@ -0,0 +1,374 @@
+// This file provides repack mode, which rewrites every droplet of a drop
+// in another format without extracting anything to the file system
+//
+// droplets are decoded and re-encoded in memory by a pool of threads a
+// batch at a time, and written out in their original order.  Droplets
+// already in the new format, and solid blocks, are copied unchanged.
+// Reference and chunk map droplets are copied with their distances
+// changed to where the droplets they refer to now are, and chunks and
+// sparse files are copied unchanged.  Every droplet's hash is checked
+// first, whether it is copied or repacked.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+// droplets storing more than this are streamed by the main thread
+// instead of being repacked in memory
+#define REPACK_MEMORY_MAX (4 * 1024 * 1024)
+#define REPACK_BATCH_BYTES (64 * 1024 * 1024)
+#define REPACK_DROPLETS_PER_THREAD 4
+
+struct repack_job {
+    struct droplet_header *header;
+    bool copy;        // the droplet is copied unchanged
+    bool reference;   // the droplet is a reference, copied with a new distance
+    bool in_memory;   // the droplet is repacked by a worker
+    char *droplet;    // the repacked droplet, hash included
+    size_t droplet_length;
+    uint8_t format;   // the format the droplet was repacked into
+    int bad_byte;     // set if the new format could not store the contents
+};
+
+struct repack_batch {
+    int input_fd;
+    uint8_t format;
+    struct repack_job *jobs;
+};
+
+// solid blocks and chunks have no pathname of their own, so are named
+// by where they are
+static void bad_hash_error(struct droplet_header *header) {
+    if (header->format == DROPLET_FMT_SOLID || header->format == DROPLET_FMT_CHUNK) {
+        fprintf(stderr, "error: %s at byte %lld has an incorrect hash, not repacking\n",
+            header->format == DROPLET_FMT_SOLID ? "solid block" : "chunk", (long long)header->offset);
+    } else {
+        fprintf(stderr, "error: %s has an incorrect hash, not repacking\n", header->pathname);
+    }
+    exit(1);
+}
+
+// writes the header of a droplet in format, then re-encodes the contents
+// read from input_stream, which must be at the start of the old contents
+// returns the number of bytes written, or -1 if the contents can not be
+// stored in format
+static int64_t write_repacked_droplet(FILE *input_stream, struct droplet_header *header,
+    uint8_t format, FILE *output_stream, int *bad_byte) {
+    fputc(header->magic, output_stream);
+    fputc(format, output_stream);
+    fwrite(header->mode, 1, DROP_LENGTH_MODE, output_stream);
+    write_little_endian(output_stream, header->pathname_length, DROP_LENGTH_PATHNLEN);
+    fwrite(header->pathname, 1, header->pathname_length, output_stream);
+    write_little_endian(output_stream, header->content_length, DROP_LENGTH_CONTLEN);
+
+    FILE *content_stream = open_droplet_content(input_stream, header->format, header->content_length);
+    if (content_stream == NULL) {
+        fprintf(stderr, "error: droplet contents of %s are corrupt\n", header->pathname);
+        exit(1);
+    }
+    int64_t stored_length = write_droplet_content(content_stream, output_stream, format,
+        header->content_length, bad_byte);
+    fclose(content_stream);
+    if (stored_length < 0 && *bad_byte < 0) {
+        fprintf(stderr, "error: droplet contents of %s are corrupt\n", header->pathname);
+        exit(1);
+    } else if (stored_length < 0) {
+        return -1;
+    }
+    return DROP_LENGTH_MAGIC + DROP_LENGTH_FORMAT + DROP_LENGTH_MODE + DROP_LENGTH_PATHNLEN +
+        header->pathname_length + DROP_LENGTH_CONTLEN + stored_length;
+}
+
+// re-encodes one droplet into job->droplet
+static void repack_droplet_in_memory(struct repack_job *job, const uint8_t *droplet, uint8_t format) {
+    struct droplet_header *header = job->header;
+    size_t content_start = header->content_offset - header->offset;
+
+    // there is nothing to read when there are no contents
+    FILE *input_stream = NULL;
+    if (header->stored_length > 0) {
+        input_stream = fmemopen((void *)(droplet + content_start), header->stored_length, "rb");
+    }
+    FILE *output_stream = open_memstream(&job->droplet, &job->droplet_length);
+    bool stored = write_repacked_droplet(input_stream, header, format, output_stream, &job->bad_byte) >= 0;
+    if (stored) {
+        fflush(output_stream);
+        fputc(droplet_hash_bytes(0, (uint8_t *)job->droplet, job->droplet_length), output_stream);
+    }
+    fclose(output_stream);
+    if (input_stream != NULL) {
+        fclose(input_stream);
+    }
+    if (!stored) {
+        free(job->droplet);
+        job->droplet = NULL;
+        return;
+    }
+    job->format = format;
+}
+
+// checks the hash of a droplet to be copied unchanged, as those repacked
+// are checked, hashing a huge one in chunks
+static void verify_copied_droplet(int input_fd, struct droplet_header *header) {
+    uint8_t stored_hash;
+    if (pread(input_fd, &stored_hash, DROP_LENGTH_HASH, header->offset + header->length - DROP_LENGTH_HASH) !=
+        DROP_LENGTH_HASH) {
+        perror("partially created droplet/EOF found");
+        exit(1);
+    }
+    if (droplet_hash_range(input_fd, header->offset, header->length - DROP_LENGTH_HASH) != stored_hash) {
+        bad_hash_error(header);
+    }
+}
+
+static void repack_worker(void *context, size_t item) {
+    struct repack_batch *batch = context;
+    struct repack_job *job = &batch->jobs[item];
+    if (job->copy) {
+        verify_copied_droplet(batch->input_fd, job->header);
+        return;
+    }
+    if (!job->in_memory) {
+        return;
+    }
+
+    struct droplet_header *header = job->header;
+    uint8_t *droplet = malloc(header->length);
+    if (pread(batch->input_fd, droplet, header->length, header->offset) != (ssize_t)header->length) {
+        perror("partially created droplet/EOF found");
+        exit(1);
+    }
+    if (droplet_hash_bytes(0, droplet, header->length - DROP_LENGTH_HASH) != droplet[header->length - DROP_LENGTH_HASH]) {
+        bad_hash_error(header);
+    }
+
+    job->droplet = NULL;
+    repack_droplet_in_memory(job, droplet, batch->format);
+    if (job->droplet == NULL) {
+        repack_droplet_in_memory(job, droplet, DROPLET_FMT_8);
+    }
+    free(droplet);
+}
+
+// re-encodes a droplet too big to hold in memory straight into
+// output_stream, which must be positioned at its end
+static void repack_droplet_streaming(FILE *input_stream, struct repack_job *job,
+    uint8_t format, FILE *output_stream) {
+    struct droplet_header *header = job->header;
+    fseek(input_stream, header->offset, SEEK_SET);
+    if (calculate_hash(header->length - DROP_LENGTH_HASH, input_stream) != fgetc(input_stream)) {
+        bad_hash_error(header);
+    }
+
+    long start = ftell(output_stream);
+    fseek(input_stream, header->content_offset, SEEK_SET);
+    int64_t droplet_length = write_repacked_droplet(input_stream, header, format, output_stream, &job->bad_byte);
+    job->format = format;
+    if (droplet_length < 0) {
+        // throw away what was written and fall back to 8-bit
+        fflush(output_stream);
+        if (ftruncate(fileno(output_stream), start) != 0) {
+            perror("ftruncate");
+            exit(1);
+        }
+        fseek(output_stream, start, SEEK_SET);
+        fseek(input_stream, header->content_offset, SEEK_SET);
+        droplet_length = write_repacked_droplet(input_stream, header, DROPLET_FMT_8, output_stream, &job->bad_byte);
+        job->format = DROPLET_FMT_8;
+    }
+
+    // go back to the start and hash what was written
+    fflush(output_stream);
+    fseek(output_stream, start, SEEK_SET);
+    uint8_t hash = calculate_hash(droplet_length, output_stream);
+    fseek(output_stream, 0, SEEK_END);
+    fputc(hash, output_stream);
+}
+
+// returns the index of the droplet at offset among the first n_headers
+// of headers, which are in droplet order, or n_headers if there is none
+size_t find_droplet(struct droplet_header *headers, size_t n_headers, off_t offset) {
+    size_t low = 0, high = n_headers;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (headers[middle].offset < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < n_headers && headers[low].offset == offset ? low : n_headers;
+}
+
+// appends a reference or 'm' droplet referring to where the droplets it
+// refers to now are
+// headers are every droplet of the drop, new_offsets where each of those
+// it refers to, and this one, were written
+void copy_rebased_droplet(int input_fd, struct droplet_header *headers, off_t *new_offsets,
+    struct droplet_header *header, FILE *output_stream) {
+    uint8_t *droplet = malloc(header->length);
+    if (pread(input_fd, droplet, header->length, header->offset) != (ssize_t)header->length) {
+        perror("partially created droplet/EOF found");
+        exit(1);
+    }
+    if (droplet_hash_bytes(0, droplet, header->length - DROP_LENGTH_HASH) != droplet[header->length - DROP_LENGTH_HASH]) {
+        bad_hash_error(header);
+    }
+
+    size_t n_before = header - headers;
+    if (header->format == DROPLET_FMT_CHUNK_MAP) {
+        for (uint64_t i = 0; i < chunk_map_count(header); i++) {
+            size_t chunk = find_droplet(headers, n_before, chunk_map_offset(droplet, header, i));
+            if (chunk == n_before) {
+                fprintf(stderr, "error: %s has incorrect chunks, not repacking\n", header->pathname);
+                exit(1);
+            }
+            chunk_map_set_offset(droplet, header, i, new_offsets[n_before], new_offsets[chunk]);
+        }
+        droplet[header->length - DROP_LENGTH_HASH] = droplet_hash_bytes(0, droplet, header->length - DROP_LENGTH_HASH);
+        fwrite(droplet, 1, header->length, output_stream);
+        free(droplet);
+        return;
+    }
+
+    char kind;
+    off_t target_offset;
+    size_t target = n_before;
+    if (read_reference(input_fd, header, &kind, &target_offset)) {
+        target = find_droplet(headers, n_before, target_offset);
+    }
+    if (target == n_before) {
+        fprintf(stderr, "error: %s has an incorrect reference, not repacking\n", header->pathname);
+        exit(1);
+    }
+    uint8_t *rebased = rebase_reference_droplet(droplet, header, new_offsets[n_before] - new_offsets[target]);
+    fwrite(rebased, 1, header->length, output_stream);
+    free(rebased);
+    free(droplet);
+}
+
+// appends the droplet unchanged, copying inside the kernel if possible
+static void copy_droplet(int input_fd, struct droplet_header *header, FILE *output_stream) {
+    fflush(output_stream);
+    off_t output_offset = ftell(output_stream);
+    if (!copy_file_bytes(input_fd, header->offset, fileno(output_stream), output_offset, header->length)) {
+        perror("copy_file_range");
+        exit(1);
+    }
+    fseek(output_stream, output_offset + header->length, SEEK_SET);
+}
+
+static void print_repacked(struct repack_job *job, uint8_t format) {
+    struct droplet_header *header = job->header;
+    char *pathname = header->format == DROPLET_FMT_SOLID ? "solid block" : header->pathname;
+    if (header->format == DROPLET_FMT_CHUNK) {
+        return;
+    }
+    if (job->copy || job->reference) {
+        printf("Copying: %s\n", pathname);
+        return;
+    }
+    if (job->format != format) {
+        fprintf(stderr, "warning: byte 0x%02x in %s can not be stored in '%c' format, using '8'\n",
+            job->bad_byte, pathname, format);
+    }
+    printf("Repacking: %s\n", pathname);
+}
+
+// rewrites the drop drop_pathname as new_drop_pathname with every
+// droplet in droplet_format
+// droplets which can not be stored in droplet_format are kept as 8-bit
+void repack_drop(char *drop_pathname, char *new_drop_pathname, int droplet_format) {
+    FILE *input_stream = fopen(drop_pathname, "rb");
+    if (input_stream == NULL) {
+        perror(drop_pathname);
+        exit(1);
+    }
+    int input_fd = fileno(input_stream);
+
+    // opening the new drop would truncate the old one if they are the same file
+    struct stat input_stats, output_stats;
+    if (fstat(input_fd, &input_stats) == 0 && stat(new_drop_pathname, &output_stats) == 0 &&
+        input_stats.st_dev == output_stats.st_dev && input_stats.st_ino == output_stats.st_ino) {
+        fprintf(stderr, "error: %s can not be repacked into itself\n", drop_pathname);
+        exit(1);
+    }
+
+    size_t n_droplets;
+    struct droplet_header *headers = scan_drop(input_fd, &n_droplets);
+    off_t *new_offsets = malloc(n_droplets * sizeof *new_offsets);
+
+    FILE *output_stream = fopen(new_drop_pathname, "wb+");
+    if (output_stream == NULL) {
+        perror(new_drop_pathname);
+        exit(1);
+    }
+    // checksums and the watermark of an old drop of the same name no
+    // longer apply
+    remove_checksums(new_drop_pathname);
+    remove_watermark(new_drop_pathname);
+
+    size_t batch_droplets = rain_thread_count() * REPACK_DROPLETS_PER_THREAD;
+    struct repack_batch batch = {
+        .input_fd = input_fd,
+        .format = droplet_format,
+        .jobs = malloc(batch_droplets * sizeof (struct repack_job)),
+    };
+
+    size_t done = 0;
+    while (done < n_droplets) {
+        // gather droplets until the batch is full
+        size_t n = 0;
+        uint64_t batch_bytes = 0;
+        while (done + n < n_droplets && n < batch_droplets && batch_bytes < REPACK_BATCH_BYTES) {
+            struct droplet_header *header = &headers[done + n];
+            struct repack_job *job = &batch.jobs[n++];
+            job->header = header;
+            job->reference = header->format == DROPLET_FMT_REF || header->format == DROPLET_FMT_CHUNK_MAP;
+            job->copy = !job->reference && (header->format == droplet_format ||
+                header->format == DROPLET_FMT_SOLID || header->format == DROPLET_FMT_CHUNK ||
+                header->format == DROPLET_FMT_SPARSE);
+            job->in_memory = !job->copy && !job->reference && header->stored_length <= REPACK_MEMORY_MAX;
+            job->format = droplet_format;
+            if (job->in_memory) {
+                batch_bytes += header->length;
+            }
+        }
+
+        parallel_for(n, repack_worker, &batch);
+
+        for (size_t i = 0; i < n; i++) {
+            struct repack_job *job = &batch.jobs[i];
+            new_offsets[done + i] = ftell(output_stream);
+            if (job->reference) {
+                copy_rebased_droplet(input_fd, headers, new_offsets, job->header, output_stream);
+            } else if (job->copy) {
+                copy_droplet(input_fd, job->header, output_stream);
+            } else if (job->in_memory) {
+                fwrite(job->droplet, 1, job->droplet_length, output_stream);
+                free(job->droplet);
+            } else {
+                repack_droplet_streaming(input_stream, job, droplet_format, output_stream);
+            }
+            print_repacked(job, droplet_format);
+        }
+        done += n;
+    }
+
+    free(batch.jobs);
+    free(new_offsets);
+    free_droplet_headers(headers, n_droplets);
+    fclose(input_stream);
+    if (fclose(output_stream) != 0) {
+        perror(new_drop_pathname);
+        exit(1);
+    }
+}
@@ -0,0 +1,283 @@
+// This file provides salvage mode, which finds every intact droplet of
+// a damaged or truncated drop
+//
+// Droplets are followed from the start of the drop as usual while their
+// hashes are correct.  Past damage the drop is searched for the next
+// place a droplet could start: a magic byte followed by a valid format
+// byte, found sixteen positions at a time with SSE2, then a plausible
+// mode.  A candidate is only believed if its header fits in the drop
+// and its droplet hash is correct, then droplets are followed from it
+// again.  A droplet of a drop archived inside the damaged droplet can
+// look intact too, there is no telling them apart.
+//
+// Salvage reports the damaged byte ranges and the good prefix of the
+// drop, which append can carry on from once the drop is truncated to
+// it, and copies the intact droplets to a new drop if one is given.
+// Reference and chunk map droplets are copied referring to where the
+// droplets they refer to were copied, and left out if any was not.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "rain.h"
+
+#define SALVAGE_LANES 16
+
+struct salvage {
+    const uint8_t *bytes;
+    off_t size;
+    int fd;
+    int output_fd;               /**< -1 unless copying to a new drop. */
+    off_t output_offset;
+    size_t n_intact;
+    uint64_t n_damaged_bytes;
+    off_t *old_offsets;          /**< Where each droplet copied was. */
+    off_t *new_offsets;          /**< Where it was copied to. */
+    size_t n_copied;
+    size_t copied_capacity;
+};
+
+// returns the offset of the next position from offset holding the magic
+// byte then a valid format byte, or size if there is none
+static off_t next_candidate(const uint8_t *bytes, off_t offset, off_t size) {
+#if defined(__SSE2__)
+    const __m128i magic = _mm_set1_epi8((char)DROPLET_MAGIC);
+    const __m128i format_6 = _mm_set1_epi8((char)DROPLET_FMT_6);
+    const __m128i format_7 = _mm_set1_epi8((char)DROPLET_FMT_7);
+    const __m128i format_8 = _mm_set1_epi8((char)DROPLET_FMT_8);
+    const __m128i format_lz = _mm_set1_epi8((char)DROPLET_FMT_LZ);
+    const __m128i format_solid = _mm_set1_epi8((char)DROPLET_FMT_SOLID);
+    const __m128i format_ref = _mm_set1_epi8((char)DROPLET_FMT_REF);
+    const __m128i format_chunk = _mm_set1_epi8((char)DROPLET_FMT_CHUNK);
+    const __m128i format_chunk_map = _mm_set1_epi8((char)DROPLET_FMT_CHUNK_MAP);
+    const __m128i format_sparse = _mm_set1_epi8((char)DROPLET_FMT_SPARSE);
+    // the format byte of the last lane is one past the block
+    while (offset + SALVAGE_LANES + 1 <= size) {
+        __m128i first = _mm_loadu_si128((const __m128i *)(bytes + offset));
+        __m128i second = _mm_loadu_si128((const __m128i *)(bytes + offset + 1));
+        __m128i formats = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(second, format_6), _mm_cmpeq_epi8(second, format_7)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(second, format_8), _mm_cmpeq_epi8(second, format_lz)),
+                _mm_or_si128(_mm_cmpeq_epi8(second, format_solid), _mm_cmpeq_epi8(second, format_ref))));
+        formats = _mm_or_si128(formats,
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(second, format_chunk),
+                _mm_cmpeq_epi8(second, format_chunk_map)), _mm_cmpeq_epi8(second, format_sparse)));
+        int matches = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, magic), formats));
+        if (matches != 0) {
+            return offset + __builtin_ctz(matches);
+        }
+        offset += SALVAGE_LANES;
+    }
+#endif
+    for (; offset + 1 < size; offset++) {
+        if (bytes[offset] == DROPLET_MAGIC && droplet_format_valid(bytes[offset + 1])) {
+            return offset;
+        }
+    }
+    return size;
+}
+
+// rain only writes a type of '-' or 'd' then rwx permissions
+static bool mode_plausible(const uint8_t *mode) {
+    static const char permissions[] = "rwxrwxrwx";
+    if (mode[0] != '-' && mode[0] != 'd') {
+        return false;
+    }
+    for (int i = 1; i < DROP_LENGTH_MODE; i++) {
+        if (mode[i] != '-' && mode[i] != permissions[i - 1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// returns true if a whole droplet with a correct hash starts at offset
+static bool droplet_intact(struct salvage *salvage, off_t offset, struct droplet_header *header) {
+    if (offset + DROP_OFFSET_PATHNLEN > salvage->size ||
+        !mode_plausible(salvage->bytes + offset + DROP_OFFSET_MODE)) {
+        return false;
+    }
+    if (read_droplet_header(salvage->fd, offset, salvage->size, header) != SCAN_OK) {
+        return false;
+    }
+    uint8_t hash = droplet_hash_bytes(0, salvage->bytes + offset, header->length - DROP_LENGTH_HASH);
+    if (hash != salvage->bytes[offset + header->length - DROP_LENGTH_HASH]) {
+        free(header->pathname);
+        return false;
+    }
+    return true;
+}
+
+// returns the index among the droplets copied of the one which was at
+// offset, or n_copied if it was not copied
+static size_t find_copied(struct salvage *salvage, off_t offset) {
+    size_t low = 0, high = salvage->n_copied;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (salvage->old_offsets[middle] < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < salvage->n_copied && salvage->old_offsets[low] == offset ? low : salvage->n_copied;
+}
+
+// copies a reference or 'm' droplet to the new drop, referring to where
+// the droplets it refers to were copied
+// returns false if any of them was not copied
+static bool copy_reference(struct salvage *salvage, struct droplet_header *header) {
+    uint8_t *droplet;
+    if (header->format == DROPLET_FMT_CHUNK_MAP) {
+        droplet = malloc(header->length);
+        memcpy(droplet, salvage->bytes + header->offset, header->length);
+        for (uint64_t i = 0; i < chunk_map_count(header); i++) {
+            size_t chunk = find_copied(salvage, chunk_map_offset(droplet, header, i));
+            if (chunk == salvage->n_copied) {
+                free(droplet);
+                return false;
+            }
+            chunk_map_set_offset(droplet, header, i, salvage->output_offset, salvage->new_offsets[chunk]);
+        }
+        droplet[header->length - DROP_LENGTH_HASH] = droplet_hash_bytes(0, droplet, header->length - DROP_LENGTH_HASH);
+    } else {
+        char kind;
+        off_t target_offset;
+        if (!read_reference(salvage->fd, header, &kind, &target_offset)) {
+            return false;
+        }
+        size_t target = find_copied(salvage, target_offset);
+        if (target == salvage->n_copied) {
+            return false;
+        }
+        droplet = rebase_reference_droplet(salvage->bytes + header->offset, header,
+            salvage->output_offset - salvage->new_offsets[target]);
+    }
+    if (pwrite(salvage->output_fd, droplet, header->length, salvage->output_offset) != (ssize_t)header->length) {
+        perror("pwrite");
+        exit(1);
+    }
+    free(droplet);
+    return true;
+}
+
+static void salvage_droplet(struct salvage *salvage, struct droplet_header *header) {
+    bool refers = header->format == DROPLET_FMT_REF || header->format == DROPLET_FMT_CHUNK_MAP;
+    if (salvage->output_fd >= 0 && refers && !copy_reference(salvage, header)) {
+        printf("%s refers to a droplet which was not salvaged, not copied\n", header->pathname);
+    } else if (salvage->output_fd >= 0) {
+        if (!refers && !copy_file_bytes(salvage->fd, header->offset,
+                salvage->output_fd, salvage->output_offset, header->length)) {
+            perror("copy_file_range");
+            exit(1);
+        }
+        if (salvage->n_copied == salvage->copied_capacity) {
+            salvage->copied_capacity = salvage->copied_capacity == 0 ? 256 : salvage->copied_capacity * 2;
+            salvage->old_offsets = realloc(salvage->old_offsets,
+                salvage->copied_capacity * sizeof *salvage->old_offsets);
+            salvage->new_offsets = realloc(salvage->new_offsets,
+                salvage->copied_capacity * sizeof *salvage->new_offsets);
+        }
+        salvage->old_offsets[salvage->n_copied] = header->offset;
+        salvage->new_offsets[salvage->n_copied++] = salvage->output_offset;
+        salvage->output_offset += header->length;
+    }
+    salvage->n_intact++;
+    free(header->pathname);
+}
+
+// prints the damaged bytes and intact droplets of drop_pathname, and
+// copies the intact droplets to new_drop_pathname unless it is NULL
+// exits with status 1 if the drop is damaged
+void salvage_drop(char *drop_pathname, char *new_drop_pathname) {
+    struct salvage salvage = { .output_fd = -1 };
+    salvage.fd = open(drop_pathname, O_RDONLY);
+    struct stat stats;
+    if (salvage.fd < 0 || fstat(salvage.fd, &stats) != 0) {
+        perror(drop_pathname);
+        exit(1);
+    }
+    salvage.size = stats.st_size;
+    if (salvage.size > 0) {
+        salvage.bytes = mmap(NULL, salvage.size, PROT_READ, MAP_PRIVATE, salvage.fd, 0);
+        if (salvage.bytes == MAP_FAILED) {
+            perror(drop_pathname);
+            exit(1);
+        }
+        madvise((void *)salvage.bytes, salvage.size, MADV_SEQUENTIAL);
+    }
+    if (new_drop_pathname != NULL) {
+        salvage.output_fd = open(new_drop_pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (salvage.output_fd < 0) {
+            perror(new_drop_pathname);
+            exit(1);
+        }
+        remove_checksums(new_drop_pathname);
+        remove_watermark(new_drop_pathname);
+    }
+
+    off_t good_prefix = -1;
+    size_t n_prefix_droplets = 0;
+    off_t offset = 0;
+    struct droplet_header header;
+    while (offset < salvage.size) {
+        if (droplet_intact(&salvage, offset, &header)) {
+            offset += header.length;
+            salvage_droplet(&salvage, &header);
+            continue;
+        }
+
+        if (good_prefix < 0) {
+            good_prefix = offset;
+            n_prefix_droplets = salvage.n_intact;
+        }
+        off_t damage_start = offset;
+        offset = next_candidate(salvage.bytes, offset + 1, salvage.size);
+        while (offset < salvage.size && !droplet_intact(&salvage, offset, &header)) {
+            offset = next_candidate(salvage.bytes, offset + 1, salvage.size);
+        }
+        salvage.n_damaged_bytes += offset - damage_start;
+        if (offset < salvage.size) {
+            printf("bytes %jd to %jd damaged, intact again from %s\n",
+                (intmax_t)damage_start, (intmax_t)offset, header.pathname);
+            offset += header.length;
+            salvage_droplet(&salvage, &header);
+        } else {
+            printf("bytes %jd to %jd damaged or truncated, no intact droplets after it\n",
+                (intmax_t)damage_start, (intmax_t)offset);
+        }
+    }
+
+    if (good_prefix < 0) {
+        printf("%zu droplets intact, no damage found\n", salvage.n_intact);
+    } else {
+        printf("%zu droplets intact, %" PRIu64 " bytes damaged\n", salvage.n_intact, salvage.n_damaged_bytes);
+        printf("good prefix: %jd bytes, %zu droplets\n", (intmax_t)good_prefix, n_prefix_droplets);
+    }
+
+    if (salvage.size > 0) {
+        munmap((void *)salvage.bytes, salvage.size);
+    }
+    close(salvage.fd);
+    free(salvage.old_offsets);
+    free(salvage.new_offsets);
+    if (salvage.output_fd >= 0 && close(salvage.output_fd) != 0) {
+        perror(new_drop_pathname);
+        exit(1);
+    }
+    if (good_prefix >= 0) {
+        exit(1);
+    }
+}
@@ -0,0 +1,203 @@
+// This file provides spot-checking of a random sample of a drop's droplets
+//
+// Headers are scanned without reading contents, a sample is chosen
+// from them with a seeded generator so a spot-check can be repeated,
+// then only the sampled droplets are read and hashed, on every thread.
+// Droplets are sampled uniformly, or in proportion to their length so
+// the sample says something about how many bytes are damaged.  From how
+// many sampled droplets are bad check estimates the corruption rate of
+// the whole drop, with a 95% confidence interval.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+#define SAMPLE_READ (1024 * 1024)
+
+// z for a two-sided 95% confidence interval
+#define SAMPLE_Z 1.959964
+
+#define SAMPLE_CONFIDENCE 0.95
+
+struct sample_job {
+    int fd;
+    struct drop_checksums *checksums;
+    struct droplet_header *headers;
+    size_t *chosen;
+    uint8_t *calculated_hashes;
+    uint8_t *stored_hashes;
+    int64_t *bad_offsets;
+};
+
+// splitmix64, so a seed picks the same droplets everywhere
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+// returns a random number in (0, 1)
+static double next_random_fraction(uint64_t *state) {
+    return ((next_random(state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+struct sample_key {
+    double key;
+    size_t droplet;
+};
+
+static int compare_keys(const void *a, const void *b) {
+    const struct sample_key *key_a = a;
+    const struct sample_key *key_b = b;
+    return key_a->key < key_b->key ? 1 : key_a->key > key_b->key ? -1 : 0;
+}
+
+static int compare_droplets(const void *a, const void *b) {
+    size_t droplet_a = *(const size_t *)a;
+    size_t droplet_b = *(const size_t *)b;
+    return droplet_a < droplet_b ? -1 : droplet_a > droplet_b;
+}
+
+// chooses n_samples of n_droplets droplets without replacement, each
+// with weight 1, or its length if by_size, and returns them in order
+// weighted sampling gives each droplet the key log(u) / weight and
+// takes those with the largest keys (Efraimidis and Spirakis)
+static size_t *choose_sample(struct droplet_header *headers, size_t n_droplets, size_t n_samples,
+    bool by_size, uint64_t seed) {
+    uint64_t state = seed;
+    struct sample_key *keys = malloc((n_droplets + 1) * sizeof *keys);
+    for (size_t i = 0; i < n_droplets; i++) {
+        double weight = by_size ? (double)headers[i].length : 1.0;
+        keys[i].key = log(next_random_fraction(&state)) / weight;
+        keys[i].droplet = i;
+    }
+    qsort(keys, n_droplets, sizeof *keys, compare_keys);
+
+    size_t *chosen = malloc((n_samples + 1) * sizeof *chosen);
+    for (size_t i = 0; i < n_samples; i++) {
+        chosen[i] = keys[i].droplet;
+    }
+    free(keys);
+    qsort(chosen, n_samples, sizeof *chosen, compare_droplets);
+    return chosen;
+}
+
+static void check_sampled_droplet(void *context, size_t item) {
+    struct sample_job *job = context;
+    struct droplet_header *header = &job->headers[job->chosen[item]];
+    uint8_t *bytes = malloc(header->length < SAMPLE_READ ? header->length : SAMPLE_READ);
+    uint8_t hash = 0;
+    for (uint64_t done = 0; done < header->length;) {
+        size_t n = header->length - done < SAMPLE_READ ? header->length - done : SAMPLE_READ;
+        if (pread(job->fd, bytes, n, header->offset + done) != (ssize_t)n) {
+            perror("partially created droplet/EOF found");
+            exit(1);
+        }
+        done += n;
+        if (done == header->length) {
+            job->stored_hashes[item] = bytes[n - 1];
+            n--;
+        }
+        hash = droplet_hash_bytes(hash, bytes, n);
+    }
+    job->calculated_hashes[item] = hash;
+    free(bytes);
+
+    struct droplet_checksum *checksum = find_checksum(job->checksums, header->offset);
+    job->bad_offsets[item] = checksum == NULL ? -1 :
+        verify_droplet_checksum_range(job->fd, job->checksums, checksum, header->length);
+}
+
+// prints the estimated fraction of droplets, or bytes, which are bad
+// with no bad droplets only an upper bound can be given, otherwise the
+// Wilson score interval is used
+static void print_estimate(size_t n_bad, size_t n_samples, size_t n_droplets, bool by_size) {
+    const char *unit = by_size ? "bytes" : "droplets";
+    if (n_samples == n_droplets) {
+        printf("%zu bad, every droplet was checked\n", n_bad);
+        return;
+    }
+    if (n_samples == 0) {
+        return;
+    }
+    double n = n_samples;
+    if (n_bad == 0) {
+        double upper = 1 - pow(1 - SAMPLE_CONFIDENCE, 1 / n);
+        printf("0 bad: at most %.3g%% of %s are bad (%.0f%% confidence)\n",
+            100 * upper, unit, 100 * SAMPLE_CONFIDENCE);
+        return;
+    }
+    double p = n_bad / n;
+    double z2 = SAMPLE_Z * SAMPLE_Z;
+    double centre = (p + z2 / (2 * n)) / (1 + z2 / n);
+    double spread = SAMPLE_Z * sqrt(p * (1 - p) / n + z2 / (4 * n * n)) / (1 + z2 / n);
+    double lower = centre - spread > 0 ? centre - spread : 0;
+    double upper = centre + spread < 1 ? centre + spread : 1;
+    printf("%zu bad: %.3g%% to %.3g%% of %s are bad (%.0f%% confidence)\n",
+        n_bad, 100 * lower, 100 * upper, unit, 100 * SAMPLE_CONFIDENCE);
+}
+
+// checks n_samples droplets of drop_pathname chosen at random from seed,
+// in proportion to their length if options has CHECK_SAMPLE_BY_SIZE
+// returns true if every droplet sampled is correct
+bool sample_drop(char *drop_pathname, int options, size_t n_samples, uint64_t seed) {
+    FILE *input_stream = fopen(drop_pathname, "rb");
+    if (input_stream == NULL) {
+        perror(drop_pathname);
+        exit(1);
+    }
+    int input_fd = fileno(input_stream);
+    size_t n_droplets;
+    struct droplet_header *headers = scan_drop(input_fd, &n_droplets);
+    if (n_samples > n_droplets) {
+        n_samples = n_droplets;
+    }
+    bool by_size = options & CHECK_SAMPLE_BY_SIZE;
+
+    struct sample_job job = {
+        .fd = input_fd,
+        .checksums = load_checksums(drop_pathname),
+        .headers = headers,
+        .chosen = choose_sample(headers, n_droplets, n_samples, by_size, seed),
+        .calculated_hashes = malloc(n_samples + 1),
+        .stored_hashes = malloc(n_samples + 1),
+        .bad_offsets = malloc((n_samples + 1) * sizeof (int64_t)),
+    };
+    parallel_for(n_samples, check_sampled_droplet, &job);
+
+    size_t n_bad = 0;
+    for (size_t i = 0; i < n_samples; i++) {
+        struct droplet_header *header = &headers[job.chosen[i]];
+        int64_t bad_offset = job.bad_offsets[i] < 0 ? -1 : header->offset + job.bad_offsets[i];
+        if (!check_droplet_result(input_stream, header, job.calculated_hashes[i],
+                job.stored_hashes[i], bad_offset, stdout)) {
+            n_bad++;
+        }
+    }
+    printf("sampled %zu of %zu droplets %s, seed %" PRIu64 "\n", n_samples, n_droplets,
+        by_size ? "by size" : "uniformly", seed);
+    print_estimate(n_bad, n_samples, n_droplets, by_size);
+
+    free(job.chosen);
+    free(job.calculated_hashes);
+    free(job.stored_hashes);
+    free(job.bad_offsets);
+    free_checksums(job.checksums);
+    free_droplet_headers(headers, n_droplets);
+    if (fclose(input_stream) != 0) {
+        fprintf(stderr, "error: problem encounted with fclose\n");
+        exit(1);
+    }
+    return n_bad == 0;
+}
@@ -0,0 +1,223 @@
+// This file provides header-only scanning of drops: each droplet's
+// header is read with pread and its contents are skipped, so the
+// offset and size of every droplet is known without reading contents
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+// bytes read at once from the start of a droplet, enough for the whole
+// header of almost every droplet
+#define SCAN_WINDOW 4096
+#define SCAN_FIXED_BYTES 14
+#define SCAN_LZ_LENGTH_BYTES 6
+
+// returns true if format is a droplet format this rain understands
+bool droplet_format_valid(uint8_t format) {
+    return format == DROPLET_FMT_6 || format == DROPLET_FMT_7 || format == DROPLET_FMT_8 ||
+        format == DROPLET_FMT_LZ || format == DROPLET_FMT_SOLID || format == DROPLET_FMT_REF ||
+        format == DROPLET_FMT_CHUNK || format == DROPLET_FMT_CHUNK_MAP || format == DROPLET_FMT_SPARSE;
+}
+
+// returns the number of bytes of contents stored for a file of
+// content_length bytes in the 6, 7 and 8-bit formats, or by a reference
+uint64_t packed_content_length(uint8_t format, uint64_t content_length) {
+    if (format == DROPLET_FMT_REF) {
+        return REFERENCE_LENGTH;
+    } else if (format == DROPLET_FMT_6) {
+        return (content_length * 6 + 7) / 8;
+    } else if (format == DROPLET_FMT_7) {
+        return (content_length * 7 + 7) / 8;
+    }
+    return content_length;
+}
+
+// reads n bytes at offset, from window if they were already read
+static bool scan_read(int fd, uint8_t *window, ssize_t window_length, off_t window_offset,
+    uint8_t *bytes, size_t n, off_t offset) {
+    if (offset >= window_offset && offset + (off_t)n <= window_offset + window_length) {
+        memcpy(bytes, window + (offset - window_offset), n);
+        return true;
+    }
+    return pread(fd, bytes, n, offset) == (ssize_t)n;
+}
+
+// reads the header of the droplet starting at offset of the drop open
+// on fd, which is drop_size bytes long, and works out where it ends
+// header->pathname is malloc'd on SCAN_OK
+static enum scan_result read_header(int fd, off_t offset, off_t drop_size, struct droplet_header *header,
+    bool any_magic) {
+    if (offset >= drop_size) {
+        return SCAN_END;
+    }
+    memset(header, 0, sizeof *header);
+    header->offset = offset;
+
+    uint8_t window[SCAN_WINDOW];
+    ssize_t window_length = pread(fd, window, SCAN_WINDOW, offset);
+    if (window_length < 1) {
+        return SCAN_TRUNCATED;
+    }
+    header->magic = window[DROP_OFFSET_MAGIC];
+    if (header->magic != DROPLET_MAGIC && !any_magic) {
+        return SCAN_BAD_MAGIC;
+    }
+    if (window_length < SCAN_FIXED_BYTES) {
+        return SCAN_TRUNCATED;
+    }
+    header->format = window[DROP_OFFSET_FORMAT];
+    if (!droplet_format_valid(header->format)) {
+        return SCAN_BAD_FORMAT;
+    }
+    memcpy(header->mode, window + DROP_OFFSET_MODE, DROP_LENGTH_MODE);
+    header->mode[DROP_LENGTH_MODE] = '\0';
+    header->pathname_length = load_little_endian(window + DROP_OFFSET_PATHNLEN, DROP_LENGTH_PATHNLEN);
+
+    off_t position = offset + SCAN_FIXED_BYTES;
+    header->pathname = malloc(header->pathname_length + 1);
+    uint8_t length_bytes[DROP_LENGTH_CONTLEN];
+    if (!scan_read(fd, window, window_length, offset, (uint8_t *)header->pathname,
+            header->pathname_length, position) ||
+        !scan_read(fd, window, window_length, offset, length_bytes,
+            DROP_LENGTH_CONTLEN, position + header->pathname_length)) {
+        free(header->pathname);
+        return SCAN_TRUNCATED;
+    }
+    header->pathname[header->pathname_length] = '\0';
+    header->content_length = load_little_endian(length_bytes, DROP_LENGTH_CONTLEN);
+    header->content_offset = position + header->pathname_length + DROP_LENGTH_CONTLEN;
+
+    // 'z', 's', 'm' and 'p' droplets say how much they store at the start of their contents
+    header->stored_length = packed_content_length(header->format, header->content_length);
+    off_t lz_offset = -1;
+    if (header->format == DROPLET_FMT_LZ && header->content_length > 0) {
+        lz_offset = header->content_offset;
+    } else if (header->format == DROPLET_FMT_SOLID) {
+        uint8_t encoding;
+        if (!scan_read(fd, window, window_length, offset, &encoding, 1, header->content_offset)) {
+            free(header->pathname);
+            return SCAN_TRUNCATED;
+        }
+        header->stored_length = 1 + header->content_length;
+        if (encoding == DROPLET_FMT_LZ) {
+            lz_offset = header->content_offset + 1;
+        }
+    } else if (header->format == DROPLET_FMT_CHUNK_MAP) {
+        if (!scan_read(fd, window, window_length, offset, length_bytes,
+                CHUNK_COUNT_LENGTH, header->content_offset)) {
+            free(header->pathname);
+            return SCAN_TRUNCATED;
+        }
+        header->stored_length = CHUNK_COUNT_LENGTH +
+            load_little_endian(length_bytes, CHUNK_COUNT_LENGTH) * CHUNK_DISTANCE_LENGTH;
+    } else if (header->format == DROPLET_FMT_SPARSE) {
+        uint8_t fields[2 * SPARSE_FIELD_LENGTH];
+        if (!scan_read(fd, window, window_length, offset, fields, sizeof fields, header->content_offset)) {
+            free(header->pathname);
+            return SCAN_TRUNCATED;
+        }
+        header->stored_length = sparse_stored_length(load_little_endian(fields, SPARSE_FIELD_LENGTH),
+            load_little_endian(fields + SPARSE_FIELD_LENGTH, SPARSE_FIELD_LENGTH));
+    }
+    if (lz_offset >= 0) {
+        if (!scan_read(fd, window, window_length, offset, length_bytes,
+                SCAN_LZ_LENGTH_BYTES, lz_offset)) {
+            free(header->pathname);
+            return SCAN_TRUNCATED;
+        }
+        header->stored_length = (lz_offset - header->content_offset) + SCAN_LZ_LENGTH_BYTES +
+            load_little_endian(length_bytes, SCAN_LZ_LENGTH_BYTES);
+    }
+
+    header->length = (header->content_offset - offset) + header->stored_length + DROP_LENGTH_HASH;
+    if (header->stored_length > (uint64_t)drop_size ||
+        offset + (off_t)header->length > drop_size) {
+        free(header->pathname);
+        return SCAN_TRUNCATED;
+    }
+    return SCAN_OK;
+}
+
+enum scan_result read_droplet_header(int fd, off_t offset, off_t drop_size, struct droplet_header *header) {
+    return read_header(fd, offset, drop_size, header, false);
+}
+
+// as read_droplet_header, but a wrong magic byte is left for the
+// droplet hash to catch, as extract always has
+enum scan_result read_droplet_header_any_magic(int fd, off_t offset, off_t drop_size,
+    struct droplet_header *header) {
+    return read_header(fd, offset, drop_size, header, true);
+}
+
+// returns a description of what is wrong for a scan_result, for
+// reporting damage without stopping
+const char *scan_result_message(enum scan_result result) {
+    if (result == SCAN_BAD_MAGIC) {
+        return "incorrect first droplet byte";
+    } else if (result == SCAN_BAD_FORMAT) {
+        return "droplet format is wrong";
+    }
+    return "partially created droplet/EOF found";
+}
+
+// prints the error for a scan_result to error_stream the same way list,
+// check and extract report them
+void print_scan_error(FILE *error_stream, enum scan_result result, struct droplet_header *header) {
+    if (result == SCAN_BAD_MAGIC) {
+        fprintf(error_stream, "error: incorrect first droplet byte: 0x%02x should be 0x63\n", header->magic);
+    } else if (result == SCAN_BAD_FORMAT) {
+        fprintf(error_stream, "error: droplet format is wrong\n");
+    } else {
+        fprintf(error_stream, "partially created droplet/EOF found\n");
+    }
+}
+
+// prints the error for a scan_result, then exits
+void scan_error(enum scan_result result, struct droplet_header *header) {
+    print_scan_error(stderr, result, header);
+    exit(1);
+}
+
+// reads the header of every droplet in the drop open on fd
+// returns a malloc'd array of *n_droplets headers
+// exits if the drop is damaged
+struct droplet_header *scan_drop(int fd, size_t *n_droplets) {
+    off_t drop_size = settled_drop_size(fd);
+    if (drop_size < 0) {
+        perror("fstat");
+        exit(1);
+    }
+
+    size_t capacity = 64;
+    struct droplet_header *headers = malloc(capacity * sizeof *headers);
+    *n_droplets = 0;
+    off_t offset = 0;
+    enum scan_result result;
+    struct droplet_header header;
+    while ((result = read_droplet_header(fd, offset, drop_size, &header)) == SCAN_OK) {
+        if (*n_droplets == capacity) {
+            capacity *= 2;
+            headers = realloc(headers, capacity * sizeof *headers);
+        }
+        headers[(*n_droplets)++] = header;
+        offset += header.length;
+    }
+    if (result != SCAN_END) {
+        scan_error(result, &header);
+    }
+    return headers;
+}
+
+void free_droplet_headers(struct droplet_header *headers, size_t n_droplets) {
+    for (size_t i = 0; i < n_droplets; i++) {
+        free(headers[i].pathname);
+    }
+    free(headers);
+}
@@ -0,0 +1,339 @@
+// This file provides scrub mode, which checks every drop under a
+// directory slowly enough to leave the disks usable
+//
+// Drops are scrubbed one droplet at a time in order of pathname.  Reads
+// are limited to a number of MB/s, made at idle I/O priority where the
+// system supports it, and dropped from the page cache once hashed.  How
+// far the scrub has got is saved in <directory>/.rain-scrub so a scrub
+// which is stopped carries on from there when run again, and each bad
+// droplet found is added to <directory>/.rain-scrub.report as well as
+// being printed.  A scrub which reaches the end removes .rain-scrub, so
+// the next run starts a new pass.
+//
+// the progress file is one line of text:
+//     rain-scrub <drop-pathname> <offset>
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "rain.h"
+
+#define SCRUB_PROGRESS ".rain-scrub"
+#define SCRUB_REPORT ".rain-scrub.report"
+#define SCRUB_MAGIC "rain-scrub"
+#define SCRUB_SUFFIX ".drop"
+
+#define SCRUB_READ (1024 * 1024)
+
+// progress is saved at least this often
+#define SCRUB_SAVE_BYTES (64 * 1024 * 1024)
+
+// the I/O priority class which only gets the disk when nothing else wants it
+#define SCRUB_IOPRIO_WHO_PROCESS 1
+#define SCRUB_IOPRIO_CLASS_IDLE 3
+#define SCRUB_IOPRIO_CLASS_SHIFT 13
+
+struct scrub {
+    char *directory;
+    double bytes_per_second;     /**< 0 for no limit. */
+    struct timespec start;
+    uint64_t n_bytes_read;
+    uint64_t n_bytes_unsaved;
+    size_t n_bad;
+    char *progress_pathname;
+    FILE *report_stream;
+};
+
+struct drop_list {
+    size_t n_drops;
+    size_t capacity;
+    char **pathnames;            /**< Relative to the directory. */
+};
+
+static void set_idle_io_priority(void) {
+#if defined(SYS_ioprio_set)
+    // failing just means scrubbing at normal priority
+    syscall(SYS_ioprio_set, SCRUB_IOPRIO_WHO_PROCESS, 0,
+        SCRUB_IOPRIO_CLASS_IDLE << SCRUB_IOPRIO_CLASS_SHIFT);
+#endif
+}
+
+static char *join_pathname(const char *directory, const char *name) {
+    char *pathname = malloc(strlen(directory) + strlen(name) + 2);
+    sprintf(pathname, "%s/%s", directory, name);
+    return pathname;
+}
+
+// adds the drops under relative_pathname of the scrubbed directory
+static void find_drops(struct scrub *scrub, const char *relative_pathname, struct drop_list *drops) {
+    char *pathname = relative_pathname[0] ? join_pathname(scrub->directory, relative_pathname) :
+        strdup(scrub->directory);
+    DIR *directory = opendir(pathname);
+    if (directory == NULL) {
+        perror(pathname);
+        exit(1);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        // the progress and report files are hidden
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char *entry_pathname = join_pathname(pathname, entry->d_name);
+        char *entry_relative = relative_pathname[0] ? join_pathname(relative_pathname, entry->d_name) :
+            strdup(entry->d_name);
+        struct stat stats;
+        size_t name_length = strlen(entry->d_name);
+        if (lstat(entry_pathname, &stats) != 0) {
+            perror(entry_pathname);
+            exit(1);
+        }
+        if (S_ISDIR(stats.st_mode)) {
+            find_drops(scrub, entry_relative, drops);
+            free(entry_relative);
+        } else if (S_ISREG(stats.st_mode) && name_length > strlen(SCRUB_SUFFIX) &&
+            strcmp(entry->d_name + name_length - strlen(SCRUB_SUFFIX), SCRUB_SUFFIX) == 0) {
+            if (drops->n_drops == drops->capacity) {
+                drops->capacity = drops->capacity ? 2 * drops->capacity : 64;
+                drops->pathnames = realloc(drops->pathnames, drops->capacity * sizeof *drops->pathnames);
+            }
+            drops->pathnames[drops->n_drops++] = entry_relative;
+        } else {
+            free(entry_relative);
+        }
+        free(entry_pathname);
+    }
+    closedir(directory);
+    free(pathname);
+}
+
+static int compare_pathnames(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// sleeps for as long as reading n_bytes more would go over the limit
+static void scrub_throttle(struct scrub *scrub, uint64_t n_bytes) {
+    scrub->n_bytes_read += n_bytes;
+    scrub->n_bytes_unsaved += n_bytes;
+    if (scrub->bytes_per_second <= 0) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - scrub->start.tv_sec) + (now.tv_nsec - scrub->start.tv_nsec) / 1e9;
+    double wait = scrub->n_bytes_read / scrub->bytes_per_second - elapsed;
+    if (wait > 0) {
+        struct timespec duration = {
+            .tv_sec = (time_t)wait,
+            .tv_nsec = (long)((wait - (time_t)wait) * 1e9),
+        };
+        while (nanosleep(&duration, &duration) != 0 && errno == EINTR) {
+        }
+    }
+}
+
+// reads n bytes at offset within the rate limit, then lets the kernel
+// drop them from the page cache
+static void scrub_read(struct scrub *scrub, int fd, uint8_t *bytes, size_t n, off_t offset) {
+    scrub_throttle(scrub, n);
+    if (pread(fd, bytes, n, offset) != (ssize_t)n) {
+        perror("partially created droplet/EOF found");
+        exit(1);
+    }
+    posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+}
+
+static void save_progress(struct scrub *scrub, const char *drop_pathname, off_t offset) {
+    char *temp_pathname = malloc(strlen(scrub->progress_pathname) + sizeof "-XXXXXX");
+    sprintf(temp_pathname, "%s-XXXXXX", scrub->progress_pathname);
+    int temp_fd = mkstemp(temp_pathname);
+    FILE *output_stream = temp_fd < 0 ? NULL : fdopen(temp_fd, "w");
+    if (output_stream == NULL) {
+        perror(temp_pathname);
+        exit(1);
+    }
+    fprintf(output_stream, SCRUB_MAGIC " %s %jd\n", drop_pathname, (intmax_t)offset);
+    if (fclose(output_stream) != 0 || rename(temp_pathname, scrub->progress_pathname) != 0) {
+        perror(scrub->progress_pathname);
+        exit(1);
+    }
+    free(temp_pathname);
+    scrub->n_bytes_unsaved = 0;
+}
+
+// reads where an earlier scrub stopped
+// returns false if the last scrub finished
+static bool load_progress(struct scrub *scrub, char **drop_pathname, off_t *offset) {
+    FILE *input_stream = fopen(scrub->progress_pathname, "r");
+    if (input_stream == NULL) {
+        return false;
+    }
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length = getline(&line, &line_capacity, input_stream);
+    fclose(input_stream);
+    // pathnames may hold spaces, the offset is after the last one
+    char *space = line_length > 0 ? strrchr(line, ' ') : NULL;
+    if (space == NULL || strncmp(line, SCRUB_MAGIC " ", strlen(SCRUB_MAGIC " ")) != 0) {
+        fprintf(stderr, "error: %s is not a valid scrub progress file\n", scrub->progress_pathname);
+        exit(1);
+    }
+    *space = '\0';
+    *offset = strtoll(space + 1, NULL, 10);
+    *drop_pathname = strdup(line + strlen(SCRUB_MAGIC " "));
+    free(line);
+    return true;
+}
+
+// prints a bad droplet and adds it to the report
+static void report_bad(struct scrub *scrub, const char *drop_pathname, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void report_bad(struct scrub *scrub, const char *drop_pathname, const char *format, ...) {
+    char message[512];
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(message, sizeof message, format, arguments);
+    va_end(arguments);
+    printf("%s: %s\n", drop_pathname, message);
+    fflush(stdout);
+    fprintf(scrub->report_stream, "%s: %s\n", drop_pathname, message);
+    fflush(scrub->report_stream);
+    scrub->n_bad++;
+}
+
+// returns the droplet_hash of a droplet and sets stored_hash to its last byte
+static uint8_t scrub_droplet(struct scrub *scrub, int fd, struct droplet_header *header,
+    uint8_t *buffer, uint8_t *stored_hash) {
+    uint8_t hash = 0;
+    for (uint64_t done = 0; done < header->length;) {
+        size_t n = header->length - done < SCRUB_READ ? header->length - done : SCRUB_READ;
+        scrub_read(scrub, fd, buffer, n, header->offset + done);
+        done += n;
+        if (done == header->length) {
+            *stored_hash = buffer[n - 1];
+            n--;
+        }
+        hash = droplet_hash_bytes(hash, buffer, n);
+    }
+    return hash;
+}
+
+// scrubs one drop from offset, saving progress as it goes
+// returns the offset it got to
+static off_t scrub_drop(struct scrub *scrub, const char *relative_pathname, off_t offset) {
+    char *pathname = join_pathname(scrub->directory, relative_pathname);
+    int fd = open(pathname, O_RDONLY);
+    struct stat stats;
+    if (fd < 0 || fstat(fd, &stats) != 0) {
+        perror(pathname);
+        exit(1);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint8_t *buffer = malloc(SCRUB_READ);
+    struct droplet_header header;
+    enum scan_result result = read_droplet_header(fd, offset, stats.st_size, &header);
+    if (offset > 0 && result != SCAN_OK && result != SCAN_END) {
+        // the drop has been rewritten since, start it again
+        offset = 0;
+        result = read_droplet_header(fd, offset, stats.st_size, &header);
+    }
+    while (result == SCAN_OK) {
+        uint8_t stored_hash = 0;
+        uint8_t calculated_hash = scrub_droplet(scrub, fd, &header, buffer, &stored_hash);
+        if (calculated_hash != stored_hash) {
+            report_bad(scrub, relative_pathname, "%s at byte %jd - incorrect hash 0x%02x should be 0x%02x",
+                header.pathname, (intmax_t)offset, calculated_hash, stored_hash);
+        }
+        offset += header.length;
+        free(header.pathname);
+        if (scrub->n_bytes_unsaved >= SCRUB_SAVE_BYTES) {
+            save_progress(scrub, relative_pathname, offset);
+        }
+        result = read_droplet_header(fd, offset, stats.st_size, &header);
+    }
+    if (result != SCAN_END) {
+        report_bad(scrub, relative_pathname, "byte %jd - %s, rest of drop not scrubbed",
+            (intmax_t)offset, scan_result_message(result));
+    }
+
+    free(buffer);
+    close(fd);
+    free(pathname);
+    return offset;
+}
+
+// scrubs every drop under directory reading at most mb_per_second MB/s
+// (0 for no limit), carrying on from where an earlier scrub stopped
+// exits with status 1 if a bad droplet is found
+void scrub_directory(char *directory, double mb_per_second) {
+    struct scrub scrub = {
+        .directory = directory,
+        .bytes_per_second = mb_per_second * 1000 * 1000,
+        .progress_pathname = join_pathname(directory, SCRUB_PROGRESS),
+    };
+    clock_gettime(CLOCK_MONOTONIC, &scrub.start);
+    set_idle_io_priority();
+
+    struct drop_list drops = { 0 };
+    find_drops(&scrub, "", &drops);
+    qsort(drops.pathnames, drops.n_drops, sizeof *drops.pathnames, compare_pathnames);
+
+    // a new pass starts a new report
+    char *resume_pathname = NULL;
+    off_t resume_offset = 0;
+    bool resuming = load_progress(&scrub, &resume_pathname, &resume_offset);
+    char *report_pathname = join_pathname(directory, SCRUB_REPORT);
+    scrub.report_stream = fopen(report_pathname, resuming ? "a" : "w");
+    if (scrub.report_stream == NULL) {
+        perror(report_pathname);
+        exit(1);
+    }
+    if (resuming) {
+        printf("resuming scrub of %s from %s byte %jd\n", directory, resume_pathname, (intmax_t)resume_offset);
+    }
+
+    size_t n_scrubbed = 0;
+    for (size_t i = 0; i < drops.n_drops; i++) {
+        int order = resuming ? strcmp(drops.pathnames[i], resume_pathname) : 1;
+        if (order >= 0) {
+            off_t offset = scrub_drop(&scrub, drops.pathnames[i], order == 0 ? resume_offset : 0);
+            save_progress(&scrub, drops.pathnames[i], offset);
+            n_scrubbed++;
+        }
+        free(drops.pathnames[i]);
+    }
+    free(drops.pathnames);
+
+    // finished the pass
+    if (unlink(scrub.progress_pathname) != 0 && errno != ENOENT) {
+        perror(scrub.progress_pathname);
+        exit(1);
+    }
+    printf("scrubbed %zu drops, %" PRIu64 " bytes, %zu bad\n", n_scrubbed, scrub.n_bytes_read, scrub.n_bad);
+    if (fclose(scrub.report_stream) != 0) {
+        perror(report_pathname);
+        exit(1);
+    }
+    free(report_pathname);
+    free(resume_pathname);
+    free(scrub.progress_pathname);
+    if (scrub.n_bad > 0) {
+        exit(1);
+    }
+}
@@ -0,0 +1,389 @@
+// This file provides solid-block droplets (0x73, 's'), which pack many
+// small files into a single droplet
+//
+// 's' droplet contents:
+//
+//  - encoding:   1 byte, '8' if the payload is stored as-is or 'z' if it
+//                is stored as 'z' droplet contents (see rain_lz.c)
+//  - payload:    content_length bytes once decoded:
+//      - member count:  4 bytes, little-endian
+//      - directory:     per member; a 10 byte mode, a 2 byte pathname
+//                       length, the pathname and a 6 byte content length
+//      - contents:      every member's contents, back to back, in the
+//                       same order as the directory
+//
+// The droplet itself has an empty pathname and no permissions; list,
+// check and extract report the members instead.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+// regular files up to this size are packed into solid blocks
+#define SOLID_MEMBER_MAX (64 * 1024)
+// a solid block is written out once its payload reaches this size
+#define SOLID_BLOCK_SIZE (1024 * 1024)
+// larger payloads can only come from a corrupt header
+#define SOLID_PAYLOAD_MAX (16 * SOLID_BLOCK_SIZE)
+
+#define SOLID_ENCODING_BYTES 1
+#define SOLID_COUNT_BYTES 4
+#define SOLID_MODE_BYTES 10
+#define SOLID_PATHNLEN_BYTES 2
+#define SOLID_CONTLEN_BYTES 6
+#define SOLID_HEADER_BYTES 20
+
+struct solid_member {
+    char mode[SOLID_MODE_BYTES + 1];
+    char *pathname;
+    uint64_t content_length;
+    uint8_t *contents;
+};
+
+struct byte_buffer {
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+};
+
+// the solid block being filled by create_drop
+static struct byte_buffer pending_directory;
+static struct byte_buffer pending_contents;
+static uint32_t pending_members;
+static int pending_format;
+
+static uint8_t *buffer_reserve(struct byte_buffer *buffer, size_t n_bytes) {
+    if (buffer->length + n_bytes > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (capacity < buffer->length + n_bytes) {
+            capacity *= 2;
+        }
+        buffer->bytes = realloc(buffer->bytes, capacity);
+        if (buffer->bytes == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        buffer->capacity = capacity;
+    }
+    uint8_t *reserved = buffer->bytes + buffer->length;
+    buffer->length += n_bytes;
+    return reserved;
+}
+
+// returns true if a file with these stats should go into a solid block
+bool solid_eligible(struct stat *stats) {
+    return S_ISREG(stats->st_mode) && stats->st_size <= SOLID_MEMBER_MAX;
+}
+
+// writes the pending solid block as one droplet, if it has any members
+// returns amount of bytes so position can be recorded in the drop file
+long solid_flush(FILE *output_stream, long amount_of_bytes) {
+    if (pending_members == 0) {
+        return amount_of_bytes;
+    }
+
+    size_t payload_length = SOLID_COUNT_BYTES + pending_directory.length + pending_contents.length;
+    uint8_t *payload = malloc(payload_length);
+    store_little_endian(payload, pending_members, SOLID_COUNT_BYTES);
+    memcpy(payload + SOLID_COUNT_BYTES, pending_directory.bytes, pending_directory.length);
+    memcpy(payload + SOLID_COUNT_BYTES + pending_directory.length,
+        pending_contents.bytes, pending_contents.length);
+
+    fseek(output_stream, amount_of_bytes, SEEK_SET);
+    fputc(DROPLET_MAGIC, output_stream);
+    fputc(DROPLET_FMT_SOLID, output_stream);
+    for (int i = 0; i < DROP_LENGTH_MODE; i++) {
+        fputc('-', output_stream);
+    }
+    write_little_endian(output_stream, 0, DROP_LENGTH_PATHNLEN);
+    write_little_endian(output_stream, payload_length, DROP_LENGTH_CONTLEN);
+
+    uint64_t stored_length = SOLID_ENCODING_BYTES;
+    if (pending_format == DROPLET_FMT_LZ) {
+        fputc(DROPLET_FMT_LZ, output_stream);
+        FILE *payload_stream = fmemopen(payload, payload_length, "rb");
+        stored_length += write_lz_content(payload_stream, output_stream, payload_length);
+        fclose(payload_stream);
+    } else {
+        fputc(DROPLET_FMT_8, output_stream);
+        fwrite(payload, 1, payload_length, output_stream);
+        stored_length += payload_length;
+    }
+    free(payload);
+
+    // go back to the start and check the hashing now
+    fseek(output_stream, amount_of_bytes, SEEK_SET);
+    long droplet_length = DROP_LENGTH_MAGIC + DROP_LENGTH_FORMAT + DROP_LENGTH_MODE +
+        DROP_LENGTH_PATHNLEN + DROP_LENGTH_CONTLEN + stored_length + DROP_LENGTH_HASH;
+    fputc(calculate_hash(droplet_length - 1, output_stream), output_stream);
+
+    pending_directory.length = 0;
+    pending_contents.length = 0;
+    pending_members = 0;
+
+    return amount_of_bytes + droplet_length;
+}
+
+// adds a small file to the pending solid block, writing the block out
+// once it is big enough
+// returns amount of bytes so position can be recorded in the drop file
+long solid_add_file(FILE *output_stream, int format, char *pathname, struct stat *stats, long amount_of_bytes) {
+    FILE *input_stream = fopen(pathname, "rb");
+    if (input_stream == NULL) {
+        perror(pathname);
+        exit(1);
+    }
+    printf("Adding: %s\n", pathname);
+    pending_format = format;
+
+    size_t pathname_length = strlen(pathname);
+    uint8_t *entry = buffer_reserve(&pending_directory,
+        SOLID_MODE_BYTES + SOLID_PATHNLEN_BYTES + pathname_length + SOLID_CONTLEN_BYTES);
+    char *permissions = convert_permissions_to_array(stats->st_mode);
+    memcpy(entry, permissions, SOLID_MODE_BYTES);
+    free(permissions);
+    entry += SOLID_MODE_BYTES;
+    store_little_endian(entry, pathname_length, SOLID_PATHNLEN_BYTES);
+    entry += SOLID_PATHNLEN_BYTES;
+    memcpy(entry, pathname, pathname_length);
+    entry += pathname_length;
+    store_little_endian(entry, stats->st_size, SOLID_CONTLEN_BYTES);
+
+    uint8_t *contents = buffer_reserve(&pending_contents, stats->st_size);
+    if (fread(contents, 1, stats->st_size, input_stream) != (size_t)stats->st_size) {
+        fprintf(stderr, "error: file changed size while being added\n");
+        exit(1);
+    }
+    pending_members++;
+
+    if (fclose(input_stream) != 0) {
+        fprintf(stderr, "error: problem encounted with fclose\n");
+        exit(1);
+    }
+
+    if (SOLID_COUNT_BYTES + pending_directory.length + pending_contents.length >= SOLID_BLOCK_SIZE) {
+        amount_of_bytes = solid_flush(output_stream, amount_of_bytes);
+    }
+    return amount_of_bytes;
+}
+
+// returns how many bytes of contents the 's' droplet starting at the
+// current position of input_stream stores, leaving the position unchanged
+uint64_t solid_content_length(FILE *input_stream, uint64_t content_length) {
+    long position = ftell(input_stream);
+    int encoding = fgetc(input_stream);
+    uint64_t stored_length = SOLID_ENCODING_BYTES + content_length;
+    if (encoding == DROPLET_FMT_LZ) {
+        stored_length = SOLID_ENCODING_BYTES + lz_content_length(input_stream);
+    }
+    fseek(input_stream, position, SEEK_SET);
+    return stored_length;
+}
+
+// reads and decodes the payload of the 's' droplet at the current
+// position of input_stream
+// returns the malloc'd payload, or NULL if it could not be decoded
+static uint8_t *read_solid_payload(FILE *input_stream, uint64_t content_length) {
+    int encoding = fgetc(input_stream);
+    if (content_length > SOLID_PAYLOAD_MAX) {
+        return NULL;
+    }
+    uint8_t *payload = malloc(content_length > 0 ? content_length : 1);
+    if (encoding == DROPLET_FMT_8) {
+        if (fread(payload, 1, content_length, input_stream) == content_length) {
+            return payload;
+        }
+    } else if (encoding == DROPLET_FMT_LZ && content_length > 0) {
+        if (read_lz_content(input_stream, payload, content_length)) {
+            return payload;
+        }
+    }
+    free(payload);
+    return NULL;
+}
+
+static void free_solid_members(struct solid_member *members, long n_members) {
+    for (long i = 0; i < n_members; i++) {
+        free(members[i].pathname);
+    }
+    free(members);
+}
+
+// splits a decoded payload into its members
+// returns the number of members, or -1 if the directory is corrupt
+// members point into payload and are freed along with it
+static long parse_solid_payload(uint8_t *payload, uint64_t payload_length, struct solid_member **members) {
+    if (payload_length < SOLID_COUNT_BYTES) {
+        return -1;
+    }
+    uint32_t n_members = load_little_endian(payload, SOLID_COUNT_BYTES);
+    if (n_members > payload_length / SOLID_HEADER_BYTES) {
+        return -1;
+    }
+    *members = calloc(n_members + 1, sizeof **members);
+
+    uint64_t position = SOLID_COUNT_BYTES;
+    for (uint32_t i = 0; i < n_members; i++) {
+        struct solid_member *member = &(*members)[i];
+        if (payload_length - position < SOLID_HEADER_BYTES) {
+            free_solid_members(*members, i);
+            return -1;
+        }
+        memcpy(member->mode, payload + position, SOLID_MODE_BYTES);
+        member->mode[SOLID_MODE_BYTES] = '\0';
+        position += SOLID_MODE_BYTES;
+        uint16_t pathname_length = load_little_endian(payload + position, SOLID_PATHNLEN_BYTES);
+        position += SOLID_PATHNLEN_BYTES;
+        if (payload_length - position < (uint64_t)pathname_length + SOLID_CONTLEN_BYTES) {
+            free_solid_members(*members, i);
+            return -1;
+        }
+        // the pathname is copied so it can be null terminated
+        member->pathname = strndup((char *)payload + position, pathname_length);
+        position += pathname_length;
+        member->content_length = load_little_endian(payload + position, SOLID_CONTLEN_BYTES);
+        position += SOLID_CONTLEN_BYTES;
+    }
+
+    for (uint32_t i = 0; i < n_members; i++) {
+        struct solid_member *member = &(*members)[i];
+        if (payload_length - position < member->content_length) {
+            free_solid_members(*members, n_members);
+            return -1;
+        }
+        member->contents = payload + position;
+        position += member->content_length;
+    }
+    return n_members;
+}
+
+// prints the members of the 's' droplet whose contents start at the
+// current position of input_stream, which is left unchanged
+// a block which can not be decoded is reported on error_stream
+// returns false if the block is corrupt
+bool list_solid_block(FILE *input_stream, uint64_t content_length, int long_listing, FILE *output_stream,
+    FILE *error_stream) {
+    long position = ftell(input_stream);
+    uint8_t *payload = read_solid_payload(input_stream, content_length);
+    struct solid_member *members;
+    long n_members = payload ? parse_solid_payload(payload, content_length, &members) : -1;
+    if (n_members < 0) {
+        fprintf(error_stream, "error: solid block at byte %ld is corrupt\n", position);
+        free(payload);
+        fseek(input_stream, position, SEEK_SET);
+        return false;
+    }
+
+    for (long i = 0; i < n_members; i++) {
+        if (long_listing) {
+            fprintf(output_stream, "%s  %c  %5lu  %s\n", members[i].mode, DROPLET_FMT_SOLID,
+                members[i].content_length, members[i].pathname);
+        } else {
+            fprintf(output_stream, "%s\n", members[i].pathname);
+        }
+    }
+
+    free_solid_members(members, n_members);
+    free(payload);
+    fseek(input_stream, position, SEEK_SET);
+    return true;
+}
+
+// calls found with the mode, pathname and content length of each member
+// of the 's' droplet whose contents start at the current position of
+// input_stream, which is left unchanged
+// returns false if the block is corrupt
+bool each_solid_member(FILE *input_stream, uint64_t content_length,
+    void (*found)(void *context, char *mode, char *pathname, uint64_t content_length), void *context) {
+    long position = ftell(input_stream);
+    uint8_t *payload = read_solid_payload(input_stream, content_length);
+    struct solid_member *members;
+    long n_members = payload ? parse_solid_payload(payload, content_length, &members) : -1;
+    fseek(input_stream, position, SEEK_SET);
+    if (n_members < 0) {
+        free(payload);
+        return false;
+    }
+
+    for (long i = 0; i < n_members; i++) {
+        found(context, members[i].mode, members[i].pathname, members[i].content_length);
+    }
+    free_solid_members(members, n_members);
+    free(payload);
+    return true;
+}
+
+// prints "<member> - <result>" to output_stream for each member of the
+// 's' droplet whose contents start at content_offset, leaving
+// input_stream where it was
+// falls back to naming the droplet by its offset if it cannot be decoded
+void check_solid_block(FILE *input_stream, long content_offset, uint64_t content_length, char *result,
+    FILE *output_stream) {
+    long position = ftell(input_stream);
+    fseek(input_stream, content_offset, SEEK_SET);
+    uint8_t *payload = read_solid_payload(input_stream, content_length);
+    struct solid_member *members;
+    long n_members = payload ? parse_solid_payload(payload, content_length, &members) : -1;
+
+    if (n_members < 0) {
+        fprintf(output_stream, "solid block at byte %ld - %s\n", content_offset, result);
+    } else {
+        for (long i = 0; i < n_members; i++) {
+            fprintf(output_stream, "%s - %s\n", members[i].pathname, result);
+        }
+        free_solid_members(members, n_members);
+    }
+
+    free(payload);
+    fseek(input_stream, position, SEEK_SET);
+}
+
+// extracts every member of the 's' droplet whose contents start at the
+// current position of input_stream, leaving it after the hash byte
+// the whole block is read and its hash checked, hash being the hash of
+// the droplet's header, then it is written out file by file
+// the members extracted are printed on output_stream, and a block which
+// can not be decoded is reported on error_stream
+// returns false if the block is corrupt
+bool extract_solid_block(FILE *input_stream, uint64_t content_length, uint8_t hash, FILE *output_stream,
+    FILE *error_stream) {
+    uint64_t stored_length = solid_content_length(input_stream, content_length);
+    long content_offset = ftell(input_stream);
+    FILE *content_stream = open_hashing_stream(input_stream, stored_length, &hash);
+    uint8_t *payload = read_solid_payload(content_stream, content_length);
+    fclose(content_stream);
+
+    char name[64];
+    snprintf(name, sizeof name, "solid block at byte %ld", content_offset);
+    if (!droplet_hash_verified(name, hash, fgetc_with_EOF_checking(input_stream))) {
+        free(payload);
+        return true;
+    }
+
+    struct solid_member *members;
+    long n_members = payload ? parse_solid_payload(payload, content_length, &members) : -1;
+    if (n_members < 0) {
+        fprintf(error_stream, "error: %s is corrupt\n", name);
+        free(payload);
+        return false;
+    }
+
+    for (long i = 0; i < n_members; i++) {
+        fprintf(output_stream, "Extracting: %s\n", members[i].pathname);
+        char *temp_pathname;
+        FILE *output_stream = open_extract_file(members[i].pathname, &temp_pathname);
+        fwrite(members[i].contents, 1, members[i].content_length, output_stream);
+        finish_extract_file(output_stream, temp_pathname, members[i].pathname,
+            convert_permissions_array(members[i].mode), true);
+    }
+
+    free_solid_members(members, n_members);
+    free(payload);
+    return true;
+}
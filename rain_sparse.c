@@ -0,0 +1,227 @@
+// This file provides sparse droplets (0x70, 'p'), which store only the
+// parts of a file with data in them, so a file that is mostly holes
+// takes about its allocated size in the drop
+//
+// 'p' droplet contents:
+//
+//  - extent count:  6 bytes, little-endian
+//  - data length:   6 bytes, little-endian, the sum of the extent lengths
+//  - extents:       per extent, in order; a 6 byte offset in the file
+//                   and a 6 byte length
+//  - data:          every extent's bytes, back to back, stored as-is
+//
+// content_length is the length of the file, holes included.  Create
+// finds the extents with SEEK_DATA and SEEK_HOLE, for files whose
+// allocated size is less than their length.  Extract sets the length of
+// the file first and writes only the extents, so the holes stay holes.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+#define SPARSE_EXTENT_LENGTH (2 * SPARSE_FIELD_LENGTH)
+#define SPARSE_COPY (1024 * 1024)
+
+// returns true if the file stat gave may have holes, as it has fewer
+// blocks allocated than its length needs
+bool sparse_candidate(struct stat *stats) {
+    return S_ISREG(stats->st_mode) && (uint64_t)stats->st_blocks * 512 < (uint64_t)stats->st_size;
+}
+
+// returns the extents of data of the file at pathname, stat'd as stats,
+// or NULL if it has no holes; *n_extents and *data_length are set
+// the extents are malloc'd
+struct sparse_extent *sparse_extents(char *pathname, struct stat *stats, size_t *n_extents,
+    uint64_t *data_length) {
+    if (!sparse_candidate(stats)) {
+        return NULL;
+    }
+    int fd = open(pathname, O_RDONLY);
+    if (fd < 0) {
+        perror(pathname);
+        exit(1);
+    }
+
+    struct sparse_extent *extents = NULL;
+    size_t capacity = 0;
+    *n_extents = 0;
+    *data_length = 0;
+    off_t offset = 0;
+    while (offset < stats->st_size) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            break;
+        } else if (data < 0) {
+            // file systems which can not say where the holes are
+            free(extents);
+            close(fd);
+            return NULL;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > stats->st_size) {
+            hole = stats->st_size;
+        }
+        if (*n_extents == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            extents = realloc(extents, capacity * sizeof *extents);
+        }
+        extents[*n_extents].offset = data;
+        extents[*n_extents].length = hole - data;
+        (*n_extents)++;
+        *data_length += hole - data;
+        offset = hole;
+    }
+    close(fd);
+
+    if (*data_length == (uint64_t)stats->st_size) {
+        // the blocks it is short of are not holes after all
+        free(extents);
+        return NULL;
+    }
+    return extents;
+}
+
+// returns the bytes of contents of a 'p' droplet with these extents
+uint64_t sparse_stored_length(size_t n_extents, uint64_t data_length) {
+    return 2 * SPARSE_FIELD_LENGTH + n_extents * SPARSE_EXTENT_LENGTH + data_length;
+}
+
+// writes the contents of a 'p' droplet of the extents of the file at
+// pathname to output_stream
+// returns the number of bytes written, or -1 if the file could not be
+// read as planned, which has been reported
+int64_t write_sparse_content(char *pathname, struct sparse_extent *extents, size_t n_extents,
+    uint64_t data_length, FILE *output_stream) {
+    int fd = open(pathname, O_RDONLY);
+    if (fd < 0) {
+        perror(pathname);
+        return -1;
+    }
+    write_little_endian(output_stream, n_extents, SPARSE_FIELD_LENGTH);
+    write_little_endian(output_stream, data_length, SPARSE_FIELD_LENGTH);
+    for (size_t i = 0; i < n_extents; i++) {
+        write_little_endian(output_stream, extents[i].offset, SPARSE_FIELD_LENGTH);
+        write_little_endian(output_stream, extents[i].length, SPARSE_FIELD_LENGTH);
+    }
+
+    uint8_t *bytes = malloc(SPARSE_COPY);
+    bool copied = true;
+    for (size_t i = 0; copied && i < n_extents; i++) {
+        for (uint64_t done = 0; copied && done < extents[i].length;) {
+            size_t n = extents[i].length - done < SPARSE_COPY ? extents[i].length - done : SPARSE_COPY;
+            ssize_t length = pread(fd, bytes, n, extents[i].offset + done);
+            if (length <= 0) {
+                fprintf(stderr, "error: file changed size while being added\n");
+                copied = false;
+            } else if (fwrite(bytes, 1, length, output_stream) != (size_t)length) {
+                perror("fwrite");
+                copied = false;
+            }
+            done += copied ? length : 0;
+        }
+    }
+    free(bytes);
+    close(fd);
+    return copied ? (int64_t)sparse_stored_length(n_extents, data_length) : -1;
+}
+
+// reads the extent table of the 'p' droplet whose header is header, in
+// the drop open on fd
+// returns the malloc'd extents, or NULL if they do not fit in the file
+// one after another or do not add up to the data length
+struct sparse_extent *read_sparse_extents(int fd, struct droplet_header *header, size_t *n_extents) {
+    uint8_t fields[2 * SPARSE_FIELD_LENGTH];
+    if (pread(fd, fields, sizeof fields, header->content_offset) != sizeof fields) {
+        return NULL;
+    }
+    *n_extents = load_little_endian(fields, SPARSE_FIELD_LENGTH);
+    uint64_t data_length = load_little_endian(fields + SPARSE_FIELD_LENGTH, SPARSE_FIELD_LENGTH);
+    if (sparse_stored_length(*n_extents, data_length) != header->stored_length) {
+        return NULL;
+    }
+
+    size_t table_length = *n_extents * SPARSE_EXTENT_LENGTH;
+    uint8_t *table = malloc(table_length);
+    struct sparse_extent *extents = malloc(*n_extents * sizeof *extents + 1);
+    bool valid = pread(fd, table, table_length, header->content_offset + sizeof fields) == (ssize_t)table_length;
+    uint64_t end = 0, total = 0;
+    for (size_t i = 0; valid && i < *n_extents; i++) {
+        extents[i].offset = load_little_endian(table + i * SPARSE_EXTENT_LENGTH, SPARSE_FIELD_LENGTH);
+        extents[i].length = load_little_endian(table + i * SPARSE_EXTENT_LENGTH + SPARSE_FIELD_LENGTH,
+            SPARSE_FIELD_LENGTH);
+        valid = extents[i].offset >= end && extents[i].offset + extents[i].length <= header->content_length;
+        end = extents[i].offset + extents[i].length;
+        total += extents[i].length;
+    }
+    free(table);
+    if (!valid || total != data_length) {
+        free(extents);
+        return NULL;
+    }
+    return extents;
+}
+
+// returns true if the extent table of the 'p' droplet whose header is
+// header is consistent
+bool sparse_extents_valid(int fd, struct droplet_header *header) {
+    size_t n_extents;
+    struct sparse_extent *extents = read_sparse_extents(fd, header, &n_extents);
+    bool valid = extents != NULL;
+    free(extents);
+    return valid;
+}
+
+// writes the file of the 'p' droplet whose header is header, in the drop
+// open on fd, to output_fd, leaving holes where it had them, and carries
+// on *hash over the droplet's contents
+// returns false if the extent table is corrupt
+bool extract_sparse_file(int fd, struct droplet_header *header, int output_fd, uint8_t *hash) {
+    size_t n_extents;
+    struct sparse_extent *extents = read_sparse_extents(fd, header, &n_extents);
+    if (extents == NULL) {
+        return false;
+    }
+    if (ftruncate(output_fd, header->content_length) != 0) {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    // the fields and extent table are hashed, then each extent's data
+    size_t table_length = 2 * SPARSE_FIELD_LENGTH + n_extents * SPARSE_EXTENT_LENGTH;
+    uint8_t *bytes = malloc(table_length > SPARSE_COPY ? table_length : SPARSE_COPY);
+    if (pread(fd, bytes, table_length, header->content_offset) != (ssize_t)table_length) {
+        perror("partially created droplet/EOF found");
+        exit(1);
+    }
+    *hash = droplet_hash_bytes(*hash, bytes, table_length);
+    off_t input_offset = header->content_offset + table_length;
+    for (size_t i = 0; i < n_extents; i++) {
+        for (uint64_t done = 0; done < extents[i].length;) {
+            size_t n = extents[i].length - done < SPARSE_COPY ? extents[i].length - done : SPARSE_COPY;
+            if (pread(fd, bytes, n, input_offset) != (ssize_t)n) {
+                perror("partially created droplet/EOF found");
+                exit(1);
+            }
+            *hash = droplet_hash_bytes(*hash, bytes, n);
+            if (pwrite(output_fd, bytes, n, extents[i].offset + done) != (ssize_t)n) {
+                perror("pwrite");
+                exit(1);
+            }
+            input_offset += n;
+            done += n;
+        }
+    }
+    free(bytes);
+    free(extents);
+    return true;
+}
@@ -0,0 +1,96 @@
+// This file provides a small thread pool helper used to spread
+// independent pieces of work (blocks, droplets, archives) across cores
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "rain.h"
+
+#define MAX_THREADS 256
+
+// the threads a parallel_for called from work on this thread may use,
+// 0 outside any parallel_for
+static _Thread_local size_t thread_budget;
+
+struct parallel_job {
+    void (*work)(void *context, size_t item);
+    void *context;
+    size_t n_items;
+    size_t threads_each;     /**< thread_budget of each thread. */
+    atomic_size_t next_item;
+};
+
+// number of worker threads to use
+// defaults to the number of online cores, RAIN_THREADS overrides it
+int rain_thread_count(void) {
+    char *override = getenv("RAIN_THREADS");
+    if (override != NULL) {
+        int n_threads = atoi(override);
+        if (n_threads > 0) {
+            return n_threads < MAX_THREADS ? n_threads : MAX_THREADS;
+        }
+    }
+    long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cores < 1) {
+        return 1;
+    }
+    return n_cores < MAX_THREADS ? n_cores : MAX_THREADS;
+}
+
+// each thread keeps claiming the next unprocessed item until none are left
+static void *parallel_worker(void *argument) {
+    struct parallel_job *job = argument;
+    size_t outer_budget = thread_budget;
+    thread_budget = job->threads_each;
+    size_t item;
+    while ((item = atomic_fetch_add(&job->next_item, 1)) < job->n_items) {
+        job->work(job->context, item);
+    }
+    thread_budget = outer_budget;
+    return NULL;
+}
+
+// returns the number of threads work on this thread may use: all of them
+// outside any parallel_for, its share inside one
+size_t rain_thread_budget(void) {
+    return thread_budget > 0 ? thread_budget : (size_t)rain_thread_count();
+}
+
+// calls work(context, i) for every i in [0, n_items), spread over threads
+// returns once every item is done
+// the calling thread takes part, so a failed pthread_create only costs speed
+// a parallel_for called from work shares out the threads of its own
+// thread, so nesting them never starts more threads than there are cores
+void parallel_for(size_t n_items, void (*work)(void *context, size_t item), void *context) {
+    size_t available = rain_thread_budget();
+    size_t n_threads = available;
+    if (n_threads > n_items) {
+        n_threads = n_items;
+    }
+
+    struct parallel_job job = {
+        .work = work,
+        .context = context,
+        .n_items = n_items,
+        .threads_each = n_threads > 0 ? available / n_threads : available,
+    };
+    atomic_init(&job.next_item, 0);
+
+    pthread_t threads[MAX_THREADS];
+    size_t n_started = 0;
+    for (size_t i = 1; i < n_threads; i++) {
+        if (pthread_create(&threads[n_started], NULL, parallel_worker, &job) != 0) {
+            break;
+        }
+        n_started++;
+    }
+
+    parallel_worker(&job);
+
+    for (size_t i = 0; i < n_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
@@ -0,0 +1,278 @@
+// This file provides --update, which leaves out of an append the files
+// that have not changed since they were last added to the drop
+//
+// The latest droplet of each pathname is found with a header-only scan
+// of the drop; only solid blocks are read, for their members' headers.
+// The drop does not store modification times, so they are kept in
+// <drop>.times, to which a line is appended for every file added while
+// updating, or appending to a drop which already has one:
+//     <seconds> <nanoseconds> <length> <pathname-length> <pathname>
+// A file is unchanged if its latest droplet has the same mode and length
+// and its latest line the same modification time and length.  Lines are
+// appended with one write to a file opened O_APPEND, so appends running
+// alongside each other do not interleave them, and are only written once
+// the droplets they describe are in the drop.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+#define UPDATE_SUFFIX ".times"
+#define UPDATE_INITIAL 256
+
+struct update_file {
+    char *pathname;              /**< NULL where a slot is empty. */
+    uint64_t hash;
+    bool in_drop;                /**< Whether a droplet of it was found. */
+    char mode[11];               /**< Mode of its latest droplet. */
+    uint64_t content_length;     /**< Length of its latest droplet. */
+    bool timed;                  /**< Whether it has a line in the times file. */
+    struct timespec mtime;       /**< From its latest line. */
+    uint64_t timed_length;       /**< From its latest line. */
+};
+
+struct update_index {
+    struct update_file *files;
+    size_t capacity;             /**< Always a power of two. */
+    size_t n_files;
+    bool skip_unchanged;
+    char *lines;                 /**< Lines to append to the times file. */
+    size_t lines_length;
+    size_t lines_capacity;
+};
+
+static char *update_times_pathname(char *drop_pathname) {
+    char *pathname = malloc(strlen(drop_pathname) + sizeof UPDATE_SUFFIX);
+    strcpy(pathname, drop_pathname);
+    strcat(pathname, UPDATE_SUFFIX);
+    return pathname;
+}
+
+bool update_times_exist(char *drop_pathname) {
+    char *pathname = update_times_pathname(drop_pathname);
+    bool exists = access(pathname, F_OK) == 0;
+    free(pathname);
+    return exists;
+}
+
+void remove_update_times(char *drop_pathname) {
+    char *pathname = update_times_pathname(drop_pathname);
+    if (unlink(pathname) != 0 && errno != ENOENT) {
+        perror(pathname);
+        exit(1);
+    }
+    free(pathname);
+}
+
+static uint64_t hash_pathname(const char *pathname) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const unsigned char *byte = (const unsigned char *)pathname; *byte != '\0'; byte++) {
+        hash = (hash ^ *byte) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// returns the slot holding pathname, or the empty slot it would go in
+static size_t find_slot(struct update_file *files, size_t capacity, const char *pathname, uint64_t hash) {
+    size_t slot = hash & (capacity - 1);
+    while (files[slot].pathname != NULL &&
+        (files[slot].hash != hash || strcmp(files[slot].pathname, pathname) != 0)) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return slot;
+}
+
+// returns the entry of pathname, adding an empty one if there is none
+static struct update_file *update_file(struct update_index *index, const char *pathname) {
+    // kept at most half full so probes stay short
+    if (2 * (index->n_files + 1) > index->capacity) {
+        struct update_file *files = index->files;
+        size_t capacity = index->capacity;
+        index->capacity *= 2;
+        index->files = calloc(index->capacity, sizeof *index->files);
+        for (size_t i = 0; i < capacity; i++) {
+            if (files[i].pathname != NULL) {
+                index->files[find_slot(index->files, index->capacity, files[i].pathname, files[i].hash)] = files[i];
+            }
+        }
+        free(files);
+    }
+    uint64_t hash = hash_pathname(pathname);
+    struct update_file *file = &index->files[find_slot(index->files, index->capacity, pathname, hash)];
+    if (file->pathname == NULL) {
+        file->pathname = strdup(pathname);
+        file->hash = hash;
+        index->n_files++;
+    }
+    return file;
+}
+
+static void add_droplet(void *context, char *mode, char *pathname, uint64_t content_length) {
+    struct update_file *file = update_file(context, pathname);
+    file->in_drop = true;
+    memcpy(file->mode, mode, DROP_LENGTH_MODE);
+    file->content_length = content_length;
+}
+
+// adds the latest droplet of each pathname of the drop open on fd
+// a damaged drop is only read up to the damage
+static void add_drop_droplets(struct update_index *index, int fd) {
+    off_t drop_size = settled_drop_size(fd);
+    off_t offset = 0;
+    struct droplet_header header;
+    while (drop_size > 0 && read_droplet_header(fd, offset, drop_size, &header) == SCAN_OK) {
+        if (header.format == DROPLET_FMT_SOLID) {
+            FILE *input_stream = open_pread_stream(fd, header.content_offset, header.stored_length);
+            each_solid_member(input_stream, header.content_length, add_droplet, index);
+            fclose(input_stream);
+        } else if (header.format != DROPLET_FMT_CHUNK) {
+            add_droplet(index, header.mode, header.pathname, header.content_length);
+        }
+        offset += header.length;
+        free(header.pathname);
+    }
+}
+
+// adds the latest line of each pathname of the times file of
+// drop_pathname
+// a line cut short, by an append that did not finish, ends the file
+static void add_times(struct update_index *index, char *drop_pathname) {
+    char *pathname = update_times_pathname(drop_pathname);
+    FILE *input_stream = fopen(pathname, "r");
+    if (input_stream == NULL && errno != ENOENT) {
+        perror(pathname);
+        exit(1);
+    }
+    free(pathname);
+    if (input_stream == NULL) {
+        return;
+    }
+
+    int64_t seconds;
+    long nanoseconds;
+    uint64_t length;
+    size_t pathname_length;
+    // the pathname is read by length, as it may have spaces or newlines
+    while (fscanf(input_stream, "%" SCNd64 " %ld %" SCNu64 " %zu", &seconds, &nanoseconds, &length,
+        &pathname_length) == 4 && pathname_length <= UINT16_MAX && fgetc(input_stream) == ' ') {
+        char *file_pathname = malloc(pathname_length + 1);
+        if (fread(file_pathname, 1, pathname_length, input_stream) != pathname_length ||
+            fgetc(input_stream) != '\n') {
+            free(file_pathname);
+            break;
+        }
+        file_pathname[pathname_length] = '\0';
+        struct update_file *file = update_file(index, file_pathname);
+        file->timed = true;
+        file->mtime = (struct timespec){ .tv_sec = seconds, .tv_nsec = nanoseconds };
+        file->timed_length = length;
+        free(file_pathname);
+    }
+    fclose(input_stream);
+}
+
+// returns the index of the files of drop_pathname, open on fd
+// if skip_unchanged is false it only records the files added
+struct update_index *update_index_load(char *drop_pathname, int fd, bool skip_unchanged) {
+    struct update_index *index = calloc(1, sizeof *index);
+    index->capacity = UPDATE_INITIAL;
+    index->files = calloc(index->capacity, sizeof *index->files);
+    index->skip_unchanged = skip_unchanged;
+    if (skip_unchanged) {
+        add_drop_droplets(index, fd);
+        add_times(index, drop_pathname);
+    }
+    return index;
+}
+
+void update_index_free(struct update_index *index) {
+    for (size_t i = 0; i < index->capacity; i++) {
+        free(index->files[i].pathname);
+    }
+    free(index->files);
+    free(index->lines);
+    free(index);
+}
+
+// returns true if the file walked to as entry is as it was when its
+// latest droplet was added
+static bool unchanged(struct update_index *index, struct walk_entry *entry) {
+    size_t slot = find_slot(index->files, index->capacity, entry->pathname, hash_pathname(entry->pathname));
+    struct update_file *file = &index->files[slot];
+    if (file->pathname == NULL || !file->in_drop) {
+        return false;
+    }
+    char *permissions = convert_permissions_to_array(entry->stats.st_mode);
+    bool same_mode = memcmp(permissions, file->mode, DROP_LENGTH_MODE) == 0;
+    free(permissions);
+    if (!same_mode) {
+        return false;
+    } else if (S_ISDIR(entry->stats.st_mode)) {
+        return true;
+    }
+    return file->content_length == (uint64_t)entry->stats.st_size && file->timed &&
+        file->timed_length == (uint64_t)entry->stats.st_size &&
+        file->mtime.tv_sec == entry->stats.st_mtim.tv_sec && file->mtime.tv_nsec == entry->stats.st_mtim.tv_nsec;
+}
+
+// adds the line for the file walked to as entry to those to be written
+static void record_file(struct update_index *index, struct walk_entry *entry) {
+    size_t pathname_length = strlen(entry->pathname);
+    size_t line_length = 3 * 21 + 20 + pathname_length + 6;
+    if (index->lines_length + line_length > index->lines_capacity) {
+        index->lines_capacity = 2 * (index->lines_length + line_length);
+        index->lines = realloc(index->lines, index->lines_capacity);
+    }
+    index->lines_length += sprintf(index->lines + index->lines_length, "%" PRId64 " %ld %" PRIu64 " %zu %s\n",
+        (int64_t)entry->stats.st_mtim.tv_sec, (long)entry->stats.st_mtim.tv_nsec,
+        (uint64_t)entry->stats.st_size, pathname_length, entry->pathname);
+}
+
+// leaves out of the n_entries entries, in place, those which are
+// unchanged when updating, and records the regular files left
+// returns how many entries are left
+size_t update_filter(struct update_index *index, struct walk_entry *entries, size_t n_entries) {
+    size_t n_left = 0;
+    for (size_t i = 0; i < n_entries; i++) {
+        if (index->skip_unchanged && unchanged(index, &entries[i])) {
+            free(entries[i].pathname);
+            continue;
+        }
+        if (S_ISREG(entries[i].stats.st_mode)) {
+            record_file(index, &entries[i]);
+        }
+        entries[n_left++] = entries[i];
+    }
+    return n_left;
+}
+
+// appends the lines of the files recorded to the times file of
+// drop_pathname
+void update_index_save(struct update_index *index, char *drop_pathname) {
+    char *pathname = update_times_pathname(drop_pathname);
+    int fd = open(pathname, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) {
+        perror(pathname);
+        exit(1);
+    }
+    for (size_t done = 0; done < index->lines_length;) {
+        ssize_t length = write(fd, index->lines + done, index->lines_length - done);
+        if (length <= 0) {
+            perror(pathname);
+            exit(1);
+        }
+        done += length;
+    }
+    close(fd);
+    free(pathname);
+}
@@ -0,0 +1,218 @@
+// This file provides walking a tree of files on many threads
+//
+// Each directory found is a piece of work.  Every worker keeps its own
+// deque of directories: it lists the directory at the bottom of its own
+// deque, pushing the subdirectories it finds back on the bottom, and
+// when its deque is empty steals from the top of another worker's, so a
+// deep or lopsided tree keeps every worker busy.  Entries are stat'd
+// once each, with fstatat relative to their directory's fd, and child
+// pathnames are built with one allocation.
+//
+// Each directory's entries are kept in the order readdir gives them, so
+// flattening the tree afterwards gives exactly the order a recursive
+// walk from pathname takes, however the directories were shared out.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+struct walk_node {
+    char *pathname;
+    struct stat stats;
+    struct walk_node *children;  /**< In readdir order, once listed. */
+    size_t n_children;
+};
+
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_node **nodes;
+    size_t top;                  /**< Next directory to steal. */
+    size_t bottom;               /**< One past the owner's next directory. */
+    size_t capacity;
+};
+
+struct walk {
+    struct walk_deque *deques;
+    size_t n_deques;
+    atomic_size_t n_pending;     /**< Directories pushed but not yet listed. */
+};
+
+// the test for a directory create has always used
+static bool walk_is_directory(struct stat *stats) {
+    return stats->st_mode & S_IFDIR;
+}
+
+static void push_directory(struct walk *walk, struct walk_deque *deque, struct walk_node *node) {
+    atomic_fetch_add(&walk->n_pending, 1);
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity) {
+        deque->capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+        deque->nodes = realloc(deque->nodes, deque->capacity * sizeof *deque->nodes);
+    }
+    deque->nodes[deque->bottom++] = node;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// takes the newest directory of a worker's own deque
+static struct walk_node *pop_directory(struct walk_deque *deque) {
+    struct walk_node *node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        node = deque->nodes[--deque->bottom];
+    }
+    if (deque->bottom == deque->top) {
+        deque->top = deque->bottom = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+// takes the oldest directory of another worker's deque, which is the
+// nearest the root and so likely the most work
+static struct walk_node *steal_directory(struct walk_deque *deque) {
+    struct walk_node *node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        node = deque->nodes[deque->top++];
+    }
+    if (deque->bottom == deque->top) {
+        deque->top = deque->bottom = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+// lists one directory, stat'ing each entry, and pushes its
+// subdirectories onto deque
+static void list_directory(struct walk *walk, struct walk_deque *deque, struct walk_node *node) {
+    int dir_fd = open(node->pathname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = dir_fd < 0 ? NULL : fdopendir(dir_fd);
+    if (dir == NULL) {
+        perror(node->pathname);
+        exit(1);
+    }
+
+    size_t pathname_length = strlen(node->pathname);
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (node->n_children == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            node->children = realloc(node->children, capacity * sizeof *node->children);
+        }
+        struct walk_node *child = &node->children[node->n_children];
+        memset(child, 0, sizeof *child);
+
+        size_t name_length = strlen(entry->d_name);
+        child->pathname = malloc(pathname_length + 1 + name_length + 1);
+        memcpy(child->pathname, node->pathname, pathname_length);
+        child->pathname[pathname_length] = '/';
+        memcpy(child->pathname + pathname_length + 1, entry->d_name, name_length + 1);
+        if (fstatat(dir_fd, entry->d_name, &child->stats, 0) != 0) {
+            perror(child->pathname);
+            exit(1);
+        }
+        node->n_children++;
+    }
+    if (closedir(dir) == -1) {
+        perror("Failed to close directory");
+        exit(1);
+    }
+
+    // the children array is complete, so pointers into it stay put
+    for (size_t i = node->n_children; i > 0; i--) {
+        if (walk_is_directory(&node->children[i - 1].stats)) {
+            push_directory(walk, deque, &node->children[i - 1]);
+        }
+    }
+}
+
+static void walk_worker(void *context, size_t item) {
+    struct walk *walk = context;
+    struct walk_deque *own = &walk->deques[item];
+    while (atomic_load(&walk->n_pending) > 0) {
+        struct walk_node *node = pop_directory(own);
+        for (size_t i = 1; node == NULL && i < walk->n_deques; i++) {
+            node = steal_directory(&walk->deques[(item + i) % walk->n_deques]);
+        }
+        if (node == NULL) {
+            // directories are still being listed, and may yet have
+            // subdirectories to share
+            sched_yield();
+            continue;
+        }
+        list_directory(walk, own, node);
+        atomic_fetch_sub(&walk->n_pending, 1);
+    }
+}
+
+static void flatten(struct walk_node *node, struct walk_entry *entries, size_t *n_entries) {
+    entries[*n_entries].pathname = node->pathname;
+    entries[*n_entries].stats = node->stats;
+    (*n_entries)++;
+    for (size_t i = 0; i < node->n_children; i++) {
+        flatten(&node->children[i], entries, n_entries);
+    }
+    free(node->children);
+}
+
+static size_t count_nodes(struct walk_node *node) {
+    size_t n = 1;
+    for (size_t i = 0; i < node->n_children; i++) {
+        n += count_nodes(&node->children[i]);
+    }
+    return n;
+}
+
+// walks pathname and, if it is a directory, everything under it
+// returns a malloc'd array of *n_entries entries in the order a
+// recursive walk visits them, pathname first; each pathname is malloc'd
+// exits if anything can not be stat'd or listed
+struct walk_entry *walk_tree(char *pathname, size_t *n_entries) {
+    struct walk_node root = { .pathname = strdup(pathname) };
+    if (stat(pathname, &root.stats) != 0) {
+        perror(pathname);
+        exit(1);
+    }
+
+    if (walk_is_directory(&root.stats)) {
+        struct walk walk = {
+            .n_deques = rain_thread_count(),
+        };
+        walk.deques = calloc(walk.n_deques, sizeof *walk.deques);
+        for (size_t i = 0; i < walk.n_deques; i++) {
+            pthread_mutex_init(&walk.deques[i].lock, NULL);
+        }
+        atomic_init(&walk.n_pending, 0);
+        push_directory(&walk, &walk.deques[0], &root);
+
+        // each item is one worker, which runs until the walk is done
+        parallel_for(walk.n_deques, walk_worker, &walk);
+
+        for (size_t i = 0; i < walk.n_deques; i++) {
+            pthread_mutex_destroy(&walk.deques[i].lock);
+            free(walk.deques[i].nodes);
+        }
+        free(walk.deques);
+    }
+
+    struct walk_entry *entries = malloc(count_nodes(&root) * sizeof *entries);
+    *n_entries = 0;
+    flatten(&root, entries, n_entries);
+    return entries;
+}
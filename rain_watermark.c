@@ -0,0 +1,227 @@
+// This file provides the watermark check keeps next to a drop
+//
+// Drops are mostly appended to, so once check --incremental has found
+// every droplet of a drop correct it records how far it got in
+// <drop>.checked, and later incremental checks start from there.  A few
+// bytes at each end of the verified prefix are hashed again as a cheap
+// probe that the drop was not rewritten since; if the probe fails, or
+// --full is given, the whole drop is checked.  Damage in the middle of
+// the prefix which leaves its ends alone is not noticed by the probe,
+// and is trusted until a --full check.
+// The watermark also holds a SHA-256 of the whole verified prefix, as
+// the state of the hash so it can be continued over appended droplets,
+// which --full compares to notice damage the droplet hashes miss.
+//
+// the watermark file is one line of text:
+//     rain-watermark <offset> <n-droplets> <sha256-state> <buffered> <probe>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rain.h"
+
+#define WATERMARK_SUFFIX ".checked"
+#define WATERMARK_MAGIC "rain-watermark"
+
+// bytes at each end of the verified prefix hashed by the probe
+#define WATERMARK_PROBE (64 * 1024)
+
+#define WATERMARK_READ (1024 * 1024)
+
+static char *watermark_pathname(char *drop_pathname) {
+    char *pathname = malloc(strlen(drop_pathname) + sizeof WATERMARK_SUFFIX);
+    strcpy(pathname, drop_pathname);
+    strcat(pathname, WATERMARK_SUFFIX);
+    return pathname;
+}
+
+void remove_watermark(char *drop_pathname) {
+    char *pathname = watermark_pathname(drop_pathname);
+    if (unlink(pathname) != 0 && errno != ENOENT) {
+        perror(pathname);
+        exit(1);
+    }
+    free(pathname);
+}
+
+// adds length bytes at offset of the file open on fd to sha
+void sha256_update_range(struct sha256 *sha, int fd, off_t offset, uint64_t length) {
+    uint8_t *bytes = malloc(length < WATERMARK_READ ? length + 1 : WATERMARK_READ);
+    for (uint64_t done = 0; done < length;) {
+        size_t n = length - done < WATERMARK_READ ? length - done : WATERMARK_READ;
+        if (pread(fd, bytes, n, offset + done) != (ssize_t)n) {
+            perror("partially created droplet/EOF found");
+            exit(1);
+        }
+        sha256_update(sha, bytes, n);
+        done += n;
+    }
+    free(bytes);
+}
+
+// hashes the first and last few bytes of the offset bytes checked
+static void watermark_probe(int fd, off_t offset, uint8_t probe[SHA256_LENGTH]) {
+    struct sha256 sha;
+    sha256_init(&sha);
+    if (offset <= 2 * WATERMARK_PROBE) {
+        sha256_update_range(&sha, fd, 0, offset);
+    } else {
+        sha256_update_range(&sha, fd, 0, WATERMARK_PROBE);
+        sha256_update_range(&sha, fd, offset - WATERMARK_PROBE, WATERMARK_PROBE);
+    }
+    sha256_final(&sha, probe);
+}
+
+static bool parse_hex(const char *text, uint8_t *bytes, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned byte;
+        if (sscanf(text + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        bytes[i] = byte;
+    }
+    return true;
+}
+
+static void print_hex(FILE *output_stream, const uint8_t *bytes, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        fprintf(output_stream, "%02x", bytes[i]);
+    }
+}
+
+// reads the watermark of the drop open on fd and probes whether the drop
+// still matches it
+enum watermark_result load_watermark(char *drop_pathname, int fd, off_t drop_size,
+    struct check_watermark *watermark) {
+    char *pathname = watermark_pathname(drop_pathname);
+    FILE *input_stream = fopen(pathname, "r");
+    free(pathname);
+    if (input_stream == NULL) {
+        return WATERMARK_NONE;
+    }
+
+    intmax_t offset;
+    char state[8 * 8 + 1];
+    char buffered[2 * SHA256_BLOCK + 1];
+    char probe[2 * SHA256_LENGTH + 1];
+    int n_fields = fscanf(input_stream, WATERMARK_MAGIC " %jd %zu %64s %128s %64s",
+        &offset, &watermark->n_droplets, state, buffered, probe);
+    fclose(input_stream);
+    if (n_fields != 5 || offset < 0 || strlen(state) != 8 * 8 || !parse_digest(probe, watermark->probe)) {
+        return WATERMARK_STALE;
+    }
+
+    watermark->offset = offset;
+    struct sha256 *sha = &watermark->prefix_digest;
+    sha256_init(sha);
+    sha->length = offset;
+    sha->n_buffered = offset % SHA256_BLOCK;
+    for (int i = 0; i < 8; i++) {
+        if (sscanf(state + 8 * i, "%8" SCNx32, &sha->state[i]) != 1) {
+            return WATERMARK_STALE;
+        }
+    }
+    // a watermark with no buffered bytes has "-" in their place
+    if (sha->n_buffered == 0 ? strcmp(buffered, "-") != 0 :
+        strlen(buffered) != 2 * sha->n_buffered || !parse_hex(buffered, sha->buffer, sha->n_buffered)) {
+        return WATERMARK_STALE;
+    }
+
+    if (offset > drop_size) {
+        return WATERMARK_STALE;
+    }
+    uint8_t calculated_probe[SHA256_LENGTH];
+    watermark_probe(fd, offset, calculated_probe);
+    if (memcmp(calculated_probe, watermark->probe, SHA256_LENGTH) != 0) {
+        return WATERMARK_STALE;
+    }
+    return WATERMARK_VALID;
+}
+
+// adds length more bytes of the drop open on fd, at the watermark, to
+// its prefix digest, from bytes if they have already been read
+// previous is the watermark of an earlier check, or NULL: when the
+// watermark passes it their prefix digests should match
+// returns false if they don't
+bool advance_watermark(struct check_watermark *watermark, struct check_watermark *previous,
+    int fd, const uint8_t *bytes, uint64_t length) {
+    bool passes_previous = previous != NULL && watermark->offset < previous->offset &&
+        previous->offset <= watermark->offset + (off_t)length;
+    uint64_t n_before = passes_previous ? (uint64_t)(previous->offset - watermark->offset) : length;
+    if (bytes != NULL) {
+        sha256_update(&watermark->prefix_digest, bytes, n_before);
+    } else {
+        sha256_update_range(&watermark->prefix_digest, fd, watermark->offset, n_before);
+    }
+
+    bool matched = true;
+    if (passes_previous) {
+        // finish copies so both can carry on
+        struct sha256 current = watermark->prefix_digest;
+        struct sha256 expected = previous->prefix_digest;
+        uint8_t current_digest[SHA256_LENGTH];
+        uint8_t expected_digest[SHA256_LENGTH];
+        sha256_final(&current, current_digest);
+        sha256_final(&expected, expected_digest);
+        matched = memcmp(current_digest, expected_digest, SHA256_LENGTH) == 0;
+    }
+
+    if (bytes != NULL) {
+        sha256_update(&watermark->prefix_digest, bytes + n_before, length - n_before);
+    } else {
+        sha256_update_range(&watermark->prefix_digest, fd, watermark->offset + n_before, length - n_before);
+    }
+    watermark->offset += length;
+    return matched;
+}
+
+// records that the offset bytes of the drop open on fd are all correct
+// a drop on read-only media simply gets no watermark
+void save_watermark(char *drop_pathname, int fd, struct check_watermark *watermark) {
+    watermark_probe(fd, watermark->offset, watermark->probe);
+
+    char *pathname = watermark_pathname(drop_pathname);
+    char *temp_pathname = malloc(strlen(pathname) + sizeof "-XXXXXX");
+    strcpy(temp_pathname, pathname);
+    strcat(temp_pathname, "-XXXXXX");
+    int temp_fd = mkstemp(temp_pathname);
+    FILE *output_stream = temp_fd < 0 ? NULL : fdopen(temp_fd, "w");
+    if (output_stream == NULL) {
+        if (temp_fd >= 0) {
+            close(temp_fd);
+            unlink(temp_pathname);
+        }
+        free(temp_pathname);
+        free(pathname);
+        return;
+    }
+
+    struct sha256 *sha = &watermark->prefix_digest;
+    fprintf(output_stream, WATERMARK_MAGIC " %jd %zu ", (intmax_t)watermark->offset, watermark->n_droplets);
+    for (int i = 0; i < 8; i++) {
+        fprintf(output_stream, "%08" PRIx32, sha->state[i]);
+    }
+    fputc(' ', output_stream);
+    if (sha->n_buffered == 0) {
+        fputc('-', output_stream);
+    }
+    print_hex(output_stream, sha->buffer, sha->n_buffered);
+    fputc(' ', output_stream);
+    print_hex(output_stream, watermark->probe, SHA256_LENGTH);
+    fputc('\n', output_stream);
+
+    if (fclose(output_stream) != 0 || rename(temp_pathname, pathname) != 0) {
+        unlink(temp_pathname);
+    }
+    free(temp_pathname);
+    free(pathname);
+}
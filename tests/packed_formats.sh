@@ -0,0 +1,62 @@
+#!/bin/sh
+# Checks the packed 6-bit and 7-bit droplet layouts
+#
+# usage: tests/packed_formats.sh [RAIN]
+#
+# The example drops were made by the reference implementation, so
+# creating them again from what they extract to must give the same bytes.
+# Files of every length up to a few packed groups must take
+# ceil(n * bits / 8) bytes, and round-trip through create, check, extract
+# and repack.
+
+set -e
+
+rain=$(realpath "${1:-./rain}")
+examples=$(cd "$(dirname "$0")/../examples" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# example drops holding files only in one format, in the order a walk
+# of their top level gives
+for drop in tiny.6-bit small.6-bit tiny.7-bit small.7-bit text_file.7-bit hello_world.7-bit \
+    2_files.7-bit 3_files.7-bit; do
+    format=${drop##*.}
+    format=${format%-bit}
+    rm -rf "$work/x"
+    mkdir "$work/x"
+    cd "$work/x"
+    "$rain" -x "$examples/$drop.drop" > /dev/null
+    diff -r "$work/x" "$examples/${drop%.*}.d" > /dev/null || fail "$drop.drop does not extract to ${drop%.*}.d"
+    "$rain" -"$format" -c "$work/new.drop" $("$rain" -l "$examples/$drop.drop" | grep -v /) > /dev/null
+    cmp -s "$work/new.drop" "$examples/$drop.drop" || fail "$drop.drop is not created again byte for byte"
+done
+
+# files of 0 to 24 bytes, covering every leftover of bits in the last byte
+text='0123456789 !"#$%&()*+,-./:;<=>?'
+for format in 6 7; do
+    for length in $(seq 0 24); do
+        rm -rf "$work/x" "$work/y"
+        mkdir "$work/x" "$work/y"
+        cd "$work/x"
+        printf '%s' "$text" | head -c "$length" > f
+        "$rain" -"$format" -c "$work/f.drop" f > /dev/null
+        # header of 21 bytes for the pathname f, packed contents, hash
+        expected=$((21 + (length * format + 7) / 8 + 1))
+        size=$(wc -c < "$work/f.drop")
+        [ "$size" -eq "$expected" ] || fail "$length bytes in $format-bit format take $size bytes, not $expected"
+        "$rain" -C "$work/f.drop" | grep -q "^f - correct hash$" || fail "$length bytes in $format-bit format do not check"
+        cd "$work/y"
+        "$rain" -x "$work/f.drop" > /dev/null
+        cmp -s "$work/x/f" "$work/y/f" || fail "$length bytes in $format-bit format do not extract"
+        "$rain" -8 -r "$work/f.drop" "$work/f8.drop" > /dev/null
+        "$rain" -"$format" -r "$work/f8.drop" "$work/back.drop" > /dev/null
+        cmp -s "$work/f.drop" "$work/back.drop" || fail "$length bytes in $format-bit format do not repack back"
+    done
+done
+
+echo "packed formats: all tests passed"